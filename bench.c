@@ -0,0 +1,356 @@
+/*
+ * File:   bench.c
+ *
+ * Benchmark driver.  Every workload runs on a freshly formatted image for
+ * each block size / image size pair and reports throughput, per-operation
+ * latency percentiles and the block I/O it caused.  I/O is counted by
+ * wrapping pread/pwrite/pwritev at link time (see the bench target in the
+ * Makefile), so the counts are the system calls the library really made.
+ *
+ * usage: bench.exe [-b blksz,...] [-s MiB,...] [-n files] [-w workload]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+
+#include "fs.h"
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define MAX_LIST 16
+
+static const char *imgName = "bench.img";
+
+/* I/O accounting */
+
+static uint64_t nsyscalls, nbytes;
+
+ssize_t __real_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t __real_pwrite(int fd, const void *buf, size_t count, off_t offset);
+ssize_t __real_pwritev(int fd, const struct iovec *iov, int iovcnt,
+        off_t offset);
+
+ssize_t __wrap_pread(int fd, void *buf, size_t count, off_t offset) {
+    nsyscalls++;
+    nbytes += count;
+    return __real_pread(fd, buf, count, offset);
+}
+
+ssize_t __wrap_pwrite(int fd, const void *buf, size_t count, off_t offset) {
+    nsyscalls++;
+    nbytes += count;
+    return __real_pwrite(fd, buf, count, offset);
+}
+
+ssize_t __wrap_pwritev(int fd, const struct iovec *iov, int iovcnt,
+        off_t offset) {
+    int i;
+    nsyscalls++;
+    for (i = 0; i < iovcnt; i++) nbytes += iov[i].iov_len;
+    return __real_pwritev(fd, iov, iovcnt, offset);
+}
+
+/* measurement */
+
+struct run {
+    const char *name;
+    uint64_t blksz, fsize;
+    double *lat; /* per-operation latency (us) */
+    size_t ops, cap;
+    uint64_t bytes; /* payload bytes moved by the operations */
+    uint64_t syscalls, iobytes;
+    double start, elapsed;
+};
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void run_begin(struct run *r, const char *name, uint64_t blksz,
+        uint64_t fsize) {
+    memset(r, 0, sizeof (*r));
+    r->name = name;
+    r->blksz = blksz;
+    r->fsize = fsize;
+    nsyscalls = nbytes = 0;
+    r->start = now_us();
+}
+
+static double op_begin(void) {
+    return now_us();
+}
+
+static void op_end(struct run *r, double t0, uint64_t bytes) {
+    if (r->ops == r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 1024;
+        r->lat = realloc(r->lat, r->cap * sizeof (double));
+    }
+    r->lat[r->ops++] = now_us() - t0;
+    r->bytes += bytes;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void run_end(struct run *r) {
+    double secs, p50 = 0, p99 = 0;
+
+    r->elapsed = now_us() - r->start;
+    r->syscalls = nsyscalls;
+    r->iobytes = nbytes;
+    secs = r->elapsed / 1e6;
+    if (r->ops > 0) {
+        qsort(r->lat, r->ops, sizeof (double), cmp_double);
+        p50 = r->lat[r->ops / 2];
+        p99 = r->lat[(r->ops * 99) / 100];
+    }
+    printf("%-12s %6llu %5lluM %7zu %10.0f %8.2f %9.1f %9.1f %8.1f %8.1f\n",
+            r->name, (unsigned long long) r->blksz,
+            (unsigned long long) (r->fsize >> 20), r->ops,
+            r->ops / secs, r->bytes / secs / (1 << 20), p50, p99,
+            r->ops ? (double) r->syscalls / r->ops : 0,
+            r->ops ? (double) r->iobytes / r->blksz / r->ops : 0);
+    free(r->lat);
+}
+
+/* workloads */
+
+static struct superblock *fresh_image(uint64_t blksz, uint64_t fsize) {
+    int fd;
+    unlink(imgName);
+    fd = open(imgName, O_CREAT | O_RDWR, 0644);
+    if (fd < 0 || ftruncate(fd, fsize) != 0) {
+        perror(imgName);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    return fs_format(imgName, blksz);
+}
+
+/* payload with a NUL at the end of every block */
+static char *payload(size_t size, uint64_t blksz) {
+    char *buf = malloc(size + 1);
+    size_t i;
+    for (i = 0; i < size; i++) {
+        buf[i] = ((i + 1) % blksz == 0) ? '\0' : 'a' + i % 26;
+    }
+    buf[size] = '\0';
+    return buf;
+}
+
+static void create_files(struct superblock *sb, struct run *r, int n,
+        size_t size) {
+    char path[64], *buf = payload(size, sb->blksz);
+    int i;
+    fs_mkdir(sb, "/small");
+    for (i = 0; i < n; i++) {
+        sprintf(path, "/small/f%d", i);
+        double t0 = r ? op_begin() : 0;
+        fs_write_file(sb, path, buf, size);
+        if (r) op_end(r, t0, size);
+    }
+    free(buf);
+}
+
+static void wl_create(uint64_t blksz, uint64_t fsize, int n) {
+    struct run r;
+    struct superblock *sb = fresh_image(blksz, fsize);
+    if (!sb) return;
+    run_begin(&r, "create", blksz, fsize);
+    create_files(sb, &r, n, 100);
+    run_end(&r);
+    fs_close(sb);
+}
+
+static void wl_seq(uint64_t blksz, uint64_t fsize, int n) {
+    struct run r;
+    struct superblock *sb = fresh_image(blksz, fsize);
+    size_t size = (fsize / 4) / blksz * blksz;
+    char *buf, *rbuf;
+    double t0;
+    int i, rounds = 4;
+
+    if (!sb) return;
+    buf = payload(size, blksz);
+    rbuf = malloc(size + blksz);
+    run_begin(&r, "seq-write", blksz, fsize);
+    for (i = 0; i < rounds; i++) {
+        t0 = op_begin();
+        fs_write_file(sb, "/big", buf, size);
+        op_end(&r, t0, size);
+        if (i + 1 < rounds) fs_delete_file(sb, "/big");
+    }
+    run_end(&r);
+    run_begin(&r, "seq-read", blksz, fsize);
+    for (i = 0; i < rounds; i++) {
+        t0 = op_begin();
+        fs_read_file(sb, "/big", rbuf, size);
+        op_end(&r, t0, size);
+    }
+    run_end(&r);
+    free(buf);
+    free(rbuf);
+    fs_close(sb);
+}
+
+static void wl_deep(uint64_t blksz, uint64_t fsize, int n) {
+    struct run r;
+    struct superblock *sb = fresh_image(blksz, fsize);
+    char path[512], buf[16];
+    int i, depth = 32;
+
+    if (!sb) return;
+    strcpy(path, "");
+    for (i = 0; i < depth; i++) {
+        sprintf(path + strlen(path), "/d%d", i);
+        fs_mkdir(sb, path);
+    }
+    strcat(path, "/leaf");
+    fs_write_file(sb, path, "leaf", 5);
+    run_begin(&r, "deep-lookup", blksz, fsize);
+    for (i = 0; i < n; i++) {
+        double t0 = op_begin();
+        fs_read_file(sb, path, buf, 5);
+        op_end(&r, t0, 5);
+    }
+    run_end(&r);
+    fs_close(sb);
+}
+
+static void wl_list(uint64_t blksz, uint64_t fsize, int n) {
+    struct run r;
+    struct superblock *sb = fresh_image(blksz, fsize);
+    size_t count;
+    int i;
+
+    if (!sb) return;
+    create_files(sb, NULL, n, 16);
+    run_begin(&r, "list-huge", blksz, fsize);
+    for (i = 0; i < MAX_LIST; i++) {
+        double t0 = op_begin();
+        struct fs_dirent *ents = fs_list_dir_plus(sb, "/small", &count);
+        op_end(&r, t0, 0);
+        fs_free_dirents(ents, count);
+    }
+    run_end(&r);
+    fs_close(sb);
+}
+
+static void wl_delete(uint64_t blksz, uint64_t fsize, int n) {
+    struct run r;
+    struct superblock *sb = fresh_image(blksz, fsize);
+    char path[64];
+    int i;
+
+    if (!sb) return;
+    create_files(sb, NULL, n, 100);
+    run_begin(&r, "delete", blksz, fsize);
+    for (i = 0; i < n; i++) {
+        sprintf(path, "/small/f%d", i);
+        double t0 = op_begin();
+        fs_delete_file(sb, path);
+        op_end(&r, t0, 0);
+    }
+    run_end(&r);
+    fs_close(sb);
+}
+
+static void wl_mixed(uint64_t blksz, uint64_t fsize, int n) {
+    struct run r;
+    struct superblock *sb = fresh_image(blksz, fsize);
+    char path[64], *buf, *rbuf;
+    uint32_t seed = 12345;
+    int i, created = n / 2;
+    size_t size = 1000;
+
+    if (!sb) return;
+    create_files(sb, NULL, created, size);
+    buf = payload(size, blksz);
+    rbuf = malloc(size + blksz);
+    run_begin(&r, "mixed-70/30", blksz, fsize);
+    for (i = 0; i < n; i++) {
+        seed = seed * 1103515245 + 12345;
+        double t0 = op_begin();
+        if ((seed >> 16) % 10 < 7) {
+            sprintf(path, "/small/f%u", (seed >> 8) % created);
+            fs_read_file(sb, path, rbuf, size);
+        } else {
+            sprintf(path, "/small/f%d", created++);
+            fs_write_file(sb, path, buf, size);
+        }
+        op_end(&r, t0, size);
+    }
+    run_end(&r);
+    free(buf);
+    free(rbuf);
+    fs_close(sb);
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(uint64_t blksz, uint64_t fsize, int n);
+} workloads[] = {
+    {"create", wl_create},
+    {"seq", wl_seq},
+    {"deep", wl_deep},
+    {"list", wl_list},
+    {"delete", wl_delete},
+    {"mixed", wl_mixed},
+};
+
+static size_t parse_list(char *arg, uint64_t *out, uint64_t scale) {
+    size_t n = 0;
+    char *tok;
+    for (tok = strtok(arg, ","); tok && n < MAX_LIST; tok = strtok(NULL, ",")) {
+        out[n++] = strtoull(tok, NULL, 10) * scale;
+    }
+    return n;
+}
+
+int main(int argc, char **argv) {
+    uint64_t blkszs[MAX_LIST] = {512, 4096};
+    uint64_t fsizes[MAX_LIST] = {16 << 20, 64 << 20};
+    size_t nb = 2, ns = 2, i, j, k;
+    const char *only = NULL;
+    int opt, n = 2000;
+
+    while ((opt = getopt(argc, argv, "b:s:n:w:")) != -1) {
+        switch (opt) {
+            case 'b': nb = parse_list(optarg, blkszs, 1);
+                break;
+            case 's': ns = parse_list(optarg, fsizes, 1 << 20);
+                break;
+            case 'n': n = atoi(optarg);
+                break;
+            case 'w': only = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-b blksz,...] [-s MiB,...] "
+                        "[-n files] [-w workload]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("%-12s %6s %6s %7s %10s %8s %9s %9s %8s %8s\n", "workload",
+            "blksz", "image", "ops", "ops/s", "MB/s", "p50(us)", "p99(us)",
+            "sys/op", "blk/op");
+    for (k = 0; k < NELEMS(workloads); k++) {
+        if (only && strcmp(only, workloads[k].name) != 0) continue;
+        for (i = 0; i < nb; i++) {
+            for (j = 0; j < ns; j++) {
+                workloads[k].fn(blkszs[i], fsizes[j], n);
+            }
+        }
+    }
+    unlink(imgName);
+    return EXIT_SUCCESS;
+}
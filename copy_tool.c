@@ -0,0 +1,473 @@
+/*
+ * File:   copy_tool.c
+ *
+ * Copies a host directory tree into the root of an image, or with -x the
+ * tree of an image out to a host directory, as a pipeline of three stages:
+ * one lists the source tree, -j threads read file contents and the last
+ * stage writes them out.  Stages hand batches to each other through queues
+ * of at most -q batches, so a slow stage stalls the ones before it rather
+ * than letting them fill memory.  Files under SMALL_FILE bytes travel in
+ * batches of up to BATCH_FILES files and BATCH_BYTES bytes; a larger file
+ * is a batch of its own and is held in memory whole.  Directories are made
+ * as they are listed, ahead of the files they hold.
+ *
+ * The library's mutating calls must not run concurrently, so on import one
+ * thread makes every fs_mkdir and fs_write_file call, which is also where
+ * blocks are allocated; it gets whole batches ready to write while the
+ * readers fetch the next ones.  On export the image is opened shared with
+ * its namespace preloaded and -j threads write the host files.  -c stores
+ * imported files compressed.  Exit status: 0 when everything was copied,
+ * 1 when some entries failed (each is reported on stderr), 8 when the copy
+ * could not run.
+ *
+ * usage: fscopy.exe [-x] [-c] [-j threads] [-q depth] image dir
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "fs.h"
+
+#define SMALL_FILE (64 << 10)
+#define BATCH_FILES 64
+#define BATCH_BYTES (1 << 20)
+
+struct item {
+    char *path; /* from the root of the tree, starting with a slash */
+    uint64_t size;
+    uint64_t off; /* of the contents in the batch buffer */
+    int err; /* errno of a failed read */
+};
+
+struct batch {
+    int isDir; /* directories to make on import, which have no contents */
+    int n, cap;
+    struct item *items;
+    uint64_t bytes;
+    char *buf;
+};
+
+struct queue {
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty, notFull;
+    struct batch **v;
+    int cap, head, n;
+    int producers; /* pops return NULL once these are done and it is empty */
+};
+
+struct copy {
+    struct superblock *sb;
+    const char *dir; /* the host directory */
+    int exporting;
+    int flags; /* FS_WRITE_* flags of imported files */
+    struct queue readQ, writeQ;
+    pthread_mutex_t lock; /* guards =open and the counters */
+    struct batch *open; /* small files not queued yet */
+    uint64_t files, dirs, bytes, failed;
+};
+
+static void queueInit(struct queue *q, int cap, int producers) {
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->notEmpty, NULL);
+    pthread_cond_init(&q->notFull, NULL);
+    q->v = malloc(cap * sizeof (struct batch *));
+    q->cap = cap;
+    q->head = q->n = 0;
+    q->producers = producers;
+}
+
+static void queueDestroy(struct queue *q) {
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->notEmpty);
+    pthread_cond_destroy(&q->notFull);
+    free(q->v);
+}
+
+static void queuePush(struct queue *q, struct batch *b) {
+    pthread_mutex_lock(&q->lock);
+    while (q->n == q->cap) pthread_cond_wait(&q->notFull, &q->lock);
+    q->v[(q->head + q->n++) % q->cap] = b;
+    pthread_cond_signal(&q->notEmpty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static struct batch *queuePop(struct queue *q) {
+    struct batch *b = NULL;
+    pthread_mutex_lock(&q->lock);
+    while (q->n == 0 && q->producers > 0) {
+        pthread_cond_wait(&q->notEmpty, &q->lock);
+    }
+    if (q->n > 0) {
+        b = q->v[q->head];
+        q->head = (q->head + 1) % q->cap;
+        q->n--;
+        pthread_cond_signal(&q->notFull);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return b;
+}
+
+/* one of the producers of =q is done */
+static void queueDone(struct queue *q) {
+    pthread_mutex_lock(&q->lock);
+    if (--q->producers == 0) pthread_cond_broadcast(&q->notEmpty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static struct batch *newBatch(int isDir) {
+    struct batch *b = calloc(1, sizeof (struct batch));
+    b->isDir = isDir;
+    return b;
+}
+
+static void addItem(struct batch *b, const char *path, uint64_t size) {
+    if (b->n == b->cap) {
+        b->cap = b->cap ? 2 * b->cap : 8;
+        b->items = realloc(b->items, b->cap * sizeof (struct item));
+    }
+    b->items[b->n].path = strdup(path);
+    b->items[b->n].size = size;
+    b->items[b->n].off = b->bytes;
+    b->items[b->n].err = 0;
+    b->n++;
+    b->bytes += size;
+}
+
+static void freeBatch(struct batch *b) {
+    int i;
+    for (i = 0; i < b->n; i++) free(b->items[i].path);
+    free(b->items);
+    free(b->buf);
+    free(b);
+}
+
+static char *joinPath(const char *dir, const char *name) {
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    int slash = (dlen == 0 || dir[dlen - 1] != '/');
+    char *path = malloc(dlen + slash + nlen + 1);
+    memcpy(path, dir, dlen);
+    if (slash) path[dlen] = '/';
+    memcpy(path + dlen + slash, name, nlen + 1);
+    return path;
+}
+
+static char *hostPath(const struct copy *c, const char *path) {
+    return joinPath(c->dir, path + (path[0] == '/'));
+}
+
+static void report(struct copy *c, const char *path, int err) {
+    fprintf(stderr, "%s: %s\n", path, strerror(err));
+    pthread_mutex_lock(&c->lock);
+    c->failed++;
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void count(struct copy *c, uint64_t *counter, uint64_t n) {
+    pthread_mutex_lock(&c->lock);
+    *counter += n;
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* queues the file at =path for reading, with other small ones */
+static void addFile(struct copy *c, const char *path, uint64_t size) {
+    struct batch *full = NULL;
+
+    if (size >= SMALL_FILE) {
+        full = newBatch(0);
+        addItem(full, path, size);
+        queuePush(&c->readQ, full);
+        return;
+    }
+    pthread_mutex_lock(&c->lock);
+    if (c->open != NULL && (c->open->n == BATCH_FILES ||
+            c->open->bytes + size > BATCH_BYTES)) {
+        full = c->open;
+        c->open = NULL;
+    }
+    if (c->open == NULL) c->open = newBatch(0);
+    addItem(c->open, path, size);
+    pthread_mutex_unlock(&c->lock);
+    if (full != NULL) queuePush(&c->readQ, full);
+}
+
+/* queues the small files left over once the source tree is listed */
+static void flushFiles(struct copy *c) {
+    if (c->open != NULL) queuePush(&c->readQ, c->open);
+    c->open = NULL;
+}
+
+/* lists the host directory at =path of the tree, depth first */
+static void scanHost(struct copy *c, const char *path) {
+    char *host = hostPath(c, path), *child, *hostChild;
+    struct dirent *de;
+    struct stat st;
+    struct batch *b;
+    DIR *d = opendir(host);
+
+    if (d == NULL) {
+        report(c, host, errno);
+        free(host);
+        return;
+    }
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        child = joinPath(path, de->d_name);
+        hostChild = hostPath(c, child);
+        if (lstat(hostChild, &st) != 0) {
+            report(c, hostChild, errno);
+        } else if (S_ISDIR(st.st_mode)) {
+            /* straight to the writer, which gets it before any file read
+             * from below it */
+            b = newBatch(1);
+            addItem(b, child, 0);
+            queuePush(&c->writeQ, b);
+            scanHost(c, child);
+        } else if (S_ISREG(st.st_mode)) {
+            addFile(c, child, st.st_size);
+        } else {
+            report(c, hostChild, ENOTSUP); //links, devices and the like
+        }
+        free(child);
+        free(hostChild);
+    }
+    closedir(d);
+    free(host);
+}
+
+static int exportEntry(const char *path, const struct fs_dirent *ent,
+        void *arg) {
+    struct copy *c = arg;
+    char *host;
+
+    if (ent->mode != IMDIR) {
+        addFile(c, path, ent->size);
+        return 0;
+    }
+    /* the walk lists a directory's entries only after this returns */
+    host = hostPath(c, path);
+    if (mkdir(host, 0755) != 0 && errno != EEXIST) {
+        report(c, host, errno);
+        free(host);
+        return FS_WALK_SKIP;
+    }
+    count(c, &c->dirs, 1);
+    free(host);
+    return 0;
+}
+
+static void readHost(struct copy *c, struct item *it, char *buf) {
+    char *host = hostPath(c, it->path);
+    uint64_t done = 0;
+    ssize_t r = 0;
+    int fd = open(host, O_RDONLY);
+
+    if (fd < 0) {
+        it->err = errno;
+        free(host);
+        return;
+    }
+    while (done < it->size &&
+            (r = read(fd, buf + it->off + done, it->size - done)) > 0) {
+        done += r;
+    }
+    if (r < 0) it->err = errno;
+    it->size = done; //it may have shrunk since it was listed
+    close(fd);
+    free(host);
+}
+
+static void readImage(struct copy *c, struct item *it, char *buf) {
+    ssize_t r = fs_read_file(c->sb, it->path, buf + it->off, it->size);
+    if (r < 0) {
+        it->err = errno;
+    } else {
+        it->size = r;
+    }
+}
+
+static void *readStage(void *arg) {
+    struct copy *c = arg;
+    struct batch *b;
+    int i;
+
+    while ((b = queuePop(&c->readQ)) != NULL) {
+        b->buf = malloc(b->bytes ? b->bytes : 1);
+        for (i = 0; i < b->n; i++) {
+            if (c->exporting) {
+                readImage(c, &b->items[i], b->buf);
+            } else {
+                readHost(c, &b->items[i], b->buf);
+            }
+        }
+        queuePush(&c->writeQ, b);
+    }
+    queueDone(&c->writeQ);
+    return NULL;
+}
+
+static int writeHost(struct copy *c, const struct item *it, const char *buf) {
+    char *host = hostPath(c, it->path);
+    uint64_t done = 0;
+    ssize_t r = 0;
+    int fd = open(host, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        report(c, host, errno);
+        free(host);
+        return -1;
+    }
+    while (done < it->size &&
+            (r = write(fd, buf + it->off + done, it->size - done)) > 0) {
+        done += r;
+    }
+    if (r < 0 || close(fd) != 0) {
+        report(c, host, errno);
+        free(host);
+        return -1;
+    }
+    free(host);
+    return 0;
+}
+
+static int writeImage(struct copy *c, struct batch *b, const struct item *it) {
+    if (b->isDir) {
+        if (fs_mkdir(c->sb, it->path) != 0 && errno != EEXIST) {
+            report(c, it->path, errno);
+            return -1;
+        }
+        return 0;
+    }
+    if (fs_write_file_flags(c->sb, it->path, b->buf + it->off, it->size,
+            c->flags) != 0) {
+        report(c, it->path, errno);
+        return -1;
+    }
+    return 0;
+}
+
+static void *writeStage(void *arg) {
+    struct copy *c = arg;
+    struct batch *b;
+    int i;
+
+    while ((b = queuePop(&c->writeQ)) != NULL) {
+        for (i = 0; i < b->n; i++) {
+            struct item *it = &b->items[i];
+            if (it->err != 0) {
+                report(c, it->path, it->err);
+            } else if ((c->exporting ? writeHost(c, it, b->buf) :
+                    writeImage(c, b, it)) == 0) {
+                if (b->isDir) {
+                    count(c, &c->dirs, 1);
+                } else {
+                    count(c, &c->files, 1);
+                    count(c, &c->bytes, it->size);
+                }
+            }
+        }
+        freeBatch(b);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    struct copy c;
+    struct timespec t0, t1;
+    pthread_t *readers, *writers;
+    int opt, i, r = 0, nthreads = 4, depth = 16, nwriters;
+
+    memset(&c, 0, sizeof (c));
+    while ((opt = getopt(argc, argv, "xcj:q:")) != -1) {
+        switch (opt) {
+            case 'x': c.exporting = 1;
+                break;
+            case 'c': c.flags |= FS_WRITE_COMPRESS;
+                break;
+            case 'j': nthreads = atoi(optarg);
+                break;
+            case 'q': depth = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-x] [-c] [-j threads] [-q depth] "
+                        "image dir\n", argv[0]);
+                return 8;
+        }
+    }
+    if (optind != argc - 2 || nthreads < 1 || depth < 1) {
+        fprintf(stderr, "usage: %s [-x] [-c] [-j threads] [-q depth] "
+                "image dir\n", argv[0]);
+        return 8;
+    }
+    c.dir = argv[optind + 1];
+    if (c.exporting) {
+        if (mkdir(c.dir, 0755) != 0 && errno != EEXIST) {
+            perror(c.dir);
+            return 8;
+        }
+        c.sb = fs_open_flags(argv[optind], FS_OPEN_SHARED | FS_OPEN_PRELOAD);
+    } else {
+        c.sb = fs_open(argv[optind]);
+    }
+    if (c.sb == NULL) {
+        perror(argv[optind]);
+        return 8;
+    }
+
+    /* on import the lister also queues directories for the writer */
+    nwriters = c.exporting ? nthreads : 1;
+    pthread_mutex_init(&c.lock, NULL);
+    queueInit(&c.readQ, depth, 1);
+    queueInit(&c.writeQ, depth, nthreads + !c.exporting);
+    readers = malloc(nthreads * sizeof (pthread_t));
+    writers = malloc(nwriters * sizeof (pthread_t));
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < nthreads; i++) {
+        pthread_create(&readers[i], NULL, readStage, &c);
+    }
+    for (i = 0; i < nwriters; i++) {
+        pthread_create(&writers[i], NULL, writeStage, &c);
+    }
+
+    if (c.exporting) {
+        if (fs_walk(c.sb, "/", exportEntry, &c, nthreads) != 0) {
+            perror("walk");
+            r = 8;
+        }
+    } else {
+        scanHost(&c, "");
+    }
+    flushFiles(&c);
+    queueDone(&c.readQ);
+    if (!c.exporting) queueDone(&c.writeQ);
+
+    for (i = 0; i < nthreads; i++) pthread_join(readers[i], NULL);
+    for (i = 0; i < nwriters; i++) pthread_join(writers[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (fs_close(c.sb) != 0) {
+        perror(argv[optind]);
+        r = 8;
+    }
+    printf("%s: %llu files, %llu directories, %llu bytes%s (%.3fs)\n",
+            c.exporting ? c.dir : argv[optind],
+            (unsigned long long) c.files, (unsigned long long) c.dirs,
+            (unsigned long long) c.bytes, c.failed ? ", some failed" : "",
+            (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+
+    queueDestroy(&c.readQ);
+    queueDestroy(&c.writeQ);
+    pthread_mutex_destroy(&c.lock);
+    free(readers);
+    free(writers);
+    if (r == 0 && c.failed) r = 1;
+    return r;
+}
@@ -0,0 +1,124 @@
+/*
+ * File:   crc32c.c
+ *
+ * CRC-32C with a hardware path and a slicing-by-8 table fallback.  The
+ * hardware path runs three independent crc32 streams over the thirds of
+ * each 3 * STRIDE byte chunk so the instruction's latency is hidden, then
+ * merges the partial CRCs by shifting them through zero bytes with tables
+ * built for that purpose.
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#include "crc32c.h"
+
+#define POLY 0x82f63b78 /* reflected Castagnoli polynomial */
+/* bytes per hardware stream: the checksummed part of a 4 KiB block is
+ * three strides and 12 bytes */
+#define STRIDE 1360
+
+static uint32_t table[8][256];
+/* shift[k][b]: CRC state after feeding byte b followed by STRIDE zero
+ * bytes, split per byte of the state (k) */
+static uint32_t shift[4][256];
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static int hasSSE42;
+
+static uint32_t crcZeros(uint32_t crc, size_t n) {
+    while (n--) crc = (crc >> 8) ^ table[0][crc & 0xff];
+    return crc;
+}
+
+static void init(void) {
+    uint32_t i, j, crc;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++) crc = (crc >> 1) ^ (POLY & (0 - (crc & 1)));
+        table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++) {
+            table[j][i] = (table[j - 1][i] >> 8) ^ table[0][table[j - 1][i] & 0xff];
+        }
+    }
+    /* the shift is linear in the state, so it is tabulated per byte */
+    for (j = 0; j < 4; j++) {
+        for (i = 0; i < 256; i++) shift[j][i] = crcZeros(i << (8 * j), STRIDE);
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    hasSSE42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t shiftCrc(uint32_t crc) {
+    return shift[0][crc & 0xff] ^ shift[1][(crc >> 8) & 0xff] ^
+            shift[2][(crc >> 16) & 0xff] ^ shift[3][crc >> 24];
+}
+
+static uint32_t crcSoft(uint32_t crc, const unsigned char* p, size_t len) {
+    uint64_t w;
+
+    while (len && ((uintptr_t) p & 7)) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+        len--;
+    }
+    while (len >= 8) {
+        memcpy(&w, p, 8);
+        w ^= crc;
+        crc = table[7][w & 0xff] ^ table[6][(w >> 8) & 0xff] ^
+                table[5][(w >> 16) & 0xff] ^ table[4][(w >> 24) & 0xff] ^
+                table[3][(w >> 32) & 0xff] ^ table[2][(w >> 40) & 0xff] ^
+                table[1][(w >> 48) & 0xff] ^ table[0][w >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crcHard(uint32_t crc, const unsigned char* p, size_t len) {
+    uint64_t c0 = crc, c1, c2, w0, w1, w2;
+    size_t i;
+
+    while (len && ((uintptr_t) p & 7)) {
+        c0 = __builtin_ia32_crc32qi((uint32_t) c0, *p++);
+        len--;
+    }
+    while (len >= 3 * STRIDE) {
+        c1 = c2 = 0;
+        for (i = 0; i < STRIDE; i += 8) {
+            memcpy(&w0, p + i, 8);
+            memcpy(&w1, p + STRIDE + i, 8);
+            memcpy(&w2, p + 2 * STRIDE + i, 8);
+            c0 = __builtin_ia32_crc32di(c0, w0);
+            c1 = __builtin_ia32_crc32di(c1, w1);
+            c2 = __builtin_ia32_crc32di(c2, w2);
+        }
+        c0 = shiftCrc(shiftCrc((uint32_t) c0) ^ (uint32_t) c1) ^ (uint32_t) c2;
+        p += 3 * STRIDE;
+        len -= 3 * STRIDE;
+    }
+    while (len >= 8) {
+        memcpy(&w0, p, 8);
+        c0 = __builtin_ia32_crc32di(c0, w0);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) c0 = __builtin_ia32_crc32qi((uint32_t) c0, *p++);
+    return (uint32_t) c0;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len) {
+    pthread_once(&once, init);
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (hasSSE42) return ~crcHard(crc, buf, len);
+#endif
+    return ~crcSoft(crc, buf, len);
+}
@@ -0,0 +1,26 @@
+/* 
+ * File:   crc32c.h
+ *
+ * CRC-32C (Castagnoli), the checksum of iSCSI, ext4 and btrfs.
+ */
+
+#ifndef CRC32C_H
+#define	CRC32C_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <inttypes.h>
+
+    /* CRC-32C of =len bytes at =buf, continuing from =crc (zero to start).
+     * Uses the SSE4.2 crc32 instruction when the CPU has it. */
+    uint32_t crc32c(uint32_t crc, const void* buf, size_t len);
+
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* CRC32C_H */
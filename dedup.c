@@ -0,0 +1,119 @@
+/*
+ * File:   dedup.c
+ *
+ * Content-addressed sharing of data blocks (FS_FEAT_DEDUP).  The index at
+ * =dedup is a table with one slot per block of the image; the last data
+ * block written whose content hashes to h is remembered in slot h % blks.
+ * Slots are only hints: a candidate is compared byte for byte before it is
+ * shared, and the slot of a data block is cleared before the block is
+ * freed, so a slot never points at a block that no longer holds that data.
+ * Sharing goes through the reference counts of snapshots (see snapshot.c),
+ * so a shared block is freed with its last reference.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs.h"
+#include "utils.h"
+#include "crc32c.h"
+
+/* references a block may gain from dedup.  copies made for snapshots add
+ * one each on top, up to the 255 the table can count; past that the copy
+ * fails with EMLINK (see copyEntity) */
+#define DEDUP_MAX_REFS 128
+
+/* 64 bits from two CRC-32C streams, which run on the hardware crc32
+ * instruction where there is one */
+static uint64_t blockHash(const struct superblock *sb, const void *n) {
+    size_t half = sb->blksz / 2;
+    return (uint64_t) crc32c(0, n, half) << 32 |
+            crc32c(0, (const char *) n + half, sb->blksz - half);
+}
+
+/* reads the index block holding the slot for =hash */
+static uint64_t *indexBlock(const struct superblock *sb, const uint64_t hash,
+        uint64_t *tblock, uint64_t *slot) {
+    uint64_t per = (sb->blksz - getCsumLen(sb)) / sizeof (uint64_t);
+    uint64_t i = hash % sb->blks, *table = malloc(sb->blksz);
+    *tblock = sb->dedup + i / per;
+    *slot = i % per;
+    seek_read(sb, *tblock, table);
+    return table;
+}
+
+/**
+ * Looks for a data block holding the =blksz bytes at =n.
+ * @return the block, or zero if there is none that may gain a reference
+ */
+uint64_t dedupLookup(const struct superblock *sb, const void *n) {
+    uint64_t tblock, slot, block;
+    uint64_t *table = indexBlock(sb, blockHash(sb, n), &tblock, &slot);
+    char *buf;
+
+    block = table[slot];
+    free(table);
+    if (block == 0 || block >= sb->blks || getRefs(sb, block) >= DEDUP_MAX_REFS) {
+        return 0;
+    }
+    buf = malloc(sb->blksz);
+    seek_read_kind(sb, block, buf, FS_BLK_DATA);
+    if (memcmp(buf, n, sb->blksz) != 0) block = 0;
+    free(buf);
+    return block;
+}
+
+/* remembers that the data block =block holds the =blksz bytes at =n */
+void dedupInsert(const struct superblock *sb, const uint64_t block,
+        const void *n) {
+    uint64_t tblock, slot;
+    uint64_t *table = indexBlock(sb, blockHash(sb, n), &tblock, &slot);
+    if (table[slot] != block) {
+        table[slot] = block;
+        seek_write(sb, tblock, table);
+    }
+    free(table);
+}
+
+/* longest run of adjacent blocks dedupForget reads with a single call */
+#define FORGET_RUN 64
+
+/* clears the slots pointing at the =count data blocks at =blocks, which are
+ * about to be freed.  they may hold anything, so they are read raw; blocks
+ * following each other on disk are read together. */
+void dedupForget(const struct superblock *sb, const uint64_t *blocks,
+        const size_t count) {
+    char *buf = malloc(FORGET_RUN * sb->blksz);
+    uint64_t tblock, slot, *table;
+    size_t i, k, run;
+
+    for (i = 0; i < count; i += run) {
+        for (run = 1; i + run < count && run < FORGET_RUN &&
+                blocks[i + run] == blocks[i + run - 1] + 1; run++);
+        if (blockIO(sb, FALSE, buf, run * sb->blksz, blocks[i]) !=
+                run * sb->blksz) continue;
+        statsIO(sb, FS_BLK_DATA, FALSE, run);
+        TRACE(sb, FS_TR_READ, FS_BLK_DATA, blocks[i], run);
+        FOR_EACH(k, run) {
+            table = indexBlock(sb, blockHash(sb, buf + k * sb->blksz),
+                    &tblock, &slot);
+            if (table[slot] == blocks[i + k]) {
+                table[slot] = 0;
+                seek_write(sb, tblock, table);
+            }
+            free(table);
+        }
+    }
+    free(buf);
+}
+
+/* empties the index, whose slots move when the image changes size */
+void dedupReset(const struct superblock *sb) {
+    uint64_t i, n = getTableBlocks(sb, sb->blks, sizeof (uint64_t));
+    char *zero = malloc(sb->blksz);
+    FOR_EACH(i, n) {
+        memset(zero, 0, sb->blksz);
+        seek_write(sb, sb->dedup + i, zero);
+    }
+    free(zero);
+}
@@ -0,0 +1,427 @@
+/*
+ * File:   defrag.c
+ *
+ * Defragmentation and compaction.  fs_get_block hands out the head of the
+ * free list, where frees push blocks in LIFO order, so after some churn
+ * the inodes and data of an entity end up scattered.  fs_defrag walks the
+ * tree depth first and copies every scattered entity into one run of
+ * adjacent free blocks, taken from a map of free space built when the call
+ * starts.  The blocks of an entity are only referenced from one place (its
+ * link in the parent directory, or the superblock for the root and the
+ * snapshot directory) and from the back pointers of its own inodes and
+ * children, so a move rewrites those and frees the old blocks.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "fs.h"
+#include "utils.h"
+
+struct defrag_ctx {
+    struct superblock *sb;
+    struct fs_defrag_report *rep;
+    int flags;
+    uint64_t deadline; /* CLOCK_MONOTONIC ns, or zero */
+    uint64_t ordinal; /* entities reached by this pass so far */
+    uint8_t *isFree; /* see getFreeMap */
+    int stopped;
+};
+
+static uint64_t nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Lists the blocks of the entity at =head in the order a move lays them
+ * out: each inode followed, for the first one, by the nodeinfo and, for
+ * files, by the data blocks it links to (holes take no block).
+ * @param ctx the pass
+ * @param head first inode of the entity
+ * @param layout receives the blocks
+ * @param kinds receives FS_BLK_META or FS_BLK_DATA for each block
+ * @return FALSE if the entity shares blocks with a snapshot and cannot move
+ */
+static int entityLayout(struct defrag_ctx *ctx, const uint64_t head,
+        struct blocklist *layout, struct blocklist *kinds) {
+    const struct superblock *sb = ctx->sb;
+    struct inode *node = malloc(sb->blksz);
+    uint64_t cur = head, prev = 0;
+    int i, movable = (getRefs(sb, head) == 0);
+    int maxLinks = getLinksMaxLen(sb);
+
+    while (movable && cur != 0) {
+        seek_read(sb, cur, node);
+        pushBlock(layout, cur);
+        pushBlock(kinds, FS_BLK_META);
+        if (prev == 0) {
+            pushBlock(layout, node->meta);
+            pushBlock(kinds, FS_BLK_META);
+        } else if (node->meta != prev) {
+            movable = FALSE; //older images kept a nodeinfo copy here
+        }
+        for (i = 0; i < maxLinks && node->links[i] != 0 &&
+                !(node->mode & IMDIR); i++) {
+            if (node->links[i] == FS_HOLE) continue;
+            if (getRefs(sb, node->links[i]) != 0) movable = FALSE;
+            pushBlock(layout, node->links[i]);
+            pushBlock(kinds, FS_BLK_DATA);
+        }
+        prev = cur;
+        cur = node->next;
+    }
+    free(node);
+    return movable;
+}
+
+static int isContiguous(const struct blocklist *layout) {
+    size_t i;
+    for (i = 1; i < layout->n; i++) {
+        if (layout->v[i] != layout->v[0] + i) return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * Copies the entity at =head, laid out as =layout, to the free run at
+ * =start and switches its link in =dir (or in the superblock) to the copy.
+ * @return the first inode of the copy, or =head if a block failed to read
+ */
+static uint64_t moveEntity(struct defrag_ctx *ctx, const uint64_t dir,
+        const uint64_t head, struct blocklist *layout,
+        const struct blocklist *kinds, const uint64_t start) {
+    struct superblock *sb = ctx->sb;
+    size_t i, run, n = layout->n;
+    char *buf = malloc(n * sb->blksz);
+    struct inode *node;
+    struct blocklist children;
+    uint64_t prev = 0;
+    int k, maxLinks = getLinksMaxLen(sb);
+
+    FOR_EACH(i, n) {
+        seek_read_kind(sb, layout->v[i], buf + i * sb->blksz, kinds->v[i]);
+    }
+    if (opFailed()) {
+        free(buf);
+        return head;
+    }
+    takeRun(sb, start, n);
+    memset(ctx->isFree + start, 0, n);
+
+    /* point the copied inodes at each other */
+    initBlockList(&children);
+    for (i = 0; i < n;) {
+        uint64_t self = start + i;
+        node = (struct inode *) (buf + i++ * sb->blksz);
+        if (!(node->mode & IMCHILD)) {
+            if (node->parent == head) node->parent = self;
+            node->meta = start + i++;
+        } else {
+            node->meta = prev;
+            node->parent = start;
+        }
+        for (k = 0; k < maxLinks && node->links[k] != 0; k++) {
+            if (node->mode & IMDIR) {
+                pushBlock(&children, node->links[k]);
+            } else if (node->links[k] != FS_HOLE) {
+                node->links[k] = start + i++;
+            }
+        }
+        if (node->next != 0) node->next = start + i;
+        prev = self;
+    }
+    for (i = 0; i < n; i += run) {
+        for (run = 1; i + run < n && kinds->v[i + run] == kinds->v[i]; run++);
+        seek_write_blocks(sb, start + i, run, buf + i * sb->blksz,
+                kinds->v[i]);
+    }
+
+    if (head == sb->root) {
+        sb->root = start;
+        writeSuper(sb);
+    } else if (head == sb->snapshots) {
+        sb->snapshots = start;
+        writeSuper(sb);
+    } else {
+        replaceInDir(sb, dir, head, start, NULL);
+    }
+    node = (struct inode *) buf;
+    FOR_EACH(i, children.n) {
+        seek_read(sb, children.v[i], node);
+        if (node->parent != head) continue; //shared, owned by another copy
+        node->parent = start;
+        seek_write(sb, children.v[i], node);
+    }
+    /* the slots of the old data blocks move to the copies, whose content
+     * is still at hand */
+    if (sb->features & FS_FEAT_DEDUP) {
+        FOR_EACH(i, n) {
+            if (kinds->v[i] != FS_BLK_DATA) continue;
+            dedupInsert(sb, start + i, buf + i * sb->blksz);
+        }
+    }
+    FOR_EACH(i, n) ctx->isFree[layout->v[i]] = 1;
+    putBlocks(sb, layout->v, n);
+
+    ctx->rep->moved++;
+    ctx->rep->blocks += n;
+    freeBlockList(&children);
+    free(buf);
+    return start;
+}
+
+/* moves the entity at =head if it is scattered or, when compacting, if it
+ * fits lower; returns its (possibly new) first inode */
+static uint64_t defragEntity(struct defrag_ctx *ctx, const uint64_t dir,
+        const uint64_t head) {
+    const struct superblock *sb = ctx->sb;
+    struct blocklist layout, kinds;
+    uint64_t start = 0, block = head;
+    int contiguous;
+
+    initBlockList(&layout);
+    initBlockList(&kinds);
+    if (!entityLayout(ctx, head, &layout, &kinds)) {
+        ctx->rep->skipped++;
+    } else {
+        contiguous = isContiguous(&layout);
+        if (!contiguous) {
+            start = findFreeRun(sb, ctx->isFree, layout.n, sb->blks);
+            if (start == 0) ctx->rep->skipped++;
+        } else if (ctx->flags & FS_DEFRAG_COMPACT) {
+            start = findFreeRun(sb, ctx->isFree, layout.n, layout.v[0]);
+        }
+        if (start != 0) {
+            block = moveEntity(ctx, dir, head, &layout, &kinds, start);
+        }
+    }
+    freeBlockList(&layout);
+    freeBlockList(&kinds);
+    return block;
+}
+
+/* handles the entity at =head, listed in =dir, and everything below it */
+static void defragTree(struct defrag_ctx *ctx, const uint64_t dir,
+        uint64_t head) {
+    struct superblock *sb = ctx->sb;
+    struct inode *node;
+    struct blocklist children;
+    uint64_t cur;
+    size_t i;
+    int k, maxLinks = getLinksMaxLen(sb), examined;
+
+    if (ctx->stopped) return;
+    /* entities before the cursor were handled by the previous call */
+    examined = ctx->ordinal++ >= sb->state->defragCursor;
+    if (examined) {
+        head = defragEntity(ctx, dir, head);
+        if (opFailed() ||
+                (ctx->deadline != 0 && nowNs() >= ctx->deadline)) {
+            ctx->stopped = TRUE;
+            return;
+        }
+    }
+
+    node = malloc(sb->blksz);
+    seek_read(sb, head, node);
+    if (!(node->mode & IMDIR)) {
+        if (examined) ctx->rep->files++;
+        free(node);
+        return;
+    }
+    if (examined) ctx->rep->dirs++;
+    initBlockList(&children);
+    for (cur = head; cur != 0; cur = node->next) {
+        seek_read(sb, cur, node);
+        for (k = 0; k < maxLinks && node->links[k] != 0; k++) {
+            pushBlock(&children, node->links[k]);
+        }
+    }
+    free(node);
+    FOR_EACH(i, children.n) defragTree(ctx, head, children.v[i]);
+    freeBlockList(&children);
+}
+
+/* moves the table at =*table, of =entsz byte entries, to the lowest free
+ * run below it */
+static void compactTable(struct defrag_ctx *ctx, uint64_t *table,
+        const size_t entsz) {
+    struct superblock *sb = ctx->sb;
+    struct blocklist old;
+    uint64_t i, start, n = getTableBlocks(sb, sb->blks, entsz);
+    char *buf;
+
+    if (*table == 0) return;
+    start = findFreeRun(sb, ctx->isFree, n, *table);
+    if (start == 0) return;
+    buf = malloc(sb->blksz);
+    takeRun(sb, start, n);
+    initBlockList(&old);
+    FOR_EACH(i, n) {
+        seek_read(sb, *table + i, buf);
+        seek_write(sb, start + i, buf);
+        ctx->isFree[start + i] = 0;
+        ctx->isFree[*table + i] = 1;
+        pushBlock(&old, *table + i);
+    }
+    *table = start;
+    writeSuper(sb);
+    putBlocks(sb, old.v, old.n);
+    ctx->rep->blocks += n;
+    freeBlockList(&old);
+    free(buf);
+}
+
+static int defragPass(struct superblock *sb, int flags, uint64_t budget_ms,
+        struct fs_defrag_report *rep, uint64_t t0) {
+    struct fs_defrag_report dummy;
+    struct defrag_ctx ctx;
+
+    if (!checkWritable(sb)) return -1;
+    releaseExtents(sb);
+    memset(&ctx, 0, sizeof (ctx));
+    ctx.sb = sb;
+    ctx.rep = rep != NULL ? rep : &dummy;
+    ctx.flags = flags;
+    ctx.deadline = budget_ms ? t0 + budget_ms * 1000000ull : 0;
+    ctx.isFree = getFreeMap(sb);
+    memset(ctx.rep, 0, sizeof (*ctx.rep));
+
+    if ((flags & FS_DEFRAG_COMPACT) && sb->state->defragCursor == 0) {
+        compactTable(&ctx, &sb->refmap, 1);
+        compactTable(&ctx, &sb->csums, sizeof (uint32_t));
+        compactTable(&ctx, &sb->dedup, sizeof (uint64_t));
+    }
+    defragTree(&ctx, 0, sb->root);
+    if (sb->snapshots != 0) defragTree(&ctx, 0, sb->snapshots);
+    free(ctx.isFree);
+    if (ctx.stopped) {
+        sb->state->defragCursor = ctx.ordinal;
+        return opFailed() ? -1 : 1;
+    }
+    sb->state->defragCursor = 0;
+    return 0;
+}
+
+int fs_defrag(struct superblock *sb, int flags, uint64_t budget_ms,
+        struct fs_defrag_report *rep) {
+    uint64_t t0 = opBegin(sb, FS_OP_DEFRAG);
+    int r = defragPass(sb, flags, budget_ms, rep, t0);
+    opEnd(sb, FS_OP_DEFRAG, t0);
+    return opStatus(r);
+}
+
+static int inTable(const struct superblock *sb, const uint64_t table,
+        const size_t entsz, const uint64_t block) {
+    return table != 0 && block >= table &&
+            block < table + getTableBlocks(sb, sb->blks, entsz);
+}
+
+/* a free run below =blks for the table at =table, if it must move there;
+ * zero if it stays, (uint64_t) -1 if there is no room */
+static uint64_t tableRun(const struct superblock *sb, uint8_t *isFree,
+        const uint64_t table, const size_t entsz, const uint64_t blks) {
+    uint64_t m = getTableBlocks(sb, blks, entsz), start;
+
+    if (table == 0 || table + m <= blks) return 0;
+    start = findFreeRun(sb, isFree, m, blks);
+    if (start == 0) return (uint64_t) - 1;
+    memset(isFree + start, 0, m);
+    return start;
+}
+
+/* cuts the table at =*table down to cover =blks blocks, copying it to
+ * =start unless that is zero; blocks it leaves below =blks go to =freed */
+static void shrinkTable(struct superblock *sb, uint64_t *table,
+        const size_t entsz, const uint64_t blks, const uint64_t start,
+        struct blocklist *freed) {
+    uint64_t i, n = getTableBlocks(sb, sb->blks, entsz);
+    uint64_t m = getTableBlocks(sb, blks, entsz);
+    char *buf;
+
+    if (*table == 0) return;
+    if (start != 0) {
+        buf = malloc(sb->blksz);
+        takeRun(sb, start, m);
+        FOR_EACH(i, m) {
+            seek_read(sb, *table + i, buf);
+            seek_write(sb, start + i, buf);
+        }
+        free(buf);
+        m = 0;
+    }
+    for (i = m; i < n; i++) {
+        if (*table + i < blks) pushBlock(freed, *table + i);
+    }
+    if (start != 0) *table = start;
+}
+
+static int shrinkImage(struct superblock *sb, uint64_t size) {
+    uint64_t b, blks = size / sb->blksz, refRun, csumRun, dedupRun;
+    struct blocklist freed;
+    uint8_t *isFree;
+
+    if (!checkWritable(sb)) return -1;
+    if (blks > sb->blks || (size != 0 && blks < MIN_BLOCK_COUNT)) {
+        errno = EINVAL;
+        return -1;
+    }
+    releaseExtents(sb);
+    isFree = getFreeMap(sb);
+    if (size == 0) {
+        for (blks = sb->blks; blks > 1 && isFree[blks - 1]; blks--);
+        if (blks < MIN_BLOCK_COUNT) blks = MIN_BLOCK_COUNT;
+    }
+    if (blks == sb->blks) {
+        free(isFree);
+        return 0;
+    }
+    for (b = blks; b < sb->blks; b++) {
+        if (!isFree[b] && !inTable(sb, sb->refmap, 1, b) &&
+                !inTable(sb, sb->csums, sizeof (uint32_t), b) &&
+                !inTable(sb, sb->dedup, sizeof (uint64_t), b)) break;
+    }
+    refRun = tableRun(sb, isFree, sb->refmap, 1, blks);
+    csumRun = tableRun(sb, isFree, sb->csums, sizeof (uint32_t), blks);
+    dedupRun = tableRun(sb, isFree, sb->dedup, sizeof (uint64_t), blks);
+    if (b < sb->blks || refRun == (uint64_t) - 1 ||
+            csumRun == (uint64_t) - 1 || dedupRun == (uint64_t) - 1) {
+        free(isFree);
+        errno = ENOSPC;
+        return -1;
+    }
+
+    initBlockList(&freed);
+    shrinkTable(sb, &sb->refmap, 1, blks, refRun, &freed);
+    shrinkTable(sb, &sb->csums, sizeof (uint32_t), blks, csumRun, &freed);
+    shrinkTable(sb, &sb->dedup, sizeof (uint64_t), blks, dedupRun, &freed);
+    /* drop the free space past the new end: the part of the tail there
+     * and the free list pages below the tail */
+    for (b = blks; b < sb->tail && b < sb->blks; b++) {
+        if (isFree[b]) unlinkFree(sb, b);
+    }
+    if (sb->tail > blks) {
+        sb->freeblks -= sb->blks - sb->tail;
+        sb->tail = blks;
+    } else {
+        sb->freeblks -= sb->blks - blks;
+    }
+    sb->blks = blks;
+    if (sb->dedup != 0) dedupReset(sb);
+    writeSuper(sb);
+    putBlocks(sb, freed.v, freed.n);
+    freeBlockList(&freed);
+    free(isFree);
+    return resizeImage(sb, blks, TRUE);
+}
+
+int fs_shrink(struct superblock *sb, uint64_t size) {
+    uint64_t t0 = opBegin(sb, FS_OP_SHRINK);
+    int r = shrinkImage(sb, size);
+    opEnd(sb, FS_OP_SHRINK, t0);
+    return opStatus(r);
+}
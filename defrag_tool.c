@@ -0,0 +1,103 @@
+/*
+ * File:   defrag_tool.c
+ *
+ * Command line front end for fs_defrag and fs_shrink.  With -t the pass
+ * stops after that many milliseconds and the exit status tells whether it
+ * finished; running the tool again resumes from the start of the tree,
+ * skipping entities already in place.  -s compacts the image and shrinks
+ * it to the given size (in bytes, or with a K, M or G suffix; "min" for
+ * the smallest size compaction allows), running up to MAX_PASSES
+ * compacting passes first.  Exit status: 0 when the pass finished, 1 when
+ * the budget ran out first, 8 on error.
+ *
+ * usage: defrag.exe [-c] [-t ms] [-s size|min] image
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "fs.h"
+
+#define MAX_PASSES 4
+
+static uint64_t parseSize(const char *s) {
+    char *end;
+    uint64_t n = strtoull(s, &end, 10);
+    switch (*end) {
+        case 'G': n <<= 10; /* fall through */
+        case 'M': n <<= 10; /* fall through */
+        case 'K': n <<= 10;
+    }
+    return n;
+}
+
+int main(int argc, char **argv) {
+    struct fs_defrag_report rep;
+    struct superblock *sb;
+    struct timespec t0, t1;
+    int opt, r, flags = 0, shrink = 0, passes = 0;
+    uint64_t budget = 0, size = 0;
+
+    while ((opt = getopt(argc, argv, "ct:s:")) != -1) {
+        switch (opt) {
+            case 'c': flags |= FS_DEFRAG_COMPACT;
+                break;
+            case 't': budget = strtoull(optarg, NULL, 10);
+                break;
+            case 's': shrink = 1;
+                flags |= FS_DEFRAG_COMPACT;
+                size = strcmp(optarg, "min") == 0 ? 0 : parseSize(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-c] [-t ms] [-s size|min] image\n",
+                        argv[0]);
+                return 8;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-c] [-t ms] [-s size|min] image\n",
+                argv[0]);
+        return 8;
+    }
+    sb = fs_open(argv[optind]);
+    if (sb == NULL) {
+        perror(argv[optind]);
+        return 8;
+    }
+
+    /* a pass frees holes behind the entities it already went through, so
+     * shrinking runs a few more passes while they still move something */
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        r = fs_defrag(sb, flags, budget, &rep);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (r < 0) {
+            perror("defrag");
+            fs_close(sb);
+            return 8;
+        }
+        printf("%s: %llu files, %llu directories, moved %llu (%llu blocks), "
+                "skipped %llu%s (%.3fs)\n", argv[optind],
+                (unsigned long long) rep.files, (unsigned long long) rep.dirs,
+                (unsigned long long) rep.moved,
+                (unsigned long long) rep.blocks,
+                (unsigned long long) rep.skipped,
+                r ? ", budget exhausted" : "",
+                (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+    } while (shrink && r == 0 && rep.moved != 0 && ++passes < MAX_PASSES);
+
+    if (shrink && r == 0) {
+        if (fs_shrink(sb, size) != 0) {
+            perror("shrink");
+            fs_close(sb);
+            return 8;
+        }
+        printf("%s: shrunk to %llu blocks\n", argv[optind],
+                (unsigned long long) sb->blks);
+    }
+    fs_close(sb);
+    return r;
+}
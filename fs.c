@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <assert.h>
@@ -12,6 +13,7 @@
 #include "fs.h"
 #include "utils.h"
 #include "StringProc.h"
+#include "lz4.h"
 
 /* Build a new filesystem image in =fname (the file =fname should be present
  * in the OS's filesystem).  The new filesystem should use =blocksize as its
@@ -19,47 +21,108 @@
  * computed from the file size.  The filesystem will be initialized with an
  * empty root directory.  This function returns NULL on error and sets errno
  * to the appropriate error code.  If the block size is smaller than
- * MIN_BLOCK_SIZE bytes, then the format fails and the function sets errno to
- * EINVAL.  If there is insufficient space to store MIN_BLOCK_COUNT blocks in
+ * MIN_BLOCK_SIZE bytes or not a power of two, then the format fails and the
+ * function sets errno to EINVAL.  If there is insufficient space to store MIN_BLOCK_COUNT blocks in
  * =fname, then the function fails and sets errno to ENOSPC. */
 struct superblock * fs_format(const char *fname, uint64_t blocksize) {
+    return fs_format_features(fname, blocksize, FS_FEAT_META_CSUM);
+}
+
+struct superblock * fs_format_features(const char *fname, uint64_t blocksize,
+        uint64_t features) {
+    return fs_format_striped(&fname, 1, blocksize, 0, features);
+}
+
+/* closes the first =n descriptors in =fds */
+static void closeImages(int *fds, int n) {
+    while (n > 0) close(fds[--n]);
+}
+
+struct superblock * fs_format_striped(const char **fnames, int n,
+        uint64_t blocksize, uint64_t unit, uint64_t features) {
 
     struct superblock *sb;
     struct inode *inode;
     struct nodeinfo *info;
     struct freepage *fp;
-    int size;
-    uint64_t i;
+    uint64_t i, size = 0, per, tblocks = 0;
+    int d, fds[n > 0 ? n : 1];
 
-    if (blocksize < MIN_BLOCK_SIZE) {
+    if (blocksize < MIN_BLOCK_SIZE || (blocksize & (blocksize - 1)) != 0 ||
+            n < 1 || (n > 1 && (unit == 0 || unit > UINT32_MAX))) {
         errno = EINVAL;
         return NULL;
     }
 
+    //every image holds as many whole stripe units as the smallest one
+    for (d = 0; d < n; d++) {
+        fds[d] = open(fnames[d], O_RDWR);
+        if (fds[d] < 0) {
+            closeImages(fds, d);
+            return NULL;
+        }
+        per = getFileSize(fds[d]) / blocksize;
+        if (n > 1) per -= per % unit;
+        if (d == 0 || per * blocksize < size) size = per * blocksize;
+    }
+    size *= n;
+
     sb = (struct superblock*) calloc(1, blocksize);
     inode = (struct inode*) calloc(1, blocksize);
     info = (struct nodeinfo*) calloc(1, blocksize);
     fp = (struct freepage*) calloc(1, blocksize);
 
-    size = getFileSize(fname);
-
-
     //sb setup
-    sb->fd = open(fname, O_RDWR);
+    sb->fd = fds[0];
     sb->magic = 0xdcc605f5;
     sb->root = 1;
     sb->blksz = blocksize;
     sb->blks = size / blocksize;
-    sb->freeblks = sb->blks - 4;
-    sb->freelist = 3;
+    if (n > 1) {
+        features |= FS_FEAT_STRIPED;
+        sb->stripes = n;
+        sb->stripeUnit = unit;
+    }
+    features |= FS_FEAT_TAIL;
+    sb->features = features;
+    if (features & FS_FEAT_DATA_CSUM) {
+        //data checksum table right after the root directory
+        tblocks = getTableBlocks(sb, sb->blks, sizeof (uint32_t));
+        sb->csums = 3;
+    }
+    if (features & FS_FEAT_DEDUP) {
+        //then the reference counts and the dedup index
+        sb->refmap = 3 + tblocks;
+        tblocks += getTableBlocks(sb, sb->blks, 1);
+        sb->dedup = 3 + tblocks;
+        tblocks += getTableBlocks(sb, sb->blks, sizeof (uint64_t));
+    }
+    //nothing was freed yet: every free block is in the tail
+    sb->freeblks = sb->blks - 3 - tblocks;
+    sb->freelist = 0;
+    sb->tail = 3 + tblocks;
 
-    if (sb->blks < MIN_BLOCK_COUNT) {
+    if (sb->blks < MIN_BLOCK_COUNT || sb->blks < 3 + tblocks + 1) {
         errno = ENOSPC;
+        closeImages(fds, n);
+        free(fp);
+        free(inode);
+        free(info);
+        free(sb);
+        return NULL;
+    }
+    sb->state = newState();
+    setGeometry(sb);
+    if (stripeAttach(sb, fds, n) != 0) {
+        stripeDetach(sb->state);
         close(sb->fd);
         free(fp);
         free(inode);
         free(info);
+        pthread_mutex_destroy(&sb->state->poolLock);
+        free(sb->state);
         free(sb);
+        errno = EAGAIN;
         return NULL;
     }
 
@@ -74,66 +137,51 @@ struct superblock * fs_format(const char *fname, uint64_t blocksize) {
     info->name[1] = '\0'; //string ending escape
 
     // file writeup
-    lseek(sb->fd, 0, SEEK_SET);
-    write(sb->fd, sb, blocksize);
-    assert(sb->magic == 0xdcc605f5);
-    /////////////////////////////
-    lseek(sb->fd, sb->root * blocksize, SEEK_SET);
-    write(sb->fd, inode, blocksize);
-    /////////////////////////////    
-    lseek(sb->fd, inode->meta * blocksize, SEEK_SET);
-    write(sb->fd, info, blocksize);
-
-
-    //free page setup
-    for (i = sb->freelist; i < sb->blks; i++) {
-        if (i == sb->freelist) {
-            //first freeBlock
-            fp->next = i + 1;
-            fp->count = 0;
-            lseek(sb->fd, i * blocksize, SEEK_SET);
-            write(sb->fd, fp, blocksize);
-
-            lseek(sb->fd, i * blocksize, SEEK_SET);
-            read(sb->fd, fp, blocksize);
-            assert(fp->next == i + 1);
-        } else if (i + 1 >= sb->blks) {
-            //last free block
-            fp->next = 0;
-            fp->count = 1;
-            fp->links[0] = i - 1; //link to previous free block(doubly linked list)
-            lseek(sb->fd, i * blocksize, SEEK_SET);
-            write(sb->fd, fp, blocksize);
-
-            lseek(sb->fd, i * blocksize, SEEK_SET);
-            read(sb->fd, fp, blocksize);
-            assert(fp->next == 0);
-        } else {
-            fp->next = i + 1;
-            fp->count = 1;
-            fp->links[0] = i - 1; //link to previous free block(doubly linked list)
-            lseek(sb->fd, i * blocksize, SEEK_SET);
-            write(sb->fd, fp, blocksize);
-
-            lseek(sb->fd, i * blocksize, SEEK_SET);
-            read(sb->fd, fp, blocksize);
-            assert(fp->next == i + 1);
-        }
+    writeSuper(sb);
+    seek_write(sb, sb->root, inode);
+    seek_write(sb, inode->meta, info);
+    for (i = 0; i < tblocks; i++) {
+        memset(fp, 0, blocksize);
+        seek_write(sb, 3 + i, fp);
     }
 
     free(fp);
     free(inode);
     free(info);
 
+    fs_reset_stats(sb);
     return sb;
 }
 
 struct superblock * fs_open(const char *fname) {
-    int fd = open(fname, O_RDWR);
-    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
-        errno = EBUSY;
+    return fs_open_flags(fname, 0);
+}
+
+struct superblock * fs_open_flags(const char *fname, int flags) {
+    return fs_open_striped(&fname, 1, flags);
+}
+
+static struct superblock * openImages(const char **fnames, int n,
+        int flags) {
+    int shared = flags & FS_OPEN_SHARED;
+    int d, fd, fds[n > 0 ? n : 1];
+    if (n < 1) {
+        errno = EINVAL;
         return NULL;
     }
+    for (d = 0; d < n; d++) {
+        fds[d] = open(fnames[d], shared ? O_RDONLY : O_RDWR);
+        if (fds[d] == -1) {
+            closeImages(fds, d);
+            return NULL;
+        }
+        if (flock(fds[d], (shared ? LOCK_SH : LOCK_EX) | LOCK_NB) == -1) {
+            closeImages(fds, d + 1);
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+    fd = fds[0];
     struct superblock* sb = (struct superblock*) malloc(sizeof (struct superblock));
     read(fd, sb, sizeof (struct superblock));
 
@@ -143,7 +191,7 @@ struct superblock * fs_open(const char *fname) {
      */
     if (sb->magic != 0xdcc605f5) {
         errno = EBADF;
-        close(fd);
+        closeImages(fds, n);
         free(sb);
         return NULL;
     }
@@ -152,6 +200,61 @@ struct superblock * fs_open(const char *fname) {
     sb = (struct superblock*) malloc(blocksz);
     lseek(fd, 0, SEEK_SET);
     read(fd, sb, blocksz);
+    if ((sb->features & FS_FEAT_META_CSUM) && !checkBlockCsum(sb, sb)) {
+        errno = EIO;
+        closeImages(fds, n);
+        free(sb);
+        return NULL;
+    }
+    //the free list of older images runs to the end: no block is in the tail.
+    //they predate snapshots too and kept the descriptor where =refmap is
+    if (!(sb->features & FS_FEAT_TAIL)) {
+        sb->tail = sb->blks;
+        sb->refmap = 0;
+        sb->snapshots = 0;
+        sb->features |= FS_FEAT_TAIL;
+    }
+    //older images kept in-memory fields where the dedup index is now
+    if (!(sb->features & FS_FEAT_DEDUP)) sb->dedup = 0;
+    if (!(sb->features & FS_FEAT_STRIPED)) {
+        sb->stripes = 0;
+        sb->stripeUnit = 0;
+    }
+    if ((sb->stripes ? sb->stripes : 1) != (uint64_t) n ||
+            (n > 1 && sb->stripeUnit == 0)) {
+        errno = EINVAL;
+        closeImages(fds, n);
+        free(sb);
+        return NULL;
+    }
+    sb->fd = fd;
+    sb->flags = shared ? FS_RDONLY : 0;
+    sb->state = newState();
+    setGeometry(sb);
+    if (stripeAttach(sb, fds, n) != 0) {
+        stripeDetach(sb->state);
+        close(fd);
+        pthread_mutex_destroy(&sb->state->poolLock);
+        free(sb->state);
+        free(sb);
+        errno = EAGAIN;
+        return NULL;
+    }
+    if (shared) mapImage(sb);
+    if ((flags & FS_OPEN_PRELOAD) && preloadTree(sb) != 0) {
+        int err = errno;
+        fs_close(sb);
+        errno = err;
+        return NULL;
+    }
+    return sb;
+}
+
+/* the call is counted in the stats of the image it opens */
+struct superblock * fs_open_striped(const char **fnames, int n, int flags) {
+    uint64_t t0 = opClock();
+    struct superblock *sb = openImages(fnames, n, flags);
+    if (sb != NULL) opEnd(sb, FS_OP_OPEN, t0);
     return sb;
 }
 
@@ -159,64 +262,178 @@ int fs_close(struct superblock *sb) {
     if (sb == NULL) {
         return -1;
     }
-    seek_write(sb, 0, sb);
+    uint64_t t0 = opBegin(sb, FS_OP_CLOSE);
+    if (sb->flags & FS_VIEW) {
+        opEnd(sb, FS_OP_CLOSE, t0);
+        free(sb);
+        return 0;
+    }
+    if (!(sb->flags & FS_RDONLY)) {
+        releaseExtents(sb);
+        writeSuper(sb);
+    }
+    /* ends before the trace and stats go away with the state */
+    opEnd(sb, FS_OP_CLOSE, t0);
+    unmapImage(sb->state);
+    stripeDetach(sb->state);
+    freeNamespace(sb->state);
     if (flock(sb->fd, LOCK_UN | LOCK_NB) != 0) {
         errno = EBADF;
         return -1;
     }
     close(sb->fd);
+    freeTrace(sb->state);
+    freeBouncePool(sb->state);
+    pthread_mutex_destroy(&sb->state->poolLock);
+    free(sb->state);
     free(sb);
     return 0;
 }
 
-uint64_t fs_get_block(struct superblock *sb) {
-    if (sb->freeblks == 0) {
-        //report Error
-        return 0;
-    }
-    uint64_t freeList = sb->freelist;
-    struct freepage *fp = (struct freepage *) malloc(sb->blksz);
-    struct freepage *fp_prev = (struct freepage *) malloc(sb->blksz);
-    struct freepage *fp_next = (struct freepage *) malloc(sb->blksz);
-    seek_read(sb, freeList, fp);
-    if (fp->count != 0) {
-        //update previous pointers        
-        seek_read(sb, fp->links[0], fp_prev);
-        fp_prev->next = fp->next;
-        seek_write(sb, fp->links[0], fp_prev);
+/* blocks set aside at a time for metadata and data */
+#define META_EXTENT 64
+#define DATA_EXTENT 256
+
+/* blocks set aside in the extents and not handed out yet */
+static uint64_t extentBlocks(const struct superblock *sb) {
+    const struct fs_extent *ext = sb->state->extent;
+    return ext[0].end - ext[0].next + ext[1].end - ext[1].next;
+}
+
+/* writes the superblock.  on disk the blocks set aside in the extents are
+ * not counted as free, as they are in neither the tail nor the free list:
+ * an image that is not closed leaks them, for fs_fsck to take back */
+void writeSuper(struct superblock *sb) {
+    uint64_t freeblks = sb->freeblks;
+    sb->freeblks -= extentBlocks(sb);
+    seek_write(sb, 0, sb);
+    sb->freeblks = freeblks;
+}
+
+/* sets aside the run of adjacent blocks at the head of the free list, up
+ * to =n of them, as =ext.  fs_put_blocks chains what it frees in
+ * ascending order, so the blocks of a deleted file come back as runs and
+ * each run goes to one kind of block. */
+static void takeFreeExtent(struct superblock *sb, struct fs_extent *ext,
+        const uint64_t n) {
+    struct freepage *fp = malloc(sb->blksz);
+    uint64_t b = sb->freelist;
+
+    ext->next = b;
+    do {
+        seek_read_kind(sb, b, fp, FS_BLK_FREE);
+        ext->end = b + 1;
+        b = fp->next;
+    } while (b == ext->end && ext->end - ext->next < n);
+    if (b != 0) {
+        //the next page becomes the head: it has no previous page
+        seek_read_kind(sb, b, fp, FS_BLK_FREE);
+        fp->count = 0;
+        fp->links[0] = 0;
+        seek_write_kind(sb, b, fp, FS_BLK_FREE);
     }
+    sb->freelist = b;
+    free(fp);
+}
 
-    if (fp->next != 0) {
-        //update next pointers        
-        seek_read(sb, fp->next, fp_next);
-        fp_next->links[0] = fp->links[0];
-        seek_write(sb, fp->next, fp_next);
+/**
+ * Like fs_get_block, for a block holding =kind (FS_BLK_META or
+ * FS_BLK_DATA).  Metadata and data come from separate extents: runs set
+ * aside from the head of the free list or, once it is empty, from the
+ * never used tail.  So the inodes and names of a directory built up over
+ * time are packed together and read ahead together by findFile and
+ * fs_list_dir, and files written meanwhile still get contiguous runs of
+ * data blocks, on aged images as on fresh ones.  When both are used up
+ * the other kind's extent is drained.
+ * @return the block, or zero with errno set to ENOSPC
+ */
+uint64_t getBlock(struct superblock *sb, int kind) {
+    struct fs_extent *ext = &sb->state->extent[kind == FS_BLK_DATA];
+    struct fs_extent *other = &sb->state->extent[kind != FS_BLK_DATA];
+    uint64_t n = kind == FS_BLK_DATA ? DATA_EXTENT : META_EXTENT, block;
+
+    if (!checkWritable(sb)) {
+        return (uint64_t) - 1;
     }
+    if (ext->next == ext->end) {
+        if (sb->freelist != 0) {
+            takeFreeExtent(sb, ext, n);
+        } else if (sb->tail < sb->blks) {
+            ext->next = sb->tail;
+            sb->tail += MIN(n, sb->blks - sb->tail);
+            ext->end = sb->tail;
+        } else if (other->next != other->end) {
+            ext = other;
+        } else {
+            errno = ENOSPC;
+            return 0;
+        }
+    }
+    block = ext->next++;
 
-    sb->freelist = fp->next;
     sb->freeblks--;
-    seek_write(sb, 0, sb);
+    writeSuper(sb);
+    statsCount(sb, &sb->state->stats.allocs, 1);
+    TRACE(sb, FS_TR_ALLOC, 0, block, 1);
+    return block;
+}
 
-    free(fp_prev);
-    free(fp);
-    free(fp_next);
-    return freeList;
+uint64_t fs_get_block(struct superblock *sb) {
+    uint64_t t0 = opBegin(sb, FS_OP_GET_BLOCK);
+    uint64_t block = getBlock(sb, FS_BLK_META);
+    opEnd(sb, FS_OP_GET_BLOCK, t0);
+    return block;
 }
 
-int fs_put_block(struct superblock *sb, uint64_t block) {
-    if (sb->freeblks != 0) {
+/* gives the unused part of the extents back to the tail, or to the free
+ * list if the tail moved on since; done before anything reads the tail or
+ * the free list as a whole, and when closing */
+void releaseExtents(struct superblock *sb) {
+    struct fs_extent *ext = sb->state->extent, *e;
+    uint64_t *blocks, b, n = 0;
+    int i, moved;
+
+    if (extentBlocks(sb) == 0) return;
+    do {
+        moved = FALSE;
+        FOR_EACH(i, 2) {
+            if (ext[i].next != ext[i].end && ext[i].end == sb->tail) {
+                sb->tail = ext[i].next;
+                ext[i].next = ext[i].end = 0;
+                moved = TRUE;
+            }
+        }
+    } while (moved);
+    blocks = malloc(extentBlocks(sb) * sizeof (uint64_t));
+    FOR_EACH(i, 2) {
+        e = &ext[i];
+        for (b = e->next; b < e->end; b++) blocks[n++] = b;
+        e->next = e->end = 0;
+    }
+    /* the blocks are counted as free already */
+    sb->freeblks -= n;
+    if (n > 0) putBlocks(sb, blocks, n);
+    free(blocks);
+    writeSuper(sb);
+}
+
+static int putBlock(struct superblock *sb, uint64_t block) {
+    if (!checkWritable(sb)) {
+        return -1;
+    }
+    if (sb->freelist != 0) {
         uint64_t freeList = sb->freelist;
         struct freepage *fp = NULL, *fp_next = NULL;
         fp = (struct freepage *) malloc(sb->blksz);
         fp_next = (struct freepage *) malloc(sb->blksz);
 
-        seek_read(sb, freeList, fp_next);
+        seek_read_kind(sb, freeList, fp_next, FS_BLK_FREE);
         fp->next = freeList;
         fp->count = 0;
-        seek_write(sb, block, fp);
+        seek_write_kind(sb, block, fp, FS_BLK_FREE);
         fp_next->count = 1;
         fp_next->links[0] = block;
-        seek_write(sb, freeList, fp_next);
+        seek_write_kind(sb, freeList, fp_next, FS_BLK_FREE);
 
         free(fp);
         free(fp_next);
@@ -225,151 +442,586 @@ int fs_put_block(struct superblock *sb, uint64_t block) {
         fp = (struct freepage *) malloc(sb->blksz);
         fp->next = 0;
         fp->count = 0;
-        seek_write(sb, block, fp);
+        seek_write_kind(sb, block, fp, FS_BLK_FREE);
         free(fp);
     }
     sb->freelist = block;
     sb->freeblks++;
-    seek_write(sb, 0, sb);
+    writeSuper(sb);
+    statsCount(sb, &sb->state->stats.frees, 1);
+    TRACE(sb, FS_TR_FREE, 0, block, 1);
     return 0;
 }
 
-int fs_write_file(struct superblock *sb, const char *fname, char *buf, size_t cnt) {
-    const uint64_t blocksNeeded = MAX(1, cnt / sb->blksz);
-    if (blocksNeeded > sb->freeblks) {
+static int cmpBlock(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* longest run of adjacent free pages written with a single call */
+#define FREE_RUN 64
+
+int putBlocks(struct superblock *sb, uint64_t *blocks, size_t count) {
+    size_t i, j, k, n, run;
+    char *buf;
+    struct freepage *fp;
+
+    if (!checkWritable(sb)) return -1;
+    if (count == 0) return 0;
+    qsort(blocks, count, sizeof (uint64_t), cmpBlock);
+    for (i = 0, n = 0; i < count; i++) {
+        if (blocks[i] == 0 || blocks[i] >= sb->blks) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (n == 0 || blocks[n - 1] != blocks[i]) blocks[n++] = blocks[i];
+    }
+
+    buf = (char *) calloc(FREE_RUN, sb->blksz);
+    if (sb->freelist != 0) {
+        /* the old head now follows the last block of the batch */
+        fp = (struct freepage *) buf;
+        seek_read_kind(sb, sb->freelist, fp, FS_BLK_FREE);
+        fp->count = 1;
+        fp->links[0] = blocks[n - 1];
+        seek_write_kind(sb, sb->freelist, fp, FS_BLK_FREE);
+    }
+
+    /* chain the batch in ascending order, writing adjacent pages together */
+    for (i = 0; i < n; i += run) {
+        run = 1;
+        while (i + run < n && run < FREE_RUN &&
+                blocks[i + run] == blocks[i + run - 1] + 1) {
+            run++;
+        }
+        memset(buf, 0, run * sb->blksz);
+        for (k = 0; k < run; k++) {
+            j = i + k;
+            fp = (struct freepage *) (buf + k * sb->blksz);
+            if (j + 1 < n) {
+                fp->next = blocks[j + 1];
+            } else {
+                fp->next = sb->freelist;
+            }
+            fp->count = (j > 0);
+            fp->links[0] = (j > 0) ? blocks[j - 1] : 0;
+        }
+        seek_write_blocks(sb, blocks[i], run, buf, FS_BLK_FREE);
+    }
+    free(buf);
+
+    sb->freelist = blocks[0];
+    sb->freeblks += n;
+    writeSuper(sb);
+    statsCount(sb, &sb->state->stats.frees, n);
+    TRACE(sb, FS_TR_FREE, 0, blocks[0], n);
+    return 0;
+}
+
+int fs_put_block(struct superblock *sb, uint64_t block) {
+    uint64_t t0 = opBegin(sb, FS_OP_PUT_BLOCK);
+    int r = putBlock(sb, block);
+    opEnd(sb, FS_OP_PUT_BLOCK, t0);
+    return opStatus(r);
+}
+
+int fs_put_blocks(struct superblock *sb, uint64_t *blocks, size_t count) {
+    uint64_t t0 = opBegin(sb, FS_OP_PUT_BLOCKS);
+    int r = putBlocks(sb, blocks, count);
+    opEnd(sb, FS_OP_PUT_BLOCKS, t0);
+    return opStatus(r);
+}
+
+/* Copies the table at =*table, holding one =entsz byte entry per block, to
+ * the start of the tail if it must grow to cover =blks blocks.  The new
+ * entries are zero and the old table blocks are added to =freed. */
+static void growTable(struct superblock *sb, uint64_t *table, size_t entsz,
+        uint64_t blks, struct blocklist *freed) {
+    uint64_t i, n = getTableBlocks(sb, sb->blks, entsz);
+    uint64_t m = getTableBlocks(sb, blks, entsz);
+    char *buf;
+
+    if (*table == 0 || m == n) return;
+    buf = (char *) malloc(sb->blksz);
+    for (i = 0; i < m; i++) {
+        if (i < n) {
+            seek_read(sb, *table + i, buf);
+            pushBlock(freed, *table + i);
+        } else {
+            memset(buf, 0, sb->blksz);
+        }
+        seek_write(sb, sb->tail + i, buf);
+    }
+    free(buf);
+    statsCount(sb, &sb->state->stats.allocs, m);
+    TRACE(sb, FS_TR_ALLOC, 0, sb->tail, m);
+    *table = sb->tail;
+    sb->tail += m;
+    sb->freeblks -= m;
+}
+
+/* blocks growTable takes to cover =blks blocks */
+static uint64_t growTableBlocks(const struct superblock *sb, uint64_t table,
+        size_t entsz, uint64_t blks) {
+    uint64_t m = getTableBlocks(sb, blks, entsz);
+    if (table == 0 || m == getTableBlocks(sb, sb->blks, entsz)) return 0;
+    return m;
+}
+
+static int growImage(struct superblock *sb, uint64_t size) {
+    uint64_t blks = size / sb->blksz, need;
+    struct blocklist freed;
+
+    if (!checkWritable(sb)) return -1;
+    if (blks < sb->blks) {
+        errno = EINVAL;
+        return -1;
+    }
+    releaseExtents(sb);
+    if (blks == sb->blks) return 0;
+    need = growTableBlocks(sb, sb->refmap, 1, blks) +
+            growTableBlocks(sb, sb->csums, sizeof (uint32_t), blks) +
+            growTableBlocks(sb, sb->dedup, sizeof (uint64_t), blks);
+    if (need > blks - sb->tail) {
+        errno = ENOSPC;
+        return -1;
+    }
+    if (resizeImage(sb, blks, FALSE) != 0) {
+        return -1;
+    }
+
+    /* the new blocks extend the never used tail, so they are added to free
+     * space without touching them.  grown tables are copied there before
+     * the superblock switches to them with a single write. */
+    initBlockList(&freed);
+    sb->freeblks += blks - sb->blks;
+    growTable(sb, &sb->refmap, 1, blks, &freed);
+    growTable(sb, &sb->csums, sizeof (uint32_t), blks, &freed);
+    growTable(sb, &sb->dedup, sizeof (uint64_t), blks, &freed);
+    sb->blks = blks;
+    if (sb->dedup != 0) dedupReset(sb);
+    writeSuper(sb);
+    putBlocks(sb, freed.v, freed.n);
+    freeBlockList(&freed);
+    return 0;
+}
+
+int fs_grow(struct superblock *sb, uint64_t size) {
+    uint64_t t0 = opBegin(sb, FS_OP_GROW);
+    int r = growImage(sb, size);
+    opEnd(sb, FS_OP_GROW, t0);
+    return opStatus(r);
+}
+
+/* top bit of a chunk length: the chunk is stored raw */
+#define CHUNK_RAW 0x80000000u
+
+/**
+ * Compresses =buf into the chunk stream of an FS_FILE_LZ4 file.
+ * @param stored receives the length of the stream
+ * @return the stream, or NULL if it would take as many blocks as =buf
+ */
+static char *compressChunks(const struct superblock *sb, const char *buf,
+        size_t cnt, size_t *stored) {
+    size_t off, n, c, chunks = (cnt + FS_COMPRESS_CHUNK - 1) / FS_COMPRESS_CHUNK;
+    char *dst = malloc(cnt + chunks * sizeof (uint32_t));
+    uint32_t hdr;
+
+    *stored = 0;
+    for (off = 0; off < cnt; off += n) {
+        n = MIN(FS_COMPRESS_CHUNK, cnt - off);
+        c = lz4_compress(buf + off, n, dst + *stored + sizeof (hdr), n - 1);
+        if (c == 0) {
+            memcpy(dst + *stored + sizeof (hdr), buf + off, n);
+            hdr = n | CHUNK_RAW;
+        } else {
+            hdr = c;
+        }
+        memcpy(dst + *stored, &hdr, sizeof (hdr));
+        *stored += sizeof (hdr) + (hdr & ~CHUNK_RAW);
+    }
+    if (cnt == 0 || (*stored + sb->blksz - 1) / sb->blksz >=
+            (cnt + sb->blksz - 1) / sb->blksz) {
+        free(dst);
+        return NULL;
+    }
+    return dst;
+}
+
+/**
+ * Decompresses the first =want bytes of an FS_FILE_LZ4 file of =size
+ * bytes from its chunk stream.
+ * @return zero, or -1 if the stream is malformed
+ */
+static int decompressChunks(const char *src, size_t stored, char *dst,
+        size_t want, uint64_t size) {
+    size_t in = 0, off, raw, len;
+    char *chunk = NULL;
+    uint32_t hdr;
+    int r = 0;
+
+    for (off = 0; off < want && r == 0; off += raw, in += len) {
+        raw = MIN(FS_COMPRESS_CHUNK, size - off);
+        if (in + sizeof (hdr) > stored) {
+            r = -1;
+            break;
+        }
+        memcpy(&hdr, src + in, sizeof (hdr));
+        in += sizeof (hdr);
+        len = hdr & ~CHUNK_RAW;
+        if (len > stored - in) {
+            r = -1;
+        } else if (hdr & CHUNK_RAW) {
+            if (len != raw) r = -1;
+            else memcpy(dst + off, src + in, MIN(raw, want - off));
+        } else if (raw <= want - off) {
+            if (lz4_decompress(src + in, len, dst + off, raw) != raw) r = -1;
+        } else {
+            /* only part of the last chunk wanted */
+            if (chunk == NULL) chunk = malloc(FS_COMPRESS_CHUNK);
+            if (lz4_decompress(src + in, len, chunk, raw) != raw) r = -1;
+            else memcpy(dst + off, chunk, want - off);
+        }
+    }
+    free(chunk);
+    return r;
+}
+
+/* writes the =count data blocks at =blocks, which follow each other on disk,
+ * from =iov; they join the dedup index once they hold their data */
+static void writeRun(struct superblock *sb, const uint64_t *blocks,
+        const struct iovec *iov, const uint64_t count) {
+    uint64_t i;
+    if (count == 0) return;
+    seek_writev_blocks(sb, blocks[0], count, iov);
+    if (sb->features & FS_FEAT_DEDUP) {
+        FOR_EACH(i, count) dedupInsert(sb, blocks[i], iov[i].iov_base);
+    }
+}
+
+/* gives back what a failed writeFile took: the blocks in =taken, of which
+ * the first =meta are inodes and the nodeinfo and the rest data blocks that
+ * may be in the dedup index, and a reference to each block in =shared */
+static void dropTaken(struct superblock *sb, struct blocklist *taken,
+        const size_t meta, const struct blocklist *shared) {
+    size_t i;
+    FOR_EACH(i, shared->n) decRef(sb, shared->v[i]);
+    if ((sb->features & FS_FEAT_DEDUP) && taken->n > meta) {
+        dedupForget(sb, taken->v + meta, taken->n - meta);
+    }
+    putBlocks(sb, taken->v, taken->n);
+}
+
+static int writeFile(struct superblock *sb, const char *fname, char *buf,
+        size_t cnt, int flags) {
+    if (!checkWritable(sb)) {
+        return -1;
+    }
+    size_t stored = cnt;
+    char *packed = NULL, *data = buf;
+    if (flags & FS_WRITE_COMPRESS) {
+        packed = compressChunks(sb, buf, cnt, &stored);
+        if (packed != NULL) data = packed;
+        else stored = cnt;
+    }
+    const uint64_t blocksNeeded = MAX(1, (stored + sb->blksz - 1) / sb->blksz);
+    uint64_t* blocksList = malloc(blocksNeeded * sizeof (uint64_t));
+    /* full blocks are written straight from the caller's buffer; only a
+     * partial last block goes through a zeroed copy */
+    char* last = NULL;
+    if (stored < blocksNeeded * sb->blksz) {
+        size_t off = (blocksNeeded - 1) * sb->blksz;
+        last = calloc(1, sb->blksz);
+        memcpy(last, data + off, stored - off);
+    }
+    /* zero blocks become holes and take no space */
+    uint64_t i, holes = 0;
+    for (i = 0; i < blocksNeeded; i++) {
+        char* src = (last != NULL && i == blocksNeeded - 1) ?
+                last : data + i * sb->blksz;
+        blocksList[i] = isZeroBlock(sb, src) ? FS_HOLE : 0;
+        if (blocksList[i] == FS_HOLE) holes++;
+    }
+    if (blocksNeeded - holes > sb->freeblks) {
+        free(blocksList);
+        free(last);
+        free(packed);
         errno = ENOSPC;
         return -1;
     }
-    int blocksUsed = 0;
+    uint64_t blocksUsed = 0;
 
     if (strlen(fname) + 1 > getFileNameMaxLen(sb)) {
+        free(blocksList);
+        free(last);
+        free(packed);
         errno = ENAMETOOLONG;
         return -1;
     }
 
     if (existsFile(sb, fname)) {
+        free(blocksList);
+        free(last);
+        free(packed);
         errno = EEXIST;
         return -1;
     }
+    if (unsharePath(sb, fname, FALSE) != 0) {
+        free(blocksList);
+        free(last);
+        free(packed);
+        return -1;
+    }
 
-    int len = 0, exists = 0;
+    int len = 0, exists = 0, err = 0;
     char** fileParts = getFileParts(fname, &len);
     uint64_t dirBlock = findFile(sb, fname, &exists);
+    /* a lookup stopped by a file leaves that file as =dirBlock */
+    if (!exists && errno == ENOTDIR) err = ENOTDIR;
     char* dirName = NULL;
     struct inode* dirNode, *node;
     struct nodeinfo* meta = (struct nodeinfo*) calloc(1, sb->blksz);
+    struct iovec* iov = NULL;
+    struct blocklist taken, shared;
+    uint64_t* inodes = NULL;
     initNode(&dirNode, sb->blksz);
     initNode(&node, sb->blksz);
+    initBlockList(&taken);
+    initBlockList(&shared);
     seek_read(sb, dirBlock, dirNode);
     seek_read(sb, dirNode->meta, meta);
     dirName = calloc(1, sizeof (char)* (strlen(meta->name) + 1));
     strcpy(dirName, meta->name);
 
-    if (strcmp(fileParts[MAX(0, len - 2)], dirName) != 0) {
-        errno = EBADF;
-        free(dirName);
-        free(node);
-        free(meta);
-        free(dirNode);
-        return -1;
+    if (err == 0 && strcmp(fileParts[MAX(0, len - 2)], dirName) != 0) {
+        err = EBADF;
+    }
+    if (err != 0) goto out;
+
+    /* besides its data the file takes its nodeinfo and an inode per
+     * linksLen data blocks, and the directory a new link block when its
+     * last one is full */
+    const int linksLen = getLinksMaxLen(sb);
+    const uint64_t inodesNeeded = (blocksNeeded + linksLen - 1) / linksLen;
+    const int newLink = (meta->size + 1) % linksLen == 0;
+    if (blocksNeeded - holes + 1 + inodesNeeded + newLink > sb->freeblks) {
+        err = ENOSPC;
+        goto out;
     }
 
-
-    uint64_t fileBlock = fs_get_block(sb);
-    insertInBlock(sb, dirBlock, fileBlock);
-    uint64_t blocksList[blocksNeeded];
-    ///properly write the file
-    while (blocksUsed < blocksNeeded) {
-        uint64_t block = fs_get_block(sb);
-        blocksList[blocksUsed] = block;
-        char* temp = calloc(1, sb->blksz);
-        char* blockContent = buf + sb->blksz * (blocksUsed);
-        strcpy(temp, blockContent);
-        blocksUsed++;
-        seek_write(sb, block, temp);
-        free(temp);
+    /* everything is allocated before the file is linked in, so running
+     * out of space midway gives it all back and leaves no trace */
+    inodes = malloc(inodesNeeded * sizeof (uint64_t));
+    uint64_t metaBlock = 0;
+    FOR_EACH(i, inodesNeeded) {
+        inodes[i] = getBlock(sb, FS_BLK_META);
+        if (inodes[i] == 0) break;
+        pushBlock(&taken, inodes[i]);
+    }
+    if (i == inodesNeeded) metaBlock = getBlock(sb, FS_BLK_META);
+    if (metaBlock == 0) {
+        err = ENOSPC;
+        goto undo;
     }
+    pushBlock(&taken, metaBlock);
+    uint64_t fileBlock = inodes[0];
+
+    iov = malloc(blocksNeeded * sizeof (struct iovec));
+    uint64_t run = 0;
+    for (i = 0; i < blocksNeeded; i++) {
+        char* src = (last != NULL && i == blocksNeeded - 1) ?
+                last : data + i * sb->blksz;
+        uint64_t block = blocksList[i];
+        if (block == 0 && (sb->features & FS_FEAT_DEDUP)) {
+            block = dedupLookup(sb, src);
+        }
+        if (block == 0) {
+            block = getBlock(sb, FS_BLK_DATA);
+            if (block == 0) {
+                err = ENOSPC;
+                goto undo;
+            }
+            pushBlock(&taken, block);
+            /* a block not following the pending run starts a new one */
+            if (run != 0 && block != blocksList[i - 1] + 1) {
+                writeRun(sb, blocksList + i - run, iov + i - run, run);
+                run = 0;
+            }
+            iov[i].iov_base = src;
+            iov[i].iov_len = sb->blksz;
+            run++;
+        } else {
+            writeRun(sb, blocksList + i - run, iov + i - run, run);
+            run = 0;
+            if (block != FS_HOLE) {
+                incRef(sb, block);
+                pushBlock(&shared, block);
+            }
+        }
+        blocksList[i] = block;
+    }
+    writeRun(sb, blocksList + i - run, iov + i - run, run);
+    if (!insertInBlock(sb, dirBlock, fileBlock, meta)) {
+        err = ENOSPC;
+        goto undo;
+    }
+    statsCount(sb, &sb->state->stats.holes, holes);
+    statsCount(sb, &sb->state->stats.dedup_hits, shared.n);
     strcpy(meta->name, fileParts[len - 1]);
     meta->size = cnt;
-    meta->reserved[0] = 0;
+    meta->reserved[0] = packed != NULL ? FS_FILE_LZ4 : 0;
+    meta->reserved[1] = packed != NULL ? stored : 0;
+    meta->reserved[2] = 0; //read from the directory
 
-    node->meta = fs_get_block(sb);
+    node->meta = metaBlock;
     node->mode = IMREG;
     node->parent = dirBlock;
 
     seek_write(sb, node->meta, meta);
 
-    uint64_t nodeBlock = fileBlock;
-    blocksUsed = 0;
-    while (blocksUsed < blocksNeeded) {
+    uint64_t k = 0;
+    for (;;) {
         int i = 0;
-        int linksLen = getLinksMaxLen(sb);
-        int N = MIN(linksLen, blocksNeeded);
-        while (i < N) {
-            node->links[i] = blocksList[i];
-            i++;
-            blocksUsed++;
-        }
-        if (blocksUsed < blocksNeeded) {
-            node->next = fs_get_block(sb);
-            seek_write(sb, nodeBlock, node);
-            nodeBlock = node->next;
-            node->next = 0;
-            node->parent = fileBlock;
-            node->mode = IMCHILD | IMREG;
-            node->meta = fs_get_block(sb);
-            strcpy(meta->name, fileParts[len - 1]);
-            meta->size = cnt;
-            seek_write(sb, node->meta, meta);
+        while (i < linksLen && blocksUsed < blocksNeeded) {
+            node->links[i++] = blocksList[blocksUsed++];
         }
+        if (i < linksLen) node->links[i] = 0;
+        if (blocksUsed >= blocksNeeded) break;
+        node->next = inodes[k + 1];
+        seek_write(sb, inodes[k], node);
+        node->meta = inodes[k]; //IMCHILD: meta points to the previous inode
+        k++;
+        node->next = 0;
+        node->parent = fileBlock;
+        node->mode = IMCHILD | IMREG;
     }
-    seek_write(sb, nodeBlock, node);
-
+    seek_write(sb, inodes[k], node);
+    goto out;
+
+undo:
+    dropTaken(sb, &taken, inodesNeeded + 1, &shared);
+out:
+    freeBlockList(&taken);
+    freeBlockList(&shared);
+    free(inodes);
+    free(iov);
+    free(last);
     free(meta);
     free(node);
+    free(blocksList);
     freeFileParts(&fileParts, len);
     free(dirNode);
     free(dirName);
-
+    free(packed);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
     return 0;
 }
 
-ssize_t fs_read_file(struct superblock *sb, const char *fname, char *buf,
+int fs_write_file(struct superblock *sb, const char *fname, char *buf, size_t cnt) {
+    return fs_write_file_flags(sb, fname, buf, cnt, 0);
+}
+
+int fs_write_file_flags(struct superblock *sb, const char *fname, char *buf,
+        size_t cnt, int flags) {
+    uint64_t t0 = opBegin(sb, FS_OP_WRITE);
+    int r = writeFile(sb, fname, buf, cnt, flags);
+    opEnd(sb, FS_OP_WRITE, t0);
+    return opStatus(r);
+}
+
+/* reads the =count data blocks in =map into =p, adjacent ones with one
+ * call */
+static void readMap(struct superblock *sb, const uint64_t *map,
+        uint64_t count, char *p) {
+    uint64_t i, run;
+    for (i = 0; i < count; i += run) {
+        if (map[i] == FS_HOLE) {
+            memset(p + i * sb->blksz, 0, sb->blksz);
+            run = 1;
+            continue;
+        }
+        for (run = 1; i + run < count && map[i + run] == map[i] + run; run++);
+        seek_read_blocks(sb, map[i], run, p + i * sb->blksz, FS_BLK_DATA);
+    }
+}
+
+static ssize_t readFile(struct superblock *sb, const char *fname, char *buf,
         size_t bufsz) {
     if (existsFile(sb, fname) == FALSE) {
-        errno = ENOENT;
-        return -1;
+        return -1; /* errno from the lookup */
     }
     int len = 0, exists = 0;
     char** fileParts = getFileParts(fname, &len);
 
     uint64_t fileBlock = findFile(sb, fname, &exists);
+    const struct fs_ns *ns = nsOf(sb);
+    const uint64_t *map = NULL;
+    uint64_t fsize, fflags, stored, nmap = 0;
 
     struct inode* node;
     initNode(&node, sb->blksz);
     struct nodeinfo* meta = (struct nodeinfo*) calloc(1, sb->blksz);
 
-    seek_read(sb, fileBlock, node);
-    seek_read(sb, node->meta, meta);
-    assert(strcmp(meta->name, fileParts[len - 1]) == 0);
+    if (ns != NULL) {
+        nsFile(ns, fileBlock, &fsize, &fflags, &stored, &map, &nmap);
+    } else {
+        seek_read(sb, fileBlock, node);
+        seek_read(sb, node->meta, meta);
+        assert(strcmp(meta->name, fileParts[len - 1]) == 0);
+        fsize = meta->size;
+        fflags = meta->reserved[0];
+        stored = meta->reserved[1];
+    }
 
-    size_t size = MIN(meta->size, bufsz);
-    size = MAX(sb->blksz, size);
+    int packed = (fflags & FS_FILE_LZ4) != 0;
+    size_t size = MIN(fsize, bufsz);
+    size_t want = size;
+    if (packed) {
+        /* only the chunks holding the first =want bytes, each at most a
+         * raw chunk and its length; they are decompressed below */
+        stored = MIN(stored, (want + FS_COMPRESS_CHUNK - 1) /
+                FS_COMPRESS_CHUNK * (FS_COMPRESS_CHUNK + sizeof (uint32_t)));
+        size = stored;
+    }
+    size = MAX(1, (size + sb->blksz - 1) / sb->blksz) * sb->blksz;
     size_t read_blocks = 0;
 
+    size_t max_blocks = size / sb->blksz;
+    int maxLinks = getLinksMaxLen(sb);
     char* buf_p = (char*) calloc(1, size);
     char* p = buf_p;
-    do {
-        int i = 0;
-        while (node->links[i] != 0) {
-            seek_read(sb, node->links[i++], p);
-            p = p + sb->blksz;
-            read_blocks++;
+    if (ns != NULL) {
+        readMap(sb, map, MIN(nmap, max_blocks), buf_p);
+    } else {
+        for (;;) {
+            int i = 0;
+            while (i < maxLinks && node->links[i] != 0 &&
+                    read_blocks < max_blocks) {
+                if (node->links[i] == FS_HOLE) {
+                    memset(p, 0, sb->blksz);
+                    i++;
+                } else {
+                    seek_read_kind(sb, node->links[i++], p, FS_BLK_DATA);
+                }
+                p = p + sb->blksz;
+                read_blocks++;
+            }
+            if (node->next == 0 || read_blocks >= max_blocks)break;
+            seek_read(sb, node->next, node);
+        }
+    }
+    if (packed) {
+        if (decompressChunks(buf_p, stored, buf, want, fsize) != 0) {
+            errno = EIO;
+            want = -1;
         }
-        if (node->next == 0)break;
-        seek_read(sb, node->next, node);
-    } while (node->next != 0);
-    strcpy(buf, buf_p);
+    } else {
+        memcpy(buf, buf_p, want);
+    }
+    size = want;
     freeFileParts(&fileParts, len);
     free(meta);
     free(node);
@@ -377,158 +1029,312 @@ ssize_t fs_read_file(struct superblock *sb, const char *fname, char *buf,
     return size;
 }
 
-int fs_delete_file(struct superblock *sb, const char *fname) { //o proprio nome ja diz.
-    int i = 0, found, maxLink, ultimo;
-    uint64_t fileBlock, fileLinkBlk, lastBlock, folderBlock; //numero do bloco e do bloco do link no diretorio que tem ele
+ssize_t fs_read_file(struct superblock *sb, const char *fname, char *buf,
+        size_t bufsz) {
+    uint64_t t0 = opBegin(sb, FS_OP_READ);
+    ssize_t r = readFile(sb, fname, buf, bufsz);
+    opEnd(sb, FS_OP_READ, t0);
+    return opStatus(r);
+}
 
+/* Unlink the entity at =fname from its directory and free every block it
+ * owns in one batch.  =dirOk allows directories, =nonEmptyOk allows
+ * directories that still have entries. */
+static int removeEntity(struct superblock *sb, const char *fname, int dirOk,
+        int nonEmptyOk) {
+    int found;
+    uint64_t fileBlock, dirBlock;
     struct inode *file;
-    struct inode *folder;
-    struct inode *aux;
-    struct nodeinfo *folderInfo;
-
-    maxLink = getLinksMaxLen(sb);
-    file = (struct inode *) malloc(sb->blksz);
-    folder = (struct inode *) malloc(sb->blksz);
-    aux = (struct inode *) malloc(sb->blksz);
-    folderInfo = (struct nodeinfo *) malloc(sb->blksz);
+    struct nodeinfo *info;
+    struct blocklist blocks, data;
 
+    if (!checkWritable(sb)) {
+        return -1;
+    }
+    if (unsharePath(sb, fname, FALSE) != 0) {
+        return -1;
+    }
     fileBlock = findFile(sb, fname, &found);
-
     if (found == 0) { //arquivo nao existe
-        errno = ENOENT;
+        return -1;
+    }
+    if (fileBlock == sb->root) {
+        errno = EBUSY;
         return -1;
     }
 
+    file = (struct inode *) malloc(sb->blksz);
+    info = (struct nodeinfo *) malloc(sb->blksz);
     seek_read(sb, fileBlock, file); //pegando inode do arquivo
-    if (file->mode == IMDIR) { //se for diretorio
-        errno = EISDIR;
+    seek_read(sb, file->meta, info);
+    int err = 0;
+    if (file->mode == IMDIR && !dirOk) {
+        err = EISDIR;
+    } else if (file->mode != IMDIR && dirOk && !nonEmptyOk) {
+        err = ENOTDIR;
+    } else if (file->mode == IMDIR && info->size != 0 && !nonEmptyOk) {
+        err = ENOTEMPTY;
+    }
+    if (err != 0) {
+        free(file);
+        free(info);
+        errno = err;
         return -1;
     }
 
-    folderBlock = file->parent;
-    fileLinkBlk = folderBlock;
-    seek_read(sb, folderBlock, folder); //diretorio onde esta o arquivo
-    seek_read(sb, folder->meta, folderInfo);
+    /* the parent pointer of a shared entity may name a snapshot's copy of
+     * the directory, so resolve the directory through the path */
+    dirBlock = findParent(sb, fname, &found);
+    initBlockList(&blocks);
+    initBlockList(&data);
+    collectBlocks(sb, fileBlock, &blocks, &data);
+    removeFromDir(sb, dirBlock, fileBlock, &blocks);
+    if (sb->features & FS_FEAT_DEDUP) dedupForget(sb, data.v, data.n);
+    putBlocks(sb, blocks.v, blocks.n);
+
+    freeBlockList(&blocks);
+    freeBlockList(&data);
+    free(file);
+    free(info);
+    return 0;
+}
+
+int fs_delete_file(struct superblock *sb, const char *fname) {
+    uint64_t t0 = opBegin(sb, FS_OP_DELETE);
+    int r = removeEntity(sb, fname, FALSE, FALSE);
+    opEnd(sb, FS_OP_DELETE, t0);
+    return opStatus(r);
+}
 
+int fs_rmdir(struct superblock *sb, const char *dname) {
+    uint64_t t0 = opBegin(sb, FS_OP_RMDIR);
+    int r = removeEntity(sb, dname, TRUE, FALSE);
+    opEnd(sb, FS_OP_RMDIR, t0);
+    return opStatus(r);
+}
 
-    //removendo o arquivo e blocos associados
-    fs_put_block(sb, file->meta); //liberando bloco nodeinfo
-    while ((i < maxLink) && (file->links[i] != 0)) {
-        //if (i == maxLink)
-        fs_put_block(sb, file->links[i]);
-        file->links[i] = 0; //marcando que nao tem mais bloco neste link.
-        i++;
-        if (i == maxLink && file->next != 0) {
-            seek_read(sb, file->next, file);
-            fs_put_block(sb, file->meta); //apagando bloco anterior depois de ir pro próximo.
-            i = 0;
-        }
+int fs_remove_tree(struct superblock *sb, const char *fname) {
+    uint64_t t0 = opBegin(sb, FS_OP_REMOVE_TREE);
+    int r = removeEntity(sb, fname, TRUE, TRUE);
+    opEnd(sb, FS_OP_REMOVE_TREE, t0);
+    return opStatus(r);
+}
+
+void fs_get_stats(const struct superblock *sb, struct fs_stats *stats) {
+    const uint64_t *src = (const uint64_t *) &sb->state->stats;
+    uint64_t *dst = (uint64_t *) stats;
+    size_t i;
+    for (i = 0; i < sizeof (struct fs_stats) / sizeof (uint64_t); i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
     }
-    //removendo na pasta tambem;
-    ultimo = (folder->links[getLinksLen(folder) - 1] == fileBlock);
-    if (ultimo) {
-        folder->links[getLinksLen(folder) - 1] = 0;
-        //folderInfo->size--;
-    } else {
-        i = 0;
-        while ((folder->links[i % maxLink] != fileBlock) && i < folderInfo->size) {
-            i++;
-            if ((i % maxLink == 0) && (folder->next != 0)) {
-                fileLinkBlk = folder->next; //guardando bloco que pode conter link pro arquivo. Saindo do while sera ele.
-                seek_read(sb, folder->next, folder);
-            }
-        }
-        lastBlock = getNodeLastLinkBlock(sb, folderBlock);
-        if (lastBlock == fileLinkBlk) {
-            folder->links[i % maxLink] = folder->links[getLinksLen(folder) - 1];
-            folder->links[getLinksLen(folder) - 1] = 0;
-        } else {
-            seek_read(sb, lastBlock, aux);
-            folder->links[i % maxLink] = aux->links[getLinksLen(aux) - 1]; //copiando ultimo link pra posicao q indicava bloco do arquivo removido
-            aux->links[getLinksLen(aux) - 1] = 0;
-            seek_write(sb, lastBlock, aux); //Devo escrever o bloco alterado de volta no disco, certo?
-        }
+}
+
+void fs_reset_stats(struct superblock *sb) {
+    memset(&sb->state->stats, 0, sizeof (struct fs_stats));
+}
+
+static int renameEntity(struct superblock *sb, const char *oldname,
+        const char *newname) {
+    int found, len = 0, err = 0;
+    uint64_t srcBlock, dstBlock, oldDir, newDir, b;
+    struct inode *src, *node;
+    struct nodeinfo *info;
+    struct blocklist freed, data;
+    char **fileParts;
 
+    if (!checkWritable(sb)) {
+        return -1;
+    }
+    if (existsFile(sb, oldname) && (unsharePath(sb, oldname, TRUE) != 0 ||
+            unsharePath(sb, newname, FALSE) != 0)) {
+        return -1;
+    }
+    srcBlock = findFile(sb, oldname, &found);
+    if (!found) {
+        return -1;
+    }
+    if (srcBlock == sb->root) {
+        errno = EBUSY;
+        return -1;
+    }
+    oldDir = findParent(sb, oldname, &found);
+    newDir = findParent(sb, newname, &found);
+    if (!found) {
+        return -1;
     }
-    folderInfo->size--;
 
-    seek_write(sb, fileLinkBlk, folder); //escrevendo o que contem o link pro arquivo (foi alterado ali em cima)
-    seek_read(sb, folderBlock, folder); //voltando pro inode principal da pasta
-    seek_write(sb, folder->meta, folderInfo); //pra escrever o folderinfo no bloco onde ele estava.
+    src = (struct inode *) malloc(sb->blksz);
+    node = (struct inode *) malloc(sb->blksz);
+    info = (struct nodeinfo *) malloc(sb->blksz);
+    fileParts = getFileParts(newname, &len);
+    initBlockList(&freed);
+    initBlockList(&data);
+
+    seek_read(sb, srcBlock, src);
+    seek_read(sb, newDir, node);
+    dstBlock = findInDir(sb, newDir, fileParts[len - 1]);
+    if (node->mode != IMDIR) {
+        err = ENOTDIR;
+    } else if (strlen(fileParts[len - 1]) > getFileNameMaxLen(sb)) {
+        err = ENAMETOOLONG;
+    } else if (dstBlock == srcBlock) {
+        goto out; //same entity: nothing to do
+    }
+    /* a directory cannot be moved below itself */
+    for (b = newDir; err == 0 && src->mode == IMDIR; b = node->parent) {
+        if (b == srcBlock) err = EINVAL;
+        if (b == sb->root) break;
+        seek_read(sb, b, node);
+    }
+    if (err == 0 && dstBlock != 0) {
+        seek_read(sb, dstBlock, node);
+        seek_read(sb, node->meta, info);
+        if (node->mode == IMDIR && src->mode != IMDIR) {
+            err = EISDIR;
+        } else if (node->mode != IMDIR && src->mode == IMDIR) {
+            err = ENOTDIR;
+        } else if (node->mode == IMDIR && info->size != 0) {
+            err = ENOTEMPTY;
+        }
+    }
+    if (err != 0) goto out;
+
+    /* the new link is recorded in =info, so removeFromDir still finds the
+     * old one through the hint on disk */
+    seek_read(sb, src->meta, info);
+    if (dstBlock != 0) {
+        /* the new name is published by a single link write; the replaced
+         * entity is freed afterwards */
+        replaceInDir(sb, newDir, dstBlock, srcBlock, info);
+        collectBlocks(sb, dstBlock, &freed, &data);
+    } else if (newDir != oldDir) {
+        insertInBlock(sb, newDir, srcBlock, info);
+    }
+    if (dstBlock != 0 || newDir != oldDir) {
+        removeFromDir(sb, oldDir, srcBlock, &freed);
+    }
 
-    free(file);
-    free(folder);
-    free(folderInfo);
-    free(aux);
+    src->parent = newDir;
+    seek_write(sb, srcBlock, src);
+    strcpy(info->name, fileParts[len - 1]);
+    seek_write(sb, src->meta, info);
+    if (sb->features & FS_FEAT_DEDUP) dedupForget(sb, data.v, data.n);
+    putBlocks(sb, freed.v, freed.n);
 
+out:
+    freeBlockList(&freed);
+    freeBlockList(&data);
+    freeFileParts(&fileParts, len);
+    free(src);
+    free(node);
+    free(info);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
     return 0;
 }
 
-char * fs_list_dir(struct superblock *sb, const char *dname) { //lista tudo o que tem dentro de dname.
-    int i = 0, found, size, isDir;
-    uint64_t dirBlock;
-    int maxLink;
-    char *names;
+int fs_rename(struct superblock *sb, const char *oldname,
+        const char *newname) {
+    uint64_t t0 = opBegin(sb, FS_OP_RENAME);
+    int r = renameEntity(sb, oldname, newname);
+    opEnd(sb, FS_OP_RENAME, t0);
+    return opStatus(r);
+}
 
+static struct fs_dirent * listDirPlus(struct superblock *sb, const char *dname,
+        size_t *count) {
+    int found;
+    uint64_t dirBlock;
     struct inode *dir;
-    struct inode *aux;
-    struct nodeinfo *auxinfo;
-
-    maxLink = getLinksMaxLen(sb);
-    dir = (struct inode *) malloc(sb->blksz);
-    aux = (struct inode *) malloc(sb->blksz);
-    auxinfo = (struct nodeinfo *) malloc(sb->blksz);
-    names = (char *) malloc(sizeof (char));
-
-    strcpy(names, ""); //comecara 'nulo'
 
-    dirBlock = findFile(sb, dname, &found); //vasculhandodo o diretorio
-
-    if (found == 0) { //o dretorio nao existe
-        errno = ENOENT;
+    dirBlock = findFile(sb, dname, &found);
+    if (found == 0) {
         return NULL;
     }
 
-    seek_read(sb, dirBlock, dir); //pegando inode do diretorio
-    if (dir->mode != IMDIR) { //se nao for diretorio
+    if (nsOf(sb) != NULL) {
+        if (nsMode(nsOf(sb), dirBlock) != IMDIR) {
+            errno = ENOTDIR;
+            return NULL;
+        }
+        return nsEntries(nsOf(sb), dirBlock, count);
+    }
+    dir = (struct inode *) malloc(sb->blksz);
+    seek_read(sb, dirBlock, dir);
+    if (dir->mode != IMDIR) {
+        free(dir);
         errno = ENOTDIR;
         return NULL;
     }
+    free(dir);
 
-    while (i < maxLink && dir->links[i] != 0) { //buscar em todos os links do bloco
+    return getDirEntries(sb, dirBlock, count);
+}
 
-        seek_read(sb, dir->links[i], aux); //objeto de 'links', sempre sera inode IMREG ou IMDIR
-        seek_read(sb, aux->meta, auxinfo); //nodeinfo dele
+struct fs_dirent * fs_list_dir_plus(struct superblock *sb, const char *dname,
+        size_t *count) {
+    uint64_t t0 = opBegin(sb, FS_OP_LIST);
+    struct fs_dirent *r = listDirPlus(sb, dname, count);
+    opEnd(sb, FS_OP_LIST, t0);
+    if (r != NULL && opFailed()) {
+        fs_free_dirents(r, *count);
+        errno = EIO;
+        return NULL;
+    }
+    return r;
+}
 
-        if (aux->mode == IMDIR)
-            isDir = 1;
-        else
-            isDir = 0;
+void fs_free_dirents(struct fs_dirent *ents, size_t count) {
+    size_t i;
+    if (ents == NULL) return;
+    for (i = 0; i < count; i++) {
+        free(ents[i].name);
+    }
+    free(ents);
+}
 
-        size = strlen(auxinfo->name) + 1 + isDir; //pegando tamanho do nome mais um espaco e mais uma barra (ou nao)
-        char* temp = (char *) malloc((size + strlen(names) + 1) * sizeof (char));
-        strcpy(temp, names);
-        strcat(temp, auxinfo->name);
-        free(names);
-        names = temp;
-        if (isDir)
-            strcat(names, "/");
-        strcat(names, " "); //concatenando espaco de separacao de nomes
+static char * listDir(struct superblock *sb, const char *dname) {
+    size_t i, count, size = 1;
+    char *names, *p;
+    struct fs_dirent *ents;
 
-        i++;
-        if (i == maxLink && (dir->next != 0)) {
-            i = 0; //tem next? reseta contagem
-            seek_read(sb, dir->next, dir); //indo pro proximo inode, se houver.
-        }
+    ents = listDirPlus(sb, dname, &count);
+    if (ents == NULL) {
+        return NULL;
     }
 
-    free(dir);
-    free(aux);
-    free(auxinfo);
+    for (i = 0; i < count; i++) { //nome mais um espaco e mais uma barra (ou nao)
+        size += strlen(ents[i].name) + 1 + (ents[i].mode == IMDIR);
+    }
+    names = (char *) malloc(size * sizeof (char));
+    p = names;
+    for (i = 0; i < count; i++) {
+        p = stpcpy(p, ents[i].name);
+        if (ents[i].mode == IMDIR)
+            *p++ = '/';
+        *p++ = ' '; //espaco de separacao de nomes
+    }
+    *p = '\0';
+
+    fs_free_dirents(ents, count);
     printf("%s\n", names);
     return names;
 }
 
+char * fs_list_dir(struct superblock *sb, const char *dname) {
+    uint64_t t0 = opBegin(sb, FS_OP_LIST);
+    char *r = listDir(sb, dname);
+    opEnd(sb, FS_OP_LIST, t0);
+    if (r != NULL && opFailed()) {
+        free(r);
+        errno = EIO;
+        return NULL;
+    }
+    return r;
+}
+
 
 /*
  * Leobas:
@@ -553,14 +1359,14 @@ char * fs_list_dir(struct superblock *sb, const char *dname) { //lista tudo o qu
 #define invalid -1
 #define success 0
 
-void init_folder_struct(struct inode* folder, uint64_t folder_block, uint64_t nodeinfo_block) {
+void init_folder_struct(struct inode* folder, uint64_t parent_block, uint64_t nodeinfo_block) {
 
     /* inode properties for a folder */
 
     /* =mode indicates that the inode is a directory */
     folder->mode = IMDIR;
-    /* =parent points to the block that contains this inode */
-    folder->parent = folder_block;
+    /* =parent points to the directory that contains this folder */
+    folder->parent = parent_block;
     /* start the =next value with 0 */
     folder->next = 0;
     /* =meta value must point to the nodeinfo block */
@@ -615,7 +1421,11 @@ int checkfather_path(struct superblock *sb, const char *dname, struct inode* fat
     }
 }
 
-int fs_mkdir(struct superblock *sb, const char *dname) {
+static int makeDir(struct superblock *sb, const char *dname) {
+
+    if (!checkWritable(sb)) {
+        return invalid;
+    }
 
     if (!sb->freeblks) {
         // disk is full
@@ -625,6 +1435,9 @@ int fs_mkdir(struct superblock *sb, const char *dname) {
 
     int exists = 0;
 
+    if (unsharePath(sb, dname, FALSE) != 0) {
+        return invalid;
+    }
     uint64_t fileBlock = findFile(sb, dname, &exists);
 
     if (exists) {
@@ -632,15 +1445,18 @@ int fs_mkdir(struct superblock *sb, const char *dname) {
         errno = EEXIST;
         return invalid;
     }
+    if (errno == ENOTDIR) {
+        return invalid;
+    }
 
     struct inode *father = (struct inode*) malloc(sb->blksz);
-    struct inode *folder = (struct inode*) malloc(sb->blksz);
-    struct nodeinfo *n_info = (struct nodeinfo*) malloc(sb->blksz);
+    struct inode *folder = (struct inode*) calloc(1, sb->blksz);
+    struct nodeinfo *n_info = (struct nodeinfo*) calloc(1, sb->blksz);
 
-    uint64_t folder_block = fs_get_block(sb);
-    uint64_t nodeinfo_block = fs_get_block(sb);
+    uint64_t folder_block = getBlock(sb, FS_BLK_META);
+    uint64_t nodeinfo_block = getBlock(sb, FS_BLK_META);
 
-    init_folder_struct(folder, folder_block, nodeinfo_block);
+    init_folder_struct(folder, fileBlock, nodeinfo_block);
     int status = init_nodeinfo_struct(sb, dname, n_info, nodeinfo_block);
 
     if (status == invalid) {
@@ -677,7 +1493,7 @@ int fs_mkdir(struct superblock *sb, const char *dname) {
 
     /* Ok, proceed */
     if (!exists) {
-        insertInBlock(sb, fileBlock, folder_block);
+        insertInBlock(sb, fileBlock, folder_block, n_info);
 
         /* store both inodes related to the folder that
                  has been just created
@@ -697,3 +1513,10 @@ int fs_mkdir(struct superblock *sb, const char *dname) {
 
     return success;
 }
+
+int fs_mkdir(struct superblock *sb, const char *dname) {
+    uint64_t t0 = opBegin(sb, FS_OP_MKDIR);
+    int r = makeDir(sb, dname);
+    opEnd(sb, FS_OP_MKDIR, t0);
+    return opStatus(r);
+}
@@ -16,9 +16,14 @@
  * ETXTBUSY (text file busy)
  * EPERM (operation not permitted)
  * EACCES (permission denied)
+ * EROFS (read-only filesystem)
+ * EMLINK (too many links)
+ * EIO (short read, or a block failed its checksum)
  */
 
+#include <stdio.h>
 #include <inttypes.h>
+#include <sys/types.h>
 
 #define IMREG 1   /* regular inode */
 #define IMDIR 2   /* directory inode */
@@ -31,9 +36,50 @@ struct superblock {
     uint64_t freeblks; /* number of free blocks in the filesystem */
     uint64_t freelist; /* pointer to free block list */
     uint64_t root; /* pointer to root directory's inode */
+    /* first block of the reference count table (one byte per block), or
+     * zero if no snapshot was ever taken.  see fs_snapshot. */
+    uint64_t refmap;
+    uint64_t snapshots; /* directory holding snapshot roots, or zero */
+    uint64_t features; /* FS_FEAT_* flags chosen at format time */
+    /* first block of the data checksum table (FS_FEAT_DATA_CSUM), or zero */
+    uint64_t csums;
+    /* blocks from =tail to =blks were never used.  they are counted in
+     * =freeblks but are not on the free list, which keeps formatting O(1);
+     * fs_get_block takes them once the free list is empty. */
+    uint64_t tail;
+    /* first block of the dedup index (FS_FEAT_DEDUP), or zero */
+    uint64_t dedup;
+    /* number of image files the blocks are striped over and the blocks in
+     * each stripe unit (FS_FEAT_STRIPED), or zero.  32 bits keep the
+     * superblock within MIN_BLOCK_SIZE. */
+    uint32_t stripes;
+    uint32_t stripeUnit;
     int fd; /* file descriptor for the filesystem image */
+    int flags; /* in-memory only: FS_RDONLY, FS_VIEW */
+    struct fs_state *state; /* in-memory only */
 };
 
+/* Metadata blocks (superblock, inodes, nodeinfo, free pages, tables) end
+ * with the CRC-32C of the rest of the block, verified on every read. */
+#define FS_FEAT_META_CSUM 1
+/* The CRC-32C of every data block is kept in a table at =csums, four
+ * bytes per block, zero meaning "not recorded". */
+#define FS_FEAT_DATA_CSUM 2
+/* Data blocks with the same content are stored once: fs_write_file looks
+ * every block up in a hash index at =dedup and shares a block already
+ * holding those bytes, counting the reference in the table at =refmap. */
+#define FS_FEAT_DEDUP 4
+/* The blocks are striped over =stripes image files, =stripeUnit blocks at
+ * a time; see fs_format_striped. */
+#define FS_FEAT_STRIPED 8
+/* The superblock records =tail.  fs_format always sets it; images made
+ * before the field have every block up to =blks on the free list and are
+ * upgraded when opened. */
+#define FS_FEAT_TAIL 16
+
+#define FS_RDONLY 1 /* mutating calls fail with EROFS */
+#define FS_VIEW 2 /* snapshot view sharing the fd of another superblock */
+
 struct inode {
     uint64_t mode;
     /* if =mode does not contain IMCHILD, then =parent points to the
@@ -50,23 +96,37 @@ struct inode {
     uint64_t next;
     /* if =mode contains IMDIR, then entries in =links point to inode's
      * for each entity in the directory.  otherwise, if =mode contains
-     * IMREG, then entries in =links point to this file's data blocks. */
+     * IMREG, then entries in =links point to this file's data blocks;
+     * FS_HOLE stands for a block of zeros that takes no space. */
     uint64_t links[];
 };
 
+#define FS_HOLE ((uint64_t) -1)
+
 struct nodeinfo {
     /* for files (mode IMREG), =size should contain the size of the file in 
      * bytes.  for directories (mode IMDIR), =size should contain the
      * number of files in the directory. */
     uint64_t size;
     /* reserving some space to implement security and ownership in the
-     * future. */
+     * future.  for files, reserved[0] holds FS_FILE_* flags and, when
+     * FS_FILE_LZ4 is set, reserved[1] the number of bytes stored in the
+     * data blocks.  for directories, reserved[2] names the last block of
+     * the link chain; for every entity, reserved[3] names the link block
+     * of its directory holding its link and reserved[4] the slot there.
+     * these three are hints, checked against the block they name. */
     uint64_t reserved[7];
     /* remainder of block used to store this entity's name. */
     char name[];
 
 };
 
+/* The data blocks hold the file in LZ4 chunks of FS_COMPRESS_CHUNK bytes,
+ * each stored as a uint32_t length followed by the compressed chunk (or by
+ * the chunk itself when the top bit of the length is set). */
+#define FS_FILE_LZ4 1
+#define FS_COMPRESS_CHUNK 65536
+
 struct freepage {
     uint64_t next;
     /* link to next freepage; or zero if this is the last freepage */
@@ -77,6 +137,79 @@ struct freepage {
      * links[counts-1]. */
 };
 
+/* One directory entry as returned by fs_list_dir_plus. */
+struct fs_dirent {
+    uint64_t block; /* block of the entry's (first) inode */
+    uint64_t mode; /* IMREG or IMDIR */
+    /* nodeinfo size: bytes for files, number of entries for directories */
+    uint64_t size;
+    char *name;
+};
+
+/* Block classes counted by fs_get_stats. */
+enum fs_blktype {
+    FS_BLK_SUPER, /* the superblock */
+    FS_BLK_META, /* inodes, nodeinfo, directory links, snapshot tables */
+    FS_BLK_DATA, /* file contents */
+    FS_BLK_FREE, /* free list pages */
+    FS_BLK_TYPES
+};
+
+/* API calls timed by fs_get_stats. */
+enum fs_op {
+    FS_OP_WRITE, FS_OP_READ, FS_OP_DELETE, FS_OP_MKDIR, FS_OP_RMDIR,
+    FS_OP_REMOVE_TREE, FS_OP_RENAME, FS_OP_LIST, FS_OP_WALK, FS_OP_SNAPSHOT,
+    FS_OP_GROW, FS_OP_DEFRAG, FS_OP_SHRINK, FS_OP_PRELOAD,
+    FS_OP_SNAPSHOT_DELETE, FS_OP_SNAPSHOT_OPEN, FS_OP_OPEN, FS_OP_CLOSE,
+    FS_OP_GET_BLOCK, FS_OP_PUT_BLOCK, FS_OP_PUT_BLOCKS, FS_OP_FSCK,
+    FS_OP_SNAPSHOT_LIST, FS_OPS
+};
+
+struct fs_stats {
+    uint64_t reads[FS_BLK_TYPES]; /* blocks read, by class */
+    uint64_t writes[FS_BLK_TYPES]; /* blocks written, by class */
+    uint64_t allocs; /* blocks taken from free space */
+    uint64_t frees; /* blocks returned to free space */
+    uint64_t lookup_components; /* directories searched by path lookups */
+    uint64_t calls[FS_OPS]; /* API calls */
+    uint64_t latency_ns[FS_OPS]; /* cumulative time spent in API calls */
+    uint64_t io_errors; /* short reads and reads failing their checksum */
+    uint64_t dedup_hits; /* data blocks shared instead of written */
+    uint64_t holes; /* zero data blocks written as holes */
+};
+
+/* Events recorded by fs_trace_start. */
+enum fs_trace_type {
+    FS_TR_BEGIN, /* API call entered; =arg is its enum fs_op */
+    FS_TR_END, /* API call returned; =arg is its enum fs_op */
+    FS_TR_READ, /* =count blocks read from =block; =arg is the fs_blktype */
+    FS_TR_WRITE, /* =count blocks written at =block; =arg is the fs_blktype */
+    FS_TR_ALLOC, /* =count blocks taken from free space, first one =block */
+    FS_TR_FREE /* =count blocks returned to free space, first one =block */
+};
+
+struct fs_trace_event {
+    uint64_t ts_ns; /* CLOCK_MONOTONIC */
+    uint64_t block;
+    uint32_t count;
+    uint32_t tid; /* kernel thread id */
+    uint16_t type; /* enum fs_trace_type */
+    uint16_t arg;
+    uint32_t pad;
+};
+
+/* A trace file is this header followed by =count events, oldest first. */
+#define FS_TRACE_MAGIC "DCCTRACE"
+#define FS_TRACE_VERSION 1
+
+struct fs_trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t evsize; /* sizeof (struct fs_trace_event) */
+    uint64_t count; /* events in the file */
+    uint64_t dropped; /* older events overwritten by the ring buffer */
+};
+
 #define MIN_BLOCK_SIZE 128
 #define MIN_BLOCK_COUNT 32
 
@@ -86,21 +219,81 @@ struct freepage {
  * computed from the file size.  The filesystem will be initialized with an
  * empty root directory.  This function returns NULL on error and sets errno
  * to the appropriate error code.  If the block size is smaller than
- * MIN_BLOCK_SIZE bytes, then the format fails and the function sets errno to
- * EINVAL.  If there is insufficient space to store MIN_BLOCK_COUNT blocks in
+ * MIN_BLOCK_SIZE bytes or not a power of two, then the format fails and the
+ * function sets errno to EINVAL.  If there is insufficient space to store MIN_BLOCK_COUNT blocks in
  * =fname, then the function fails and sets errno to ENOSPC. */
 struct superblock * fs_format(const char *fname, uint64_t blocksize);
 
+/* Like fs_format, choosing the FS_FEAT_* flags of the new filesystem.
+ * fs_format enables FS_FEAT_META_CSUM. */
+struct superblock * fs_format_features(const char *fname, uint64_t blocksize,
+        uint64_t features);
+
+/* Like fs_format_features, striping the filesystem over the =n image files
+ * in =fnames, which may sit on different disks: block b is in stripe unit
+ * u = b / =unit blocks, stored on image u % =n, so sequential transfers
+ * spread over all of them and the parts on different images proceed in
+ * parallel.  Every image contributes as many whole units as the smallest
+ * one holds.  The images must be given to fs_open_striped in the same
+ * order.  With =n one this is fs_format_features and =unit is ignored.
+ * Fails with EINVAL if =n is below one or =unit is zero or over 2^32 - 1. */
+struct superblock * fs_format_striped(const char **fnames, int n,
+        uint64_t blocksize, uint64_t unit, uint64_t features);
+
 /* Open the filesystem in =fname and return its superblock.  Returns NULL on
  * error, and sets errno accordingly.  If =fname does not contain a
- * 0xdcc605fs, then errno is set to EBADF. */
+ * 0xdcc605fs, then errno is set to EBADF; if the superblock fails its
+ * checksum, to EIO.  Calls that read a block failing its checksum still
+ * complete but then return an error with errno set to EIO.  A striped
+ * filesystem fails with EINVAL; it is opened with fs_open_striped. */
 struct superblock * fs_open(const char *fname);
 
+#define FS_OPEN_SHARED 1 /* read-only, alongside other FS_OPEN_SHARED opens */
+#define FS_OPEN_PRELOAD 2 /* keep the whole namespace in memory */
+
+/* Like fs_open.  fs_open locks the image exclusively, so any other open
+ * fails with EBUSY; with FS_OPEN_SHARED the image is opened read-only
+ * under a shared lock instead, which any number of shared opens can hold
+ * at once (an exclusive open still fails with EBUSY while they do, and
+ * they do while it is held).  Mutating calls on a shared open fail with
+ * EROFS.  Its blocks are read from a read-only mapping of the image, so
+ * every process reading it shares the same cached pages.
+ *
+ * FS_OPEN_PRELOAD reads every inode, name and directory link block in one
+ * pass at open, in ascending block order, and keeps the namespace in
+ * memory: path lookups, fs_list_dir, fs_list_dir_plus and finding the data
+ * blocks of a file read no metadata afterwards, and runs of adjacent data
+ * blocks are read with one call.  Snapshot views read from disk.  The
+ * first call that changes the filesystem drops the namespace, so it is
+ * meant for FS_OPEN_SHARED serving images.  The open fails with EIO if the
+ * pass cannot read the tree. */
+struct superblock * fs_open_flags(const char *fname, int flags);
+
+/* Like fs_open_flags, for a filesystem formatted by fs_format_striped over
+ * the =n images in =fnames, given in their format order.  Every image is
+ * locked.  Fails with EINVAL if the filesystem is striped over a different
+ * number of images.  A shared open of a striped filesystem reads with
+ * pread rather than through a mapping. */
+struct superblock * fs_open_striped(const char **fnames, int n, int flags);
+
 /* Close the filesystem pointed to by =sb.  Returns zero on success and a
  * negative number on error.  If there is an error, all resources are freed
  * and errno is set appropriately. */
 int fs_close(struct superblock *sb);
 
+/* Grow the open filesystem to fill =size bytes, extending its image file
+ * if it is shorter.  The new blocks join the never used tail, so growing
+ * takes constant time however many blocks are added; the reference and
+ * data checksum tables are copied to larger ones when they no longer
+ * cover the image.  Every change reaches the image in a single
+ * superblock write, after which the old table blocks are freed (a crash
+ * in between only leaks them, which fs_fsck repairs).  =size counts the
+ * blocks of every image of a striped filesystem, and each image is
+ * extended to hold its share.  Returns zero on
+ * success or -1 with errno set (EINVAL if =size is smaller than the
+ * filesystem, ENOSPC if the grown tables do not fit, EROFS). */
+int fs_grow(struct superblock *sb, uint64_t size);
+
 /* Get a free block in the filesystem.  This block shall be removed from the
  * list of free blocks in the filesystem.  If there are no free blocks, zero
  * is returned.  If an error occurs, (uint64_t)-1 is returned and errno is set
@@ -112,6 +305,13 @@ uint64_t fs_get_block(struct superblock *sb);
  * accordingly. */
 int fs_put_block(struct superblock *sb, uint64_t block);
 
+/* Put the =count blocks in =blocks back into the filesystem at once.  The
+ * array is sorted (and duplicates dropped) in place; the blocks are chained
+ * in ascending order, adjacent free pages are written together and the
+ * superblock is written once.  Returns zero on success or a negative value
+ * on error, setting errno (EINVAL for a block outside the filesystem). */
+int fs_put_blocks(struct superblock *sb, uint64_t *blocks, size_t count);
+
 /*
  * Escreve cnt bytes de buf no sistema de arquivos apontado por sb. 
  * Os dados serão escritos num arquivo chamado fname. 
@@ -121,6 +321,16 @@ int fs_put_block(struct superblock *sb, uint64_t block);
  */
 int fs_write_file(struct superblock *sb, const char *fname, char *buf, size_t cnt);
 
+#define FS_WRITE_COMPRESS 1 /* store the data LZ4 compressed (FS_FILE_LZ4) */
+
+/* Like fs_write_file, with FS_WRITE_* =flags.  With FS_WRITE_COMPRESS the
+ * file is compressed in chunks of FS_COMPRESS_CHUNK bytes, each kept raw
+ * if it does not shrink, and stored uncompressed if that takes no more
+ * blocks.  fs_read_file decompresses transparently and only as many
+ * chunks as =bufsz needs. */
+int fs_write_file_flags(struct superblock *sb, const char *fname, char *buf,
+        size_t cnt, int flags);
+
 /*
  * Lê os primeiros bufsz bytes do arquivo fname e coloca no vetor apontado por buf.
  * Retorna a quantidade de bytes lidos em caso de sucesso 
@@ -134,10 +344,186 @@ ssize_t fs_read_file(struct superblock *sb, const char *fname, char *buf,
 
 int fs_delete_file(struct superblock *sb, const char *fname);
 
+/* Remove the empty directory =dname.  Fails with ENOTEMPTY if it still has
+ * entries, ENOTDIR if it is not a directory and EBUSY for the root. */
+int fs_rmdir(struct superblock *sb, const char *dname);
+
+/* Remove =fname and, if it is a directory, everything below it.  All blocks
+ * of the subtree are collected first and freed with a single call to
+ * fs_put_blocks.  Returns zero on success or -1 with errno set (ENOENT,
+ * EBUSY for the root). */
+int fs_remove_tree(struct superblock *sb, const char *fname);
+
 int fs_mkdir(struct superblock *sb, const char *dname);
 
+/* Move =oldname to =newname without copying data: the entity's inode is
+ * unlinked from its old directory and linked into the new one, and only its
+ * =parent pointer and nodeinfo name are rewritten.  If =newname exists it is
+ * replaced by a single link update and then freed, so readers see either
+ * the old or the new entity.  Returns zero on success or -1 with errno set
+ * (ENOENT, ENOTDIR, EISDIR, ENOTEMPTY, ENAMETOOLONG, EBUSY for the root,
+ * EINVAL when moving a directory below itself). */
+int fs_rename(struct superblock *sb, const char *oldname, const char *newname);
+
 char * fs_list_dir(struct superblock *sb, const char *dname);
 
+/* List the directory =dname in a single pass over its links, returning the
+ * name, mode, size and inode block of every entry.  The number of entries is
+ * stored in =count.  The returned array must be released with
+ * fs_free_dirents.  Returns NULL on error and sets errno (ENOENT if =dname
+ * does not exist, ENOTDIR if it is not a directory). */
+struct fs_dirent * fs_list_dir_plus(struct superblock *sb, const char *dname,
+        size_t *count);
+
+void fs_free_dirents(struct fs_dirent *ents, size_t count);
+
+/* Callback for fs_walk.  =path is the full path of the entry described by
+ * =ent.  When fs_walk runs with more than one thread the callback is called
+ * concurrently from all of them.  Returning FS_WALK_SKIP does not descend
+ * into =ent; any other non-zero value stops the walk. */
+#define FS_WALK_SKIP (-2)
+
+typedef int (*fs_walk_fn)(const char *path, const struct fs_dirent *ent,
+        void *arg);
+
+/* Visit every entry below the directory =root breadth-first, calling =fn
+ * once per entry (=root itself is not reported).  Directories are expanded
+ * by =nthreads workers that steal work from each other, so sibling
+ * subtrees are read concurrently.  The filesystem must not be modified
+ * during the walk.  Returns zero after a full walk, the non-zero value
+ * returned by =fn if it stopped the walk, or -1 on error with errno set
+ * (ENOENT, ENOTDIR). */
+int fs_walk(struct superblock *sb, const char *root, fs_walk_fn fn, void *arg,
+        int nthreads);
+
+
+/* Copy the counters gathered since the filesystem was opened (or since the
+ * last fs_reset_stats) into =stats.  Counters are updated atomically, so
+ * this may be called while other threads use the filesystem.  Snapshot
+ * views share the counters of the superblock they were opened from. */
+void fs_get_stats(const struct superblock *sb, struct fs_stats *stats);
+
+void fs_reset_stats(struct superblock *sb);
+
+/* Switch the image of =sb to O_DIRECT (=on non-zero) or back to the page
+ * cache.  Blocks are read and written whole at block offsets, so the block
+ * size must be a multiple of the device's O_DIRECT alignment; unaligned
+ * buffers are bounced through a pool of aligned ones.  Fails with EINVAL
+ * if the block size does not fit, for snapshot views, or if the underlying
+ * filesystem does not support O_DIRECT. */
+int fs_set_direct_io(struct superblock *sb, int on);
+
+/* Problems found by fs_fsck, by kind. */
+struct fs_fsck_report {
+    uint64_t leaked; /* blocks neither in use nor free */
+    uint64_t doubled; /* blocks in use twice, or both in use and free */
+    uint64_t bad_parent; /* inodes whose =parent pointer is wrong */
+    uint64_t bad_size; /* nodeinfo sizes that disagree with the entity */
+    uint64_t bad_refs; /* snapshot reference counts that are too high */
+    uint64_t bad_free; /* free list loops, broken links or wrong count */
+    uint64_t bad_ptr; /* pointers outside the image or to non-inodes */
+    uint64_t bad_csum; /* block reads that failed their checksum */
+    uint64_t repaired; /* problems fixed (with FS_FSCK_REPAIR) */
+    uint64_t files, dirs; /* entities checked */
+};
+
+#define FS_FSCK_REPAIR 1 /* fix what can be fixed */
+
+/* Check the consistency of the whole filesystem: every inode chain reached
+ * from the root and from the snapshots, and the free list.  Directories
+ * are checked by =nthreads fs_walk workers while another thread follows
+ * the free list, and block ownership is collected into a map that is
+ * compared against the free list at the end.  Blocks failing their
+ * checksum are counted as they are read.  Problems are described on
+ * =log (may be NULL) and counted in =rep.  With FS_FSCK_REPAIR, parent
+ * pointers, sizes and reference counts are rewritten and the free list is
+ * rebuilt from the unused blocks; blocks in use by two entities cannot be
+ * repaired.  The filesystem must not be used while it is checked.  Returns
+ * zero or -1 with errno set (EROFS when repairing a read-only superblock,
+ * ENOMEM). */
+int fs_fsck(struct superblock *sb, int flags, int nthreads, FILE *log,
+        struct fs_fsck_report *rep);
+
+/* Work done by fs_defrag. */
+struct fs_defrag_report {
+    uint64_t files, dirs; /* entities examined */
+    uint64_t moved; /* entities relocated */
+    uint64_t blocks; /* blocks relocated */
+    uint64_t skipped; /* shared with a snapshot, or no free run fits */
+};
+
+#define FS_DEFRAG_COMPACT 1 /* also move entities down into lower runs */
+
+/* Relocate every entity whose blocks are scattered into a single run of
+ * adjacent blocks, laid out in the order reads use them: first inode,
+ * nodeinfo, then each inode followed by the data blocks it links to.  For
+ * directories the run holds the chain of link blocks, which removals
+ * already keep packed.  Runs are taken as low as possible; with
+ * FS_DEFRAG_COMPACT entities already contiguous, and the reference and
+ * data checksum tables, also move when a free run below them fits, which
+ * packs the used blocks at the start of the image for fs_shrink.  Blocks
+ * shared with snapshots are left in place.
+ *
+ * The pass stops once =budget_ms milliseconds have elapsed (zero means no
+ * limit) and the next call resumes it where it stopped, so it can run in
+ * short maintenance windows; changes in between only make the pass skip
+ * or revisit a few entities.  Each entity is moved by copying it,
+ * switching its one directory link and freeing the old blocks.  Snapshot
+ * views must be reopened afterwards.  Returns zero once the pass is
+ * complete, one if the budget ran out first, or -1 with errno set (EROFS,
+ * EIO).  =rep (may be NULL) counts the work of this call. */
+int fs_defrag(struct superblock *sb, int flags, uint64_t budget_ms,
+        struct fs_defrag_report *rep);
+
+/* Shrink the filesystem to =size bytes and truncate its image file (each
+ * of them to its share, if striped); a =size of zero shrinks it to end
+ * after the last block in use.  Every block past the new end must be free
+ * (run fs_defrag with FS_DEFRAG_COMPACT first) or belong to the reference
+ * and data checksum tables, which are moved below it and cut down.
+ * Returns zero on success or -1 with errno set (EINVAL if =size is larger
+ * than the filesystem or below MIN_BLOCK_COUNT blocks, ENOSPC if blocks
+ * past the end are in use, EROFS, EIO). */
+int fs_shrink(struct superblock *sb, uint64_t size);
+
+/* Start recording trace events into a ring buffer of =nevents entries
+ * (rounded up to a power of two).  Once full, the oldest events are
+ * overwritten.  Recording is lock-free; while tracing is off each
+ * instrumented point costs a single pointer test.  Restarting discards the
+ * previous trace, reusing its buffer if it is large enough; buffers are
+ * only freed by fs_close.  Returns zero or -1 with errno set (EINVAL,
+ * ENOMEM). */
+int fs_trace_start(struct superblock *sb, size_t nevents);
+
+/* Stop recording.  The events stay available to fs_trace_save until the
+ * next fs_trace_start or fs_close. */
+void fs_trace_stop(struct superblock *sb);
+
+/* Write the recorded events to =path (see struct fs_trace_header);
+ * tracedump.exe converts the file to Chrome trace / Perfetto JSON.  Events
+ * still being recorded by other threads may be torn, so stop tracing
+ * first.  Returns zero or -1 with errno set (ENOENT if nothing was
+ * traced). */
+int fs_trace_save(const struct superblock *sb, const char *path);
+
+/* Take a copy-on-write snapshot of the whole filesystem called =name.  Only
+ * the root directory's inodes are copied; everything else is shared with
+ * the live tree until the live tree modifies it.  A block is shared at
+ * most 255 times over: past that, the snapshot or the call that would copy
+ * a shared entity fails with EMLINK.  Returns zero on success or -1 with
+ * errno set (EEXIST, EINVAL for names containing '/', ENOSPC, EMLINK when
+ * the snapshot limit is reached). */
+int fs_snapshot(struct superblock *sb, const char *name);
+
+/* Delete snapshot =name, freeing the blocks no longer shared with the live
+ * tree or other snapshots. */
+int fs_snapshot_delete(struct superblock *sb, const char *name);
+
+/* Open a read-only view of snapshot =name.  The view is used with the
+ * regular read calls (fs_read_file, fs_list_dir, fs_walk...); mutating calls
+ * fail with EROFS.  Release it with fs_close before closing =sb. */
+struct superblock * fs_snapshot_open(struct superblock *sb, const char *name);
 
+/* List existing snapshots; see fs_list_dir_plus. */
+struct fs_dirent * fs_snapshot_list(struct superblock *sb, size_t *count);
 
 #endif
@@ -0,0 +1,473 @@
+/*
+ * File:   fsck.c
+ *
+ * Offline consistency check.  Every block reference found while walking
+ * the trees is counted in =used; a first inode is only expanded on its
+ * first reference, so entities shared with snapshots are checked once and
+ * a directory cycle cannot loop forever.  Meanwhile a separate thread
+ * follows the free list into the =isFree bitmap.  Once both are done every
+ * block must be either free or used exactly 1 + (snapshot references)
+ * times.  Every metadata block read is verified against its checksum, and
+ * so are data blocks when the filesystem keeps data checksums.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "fs.h"
+#include "utils.h"
+
+struct fsck_ctx {
+    struct superblock *sb;
+    struct fs_fsck_report *rep;
+    FILE *log;
+    /* references found, per block (atomic); wide enough for the owner and
+     * the 255 extra references the table can count */
+    uint16_t *used;
+    uint8_t *isFree; /* bitmap of the blocks on the free list */
+    uint8_t *refs; /* copy of the reference table blocks, or NULL */
+    uint64_t nfree; /* length of the free list */
+    uint64_t inUseFree; /* blocks both in use and on the free list */
+    int inSnapshots; /* walking snapshot trees */
+    pthread_mutex_t lock; /* protects the pending repairs below */
+    struct blocklist parentFix; /* (inode, parent) pairs */
+    struct blocklist sizeFix; /* (head inode, size) pairs */
+};
+
+static void problem(struct fsck_ctx *ctx, uint64_t *ctr, const char *fmt, ...) {
+    va_list ap;
+    __atomic_add_fetch(ctr, 1, __ATOMIC_RELAXED);
+    if (ctx->log == NULL) return;
+    va_start(ap, fmt);
+    vfprintf(ctx->log, fmt, ap);
+    va_end(ap);
+}
+
+static void pushFix(struct fsck_ctx *ctx, struct blocklist *l, uint64_t block,
+        uint64_t value) {
+    pthread_mutex_lock(&ctx->lock);
+    pushBlock(l, block);
+    pushBlock(l, value);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static int inRange(struct fsck_ctx *ctx, uint64_t block, uint64_t from) {
+    if (block != 0 && block < ctx->sb->blks) return TRUE;
+    problem(ctx, &ctx->rep->bad_ptr, "block %llu: pointer %llu out of range\n",
+            (unsigned long long) from, (unsigned long long) block);
+    return FALSE;
+}
+
+/* counts a reference to =block; returns the references seen before */
+static int mark(struct fsck_ctx *ctx, uint64_t block) {
+    return __atomic_fetch_add(&ctx->used[block], 1, __ATOMIC_RELAXED);
+}
+
+static uint8_t *refSlot(struct fsck_ctx *ctx, uint64_t block) {
+    uint64_t per = getRefsPerBlock(ctx->sb);
+    return &ctx->refs[block / per * ctx->sb->blksz + block % per];
+}
+
+static int refsOf(struct fsck_ctx *ctx, uint64_t block) {
+    return ctx->refs ? *refSlot(ctx, block) : 0;
+}
+
+/* directory =dir holds =child: check the child's head inode */
+static void checkChild(struct fsck_ctx *ctx, uint64_t dir, uint64_t child,
+        struct inode *node) {
+    seek_read(ctx->sb, child, node);
+    if ((node->mode & IMCHILD) || !(node->mode & (IMREG | IMDIR))) {
+        problem(ctx, &ctx->rep->bad_ptr, "block %llu: entry %llu is not an "
+                "inode\n", (unsigned long long) dir, (unsigned long long) child);
+    } else if (node->parent != dir && refsOf(ctx, child) == 0 &&
+            !ctx->inSnapshots) {
+        /* a shared entry may point at any directory holding it, and an
+         * entry left to a snapshot when the live tree took a copy still
+         * points at the live directory */
+        problem(ctx, &ctx->rep->bad_parent, "inode %llu: parent %llu, "
+                "expected %llu\n", (unsigned long long) child,
+                (unsigned long long) node->parent, (unsigned long long) dir);
+        pushFix(ctx, &ctx->parentFix, child, dir);
+    }
+}
+
+/* the data blocks =n of a file of =size bytes; writers before the size was
+ * rounded up left out a partial last block */
+static int sizeMatches(uint64_t size, uint64_t n, uint64_t blksz) {
+    if (n == 0) return size == 0;
+    return (n - 1) * blksz <= size && size < (n + 1) * blksz;
+}
+
+/**
+ * Checks the entity whose head inode is =block, which was just referenced
+ * for the first time: its nodeinfo, continuation inodes and links.  Data
+ * blocks are counted here; directory entries are counted by the walk.
+ */
+static void checkEntity(struct fsck_ctx *ctx, uint64_t block) {
+    const struct superblock *sb = ctx->sb;
+    struct inode *node = malloc(sb->blksz), *child = malloc(sb->blksz);
+    struct nodeinfo *info = malloc(sb->blksz);
+    char *data = malloc(sb->blksz);
+    uint64_t cur = block, prev = 0, n = 0, steps = 0, type;
+    int i, maxLinks = getLinksMaxLen(sb);
+
+    seek_read(sb, block, node);
+    type = node->mode & (IMREG | IMDIR);
+    if (!inRange(ctx, node->meta, block)) goto out;
+    mark(ctx, node->meta);
+    seek_read(sb, node->meta, info);
+    __atomic_add_fetch(type == IMDIR ? &ctx->rep->dirs : &ctx->rep->files, 1,
+            __ATOMIC_RELAXED);
+
+    for (;;) {
+        for (i = 0; i < maxLinks && node->links[i] != 0; i++) {
+            if (type != IMDIR && node->links[i] == FS_HOLE) {
+                n++;
+                continue;
+            }
+            /* a bad entry is reported by whoever lists the directory */
+            if (type == IMDIR && node->links[i] >= sb->blks) {
+                n++;
+                continue;
+            }
+            if (!inRange(ctx, node->links[i], cur)) continue;
+            n++;
+            if (type == IMDIR) {
+                checkChild(ctx, block, node->links[i], child);
+            } else {
+                mark(ctx, node->links[i]);
+                /* reading verifies the block against its checksum */
+                if (sb->features & FS_FEAT_DATA_CSUM) {
+                    seek_read_kind(sb, node->links[i], data, FS_BLK_DATA);
+                }
+            }
+        }
+        if (node->next == 0 || !inRange(ctx, node->next, cur)) break;
+        if (++steps >= sb->blks || mark(ctx, node->next) != 0) {
+            problem(ctx, &ctx->rep->doubled, "inode %llu: chain reuses block "
+                    "%llu\n", (unsigned long long) block,
+                    (unsigned long long) node->next);
+            break;
+        }
+        prev = cur;
+        cur = node->next;
+        seek_read(sb, cur, node);
+        if (node->mode != (IMCHILD | type)) {
+            problem(ctx, &ctx->rep->bad_ptr, "inode %llu: continuation %llu "
+                    "has mode %llu\n", (unsigned long long) block,
+                    (unsigned long long) cur, (unsigned long long) node->mode);
+            break;
+        }
+        if (node->parent != block) {
+            problem(ctx, &ctx->rep->bad_parent, "inode %llu: parent %llu, "
+                    "expected %llu\n", (unsigned long long) cur,
+                    (unsigned long long) node->parent,
+                    (unsigned long long) block);
+            pushFix(ctx, &ctx->parentFix, cur, block);
+        }
+        /* older images kept a nodeinfo copy per continuation inode */
+        if (node->meta != prev && inRange(ctx, node->meta, cur)) {
+            mark(ctx, node->meta);
+        }
+    }
+
+    /* compressed files hold their chunk stream, not their contents */
+    uint64_t stored = type != IMDIR && (info->reserved[0] & FS_FILE_LZ4) ?
+            info->reserved[1] : info->size;
+    if (type == IMDIR ? n != info->size : !sizeMatches(stored, n, sb->blksz)) {
+        problem(ctx, &ctx->rep->bad_size, "inode %llu: size %llu with %llu "
+                "%s\n", (unsigned long long) block,
+                (unsigned long long) info->size, (unsigned long long) n,
+                type == IMDIR ? "entries" : "blocks");
+        /* a file can only be cut down to what its blocks hold */
+        if (type == IMDIR) {
+            pushFix(ctx, &ctx->sizeFix, block, n);
+        } else if (stored == info->size && info->size > n * sb->blksz) {
+            pushFix(ctx, &ctx->sizeFix, block, n * sb->blksz);
+        }
+    }
+out:
+    free(node);
+    free(child);
+    free(info);
+    free(data);
+}
+
+static int fsckVisit(const char *path, const struct fs_dirent *ent, void *arg) {
+    struct fsck_ctx *ctx = arg;
+    if (ent->block >= ctx->sb->blks) {
+        problem(ctx, &ctx->rep->bad_ptr, "%s: entry %llu out of range\n",
+                path, (unsigned long long) ent->block);
+        return FS_WALK_SKIP;
+    }
+    if (mark(ctx, ent->block) != 0) return FS_WALK_SKIP;
+    checkEntity(ctx, ent->block);
+    return 0;
+}
+
+/* checks a tree that fs_walk cannot reach from its own root */
+static void checkRoot(struct fsck_ctx *ctx, uint64_t block) {
+    if (!inRange(ctx, block, 0)) return;
+    if (mark(ctx, block) == 0) checkEntity(ctx, block);
+}
+
+static void *fsckFreeList(void *arg) {
+    struct fsck_ctx *ctx = arg;
+    const struct superblock *sb = ctx->sb;
+    struct freepage *fp = malloc(sb->blksz);
+    uint64_t cur = sb->freelist, prev = 0, b;
+
+    while (cur != 0) {
+        if (cur >= sb->blks) {
+            problem(ctx, &ctx->rep->bad_free, "free list: block %llu out of "
+                    "range\n", (unsigned long long) cur);
+            break;
+        }
+        if (ctx->isFree[cur / 8] & (1 << cur % 8)) {
+            problem(ctx, &ctx->rep->bad_free, "free list: loops at block "
+                    "%llu\n", (unsigned long long) cur);
+            break;
+        }
+        ctx->isFree[cur / 8] |= 1 << cur % 8;
+        ctx->nfree++;
+        seek_read_kind(sb, cur, fp, FS_BLK_FREE);
+        if (prev != 0 && (fp->count != 1 || fp->links[0] != prev)) {
+            problem(ctx, &ctx->rep->bad_free, "free list: block %llu does not "
+                    "link back to %llu\n", (unsigned long long) cur,
+                    (unsigned long long) prev);
+        }
+        prev = cur;
+        cur = fp->next;
+    }
+    if (sb->tail > sb->blks) {
+        problem(ctx, &ctx->rep->bad_free, "free list: tail %llu out of "
+                "range\n", (unsigned long long) sb->tail);
+    }
+    for (b = sb->tail; b < sb->blks; b++) {
+        if (ctx->isFree[b / 8] & (1 << b % 8)) {
+            problem(ctx, &ctx->rep->bad_free, "free list: block %llu is also "
+                    "in the tail\n", (unsigned long long) b);
+        }
+        ctx->isFree[b / 8] |= 1 << b % 8;
+        ctx->nfree++;
+    }
+    if (ctx->nfree != sb->freeblks) {
+        problem(ctx, &ctx->rep->bad_free, "free list: %llu blocks, superblock "
+                "says %llu\n", (unsigned long long) ctx->nfree,
+                (unsigned long long) sb->freeblks);
+    }
+    free(fp);
+    return NULL;
+}
+
+static void walkSnapshots(struct fsck_ctx *ctx, int nthreads) {
+    struct fs_dirent *snaps;
+    struct superblock *view;
+    size_t i, count;
+
+    checkRoot(ctx, ctx->sb->snapshots);
+    ctx->inSnapshots = TRUE;
+    snaps = fs_snapshot_list(ctx->sb, &count);
+    for (i = 0; i < count; i++) {
+        if (!inRange(ctx, snaps[i].block, ctx->sb->snapshots) ||
+                mark(ctx, snaps[i].block) != 0) {
+            continue;
+        }
+        checkEntity(ctx, snaps[i].block);
+        view = fs_snapshot_open(ctx->sb, snaps[i].name);
+        if (view == NULL) continue;
+        fs_walk(view, "/", fsckVisit, ctx, nthreads);
+        fs_close(view);
+    }
+    fs_free_dirents(snaps, count);
+}
+
+/* final pass: compare the references found with the free list.  the
+ * unused blocks below =tail (one past the last block in use) are appended
+ * to =unused */
+static int checkBlocks(struct fsck_ctx *ctx, struct blocklist *unused,
+        uint64_t *tail) {
+    const struct superblock *sb = ctx->sb;
+    uint64_t b;
+    int refsChanged = FALSE;
+
+    for (*tail = sb->blks; *tail > 1 && ctx->used[*tail - 1] == 0; (*tail)--);
+    for (b = 1; b < sb->blks; b++) {
+        int used = ctx->used[b], isFree = ctx->isFree[b / 8] & (1 << b % 8);
+        int expected = 1 + refsOf(ctx, b);
+
+        if (used == 0) {
+            if (b < *tail) pushBlock(unused, b);
+            if (!isFree) {
+                problem(ctx, &ctx->rep->leaked, "block %llu: leaked\n",
+                        (unsigned long long) b);
+            }
+        } else if (isFree) {
+            problem(ctx, &ctx->rep->doubled, "block %llu: in use and free\n",
+                    (unsigned long long) b);
+            ctx->inUseFree++;
+        } else if (used != expected) {
+            if (ctx->refs != NULL && used < expected) {
+                problem(ctx, &ctx->rep->bad_refs, "block %llu: %d references, "
+                        "table says %d\n", (unsigned long long) b, used,
+                        expected);
+                *refSlot(ctx, b) = used - 1;
+                refsChanged = TRUE;
+            } else {
+                problem(ctx, &ctx->rep->doubled, "block %llu: %d references, "
+                        "expected %d\n", (unsigned long long) b, used,
+                        expected);
+            }
+        }
+    }
+    return refsChanged;
+}
+
+static uint64_t refBlocks(const struct superblock *sb) {
+    return getTableBlocks(sb, sb->blks, 1);
+}
+
+/* clears the dedup slots of the leaked blocks, which may still hold the
+ * data the index names */
+static void forgetLeaked(struct fsck_ctx *ctx) {
+    const struct superblock *sb = ctx->sb;
+    struct blocklist leaked;
+    uint64_t b;
+
+    initBlockList(&leaked);
+    for (b = 1; b < sb->blks; b++) {
+        if (ctx->used[b] == 0 && !(ctx->isFree[b / 8] & (1 << b % 8))) {
+            pushBlock(&leaked, b);
+        }
+    }
+    dedupForget(sb, leaked.v, leaked.n);
+    freeBlockList(&leaked);
+}
+
+static void repair(struct fsck_ctx *ctx, struct blocklist *unused,
+        uint64_t tail, int refsChanged) {
+    struct superblock *sb = ctx->sb;
+    struct fs_fsck_report *rep = ctx->rep;
+    char *buf = malloc(sb->blksz);
+    size_t i;
+
+    for (i = 0; i < ctx->parentFix.n; i += 2) {
+        struct inode *node = (struct inode *) buf;
+        seek_read(sb, ctx->parentFix.v[i], node);
+        node->parent = ctx->parentFix.v[i + 1];
+        seek_write(sb, ctx->parentFix.v[i], node);
+        rep->repaired++;
+    }
+    for (i = 0; i < ctx->sizeFix.n; i += 2) {
+        uint64_t meta;
+        seek_read(sb, ctx->sizeFix.v[i], buf);
+        meta = ((struct inode *) buf)->meta;
+        seek_read(sb, meta, buf);
+        ((struct nodeinfo *) buf)->size = ctx->sizeFix.v[i + 1];
+        seek_write(sb, meta, buf);
+        rep->repaired++;
+    }
+    if (refsChanged) {
+        seek_write_blocks(sb, sb->refmap, refBlocks(sb), ctx->refs,
+                FS_BLK_META);
+        rep->repaired += rep->bad_refs;
+    }
+    if (rep->leaked || rep->bad_free || ctx->inUseFree) {
+        /* rebuilt from the unused blocks, dropping the ones in use */
+        if (rep->leaked && (sb->features & FS_FEAT_DEDUP)) forgetLeaked(ctx);
+        sb->tail = tail;
+        sb->freeblks = sb->blks - tail;
+        sb->freelist = 0;
+        putBlocks(sb, unused->v, unused->n);
+        writeSuper(sb);
+        rep->repaired += rep->leaked + rep->bad_free + ctx->inUseFree;
+    }
+    free(buf);
+}
+
+static int checkImage(struct superblock *sb, int flags, int nthreads,
+        FILE *log, struct fs_fsck_report *rep) {
+    struct fsck_ctx ctx;
+    struct blocklist unused;
+    pthread_t freeThread;
+    uint64_t b, tail, tblocks = refBlocks(sb);
+    uint64_t ioErrors = sb->state->stats.io_errors;
+    int refsChanged;
+
+    if ((flags & FS_FSCK_REPAIR) && !checkWritable(sb)) return -1;
+    if (!(sb->flags & FS_RDONLY)) releaseExtents(sb);
+    memset(rep, 0, sizeof (*rep));
+    memset(&ctx, 0, sizeof (ctx));
+    ctx.sb = sb;
+    ctx.rep = rep;
+    ctx.log = log;
+    ctx.used = calloc(sb->blks, sizeof (*ctx.used));
+    ctx.isFree = calloc(sb->blks / 8 + 1, 1);
+    ctx.refs = sb->refmap ? malloc(tblocks * sb->blksz) : NULL;
+    if (ctx.used == NULL || ctx.isFree == NULL || (sb->refmap && !ctx.refs)) {
+        free(ctx.used);
+        free(ctx.isFree);
+        free(ctx.refs);
+        errno = ENOMEM;
+        return -1;
+    }
+    pthread_mutex_init(&ctx.lock, NULL);
+    initBlockList(&ctx.parentFix);
+    initBlockList(&ctx.sizeFix);
+    initBlockList(&unused);
+
+    pthread_create(&freeThread, NULL, fsckFreeList, &ctx);
+    mark(&ctx, 0);
+    if (sb->refmap != 0) {
+        seek_read_blocks(sb, sb->refmap, tblocks, ctx.refs, FS_BLK_META);
+        for (b = sb->refmap; b < sb->refmap + tblocks && b < sb->blks; b++) {
+            mark(&ctx, b);
+        }
+    }
+    if (sb->csums != 0) {
+        tblocks = getTableBlocks(sb, sb->blks, sizeof (uint32_t));
+        for (b = sb->csums; b < sb->csums + tblocks && b < sb->blks; b++) {
+            mark(&ctx, b);
+        }
+    }
+    if (sb->dedup != 0) {
+        tblocks = getTableBlocks(sb, sb->blks, sizeof (uint64_t));
+        for (b = sb->dedup; b < sb->dedup + tblocks && b < sb->blks; b++) {
+            mark(&ctx, b);
+        }
+    }
+    checkRoot(&ctx, sb->root);
+    fs_walk(sb, "/", fsckVisit, &ctx, nthreads);
+    if (sb->snapshots != 0) walkSnapshots(&ctx, nthreads);
+    pthread_join(freeThread, NULL);
+
+    rep->bad_csum = __atomic_load_n(&sb->state->stats.io_errors,
+            __ATOMIC_RELAXED) - ioErrors;
+    if (rep->bad_csum != 0 && log != NULL) {
+        fprintf(log, "%llu blocks failed their checksum or were short\n",
+                (unsigned long long) rep->bad_csum);
+    }
+    refsChanged = checkBlocks(&ctx, &unused, &tail);
+    if (flags & FS_FSCK_REPAIR) repair(&ctx, &unused, tail, refsChanged);
+
+    pthread_mutex_destroy(&ctx.lock);
+    freeBlockList(&ctx.parentFix);
+    freeBlockList(&ctx.sizeFix);
+    freeBlockList(&unused);
+    free(ctx.used);
+    free(ctx.isFree);
+    free(ctx.refs);
+    return 0;
+}
+
+/* I/O errors are reported in =rep->bad_csum rather than failing the call */
+int fs_fsck(struct superblock *sb, int flags, int nthreads, FILE *log,
+        struct fs_fsck_report *rep) {
+    uint64_t t0 = opBegin(sb, FS_OP_FSCK);
+    int r = checkImage(sb, flags, nthreads, log, rep);
+    opEnd(sb, FS_OP_FSCK, t0);
+    return r;
+}
@@ -0,0 +1,80 @@
+/*
+ * File:   fsck_tool.c
+ *
+ * Command line front end for fs_fsck.  Exit status follows e2fsck: 0 when
+ * the filesystem is clean, 1 when every problem found was repaired, 4 when
+ * problems are left and 8 when the check could not run.
+ *
+ * usage: fsck.exe [-y] [-q] [-j threads] image
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "fs.h"
+
+int main(int argc, char **argv) {
+    struct fs_fsck_report rep;
+    struct superblock *sb;
+    struct timespec t0, t1;
+    int opt, flags = 0, quiet = 0, nthreads = 4;
+    uint64_t problems, freeblks, blks;
+
+    while ((opt = getopt(argc, argv, "yqj:")) != -1) {
+        switch (opt) {
+            case 'y': flags |= FS_FSCK_REPAIR;
+                break;
+            case 'q': quiet = 1;
+                break;
+            case 'j': nthreads = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-y] [-q] [-j threads] image\n",
+                        argv[0]);
+                return 8;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-y] [-q] [-j threads] image\n", argv[0]);
+        return 8;
+    }
+    sb = fs_open(argv[optind]);
+    if (sb == NULL) {
+        perror(argv[optind]);
+        return 8;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (fs_fsck(sb, flags, nthreads, quiet ? NULL : stdout, &rep) != 0) {
+        perror("fsck");
+        fs_close(sb);
+        return 8;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    freeblks = sb->freeblks;
+    blks = sb->blks;
+    fs_close(sb);
+
+    problems = rep.leaked + rep.doubled + rep.bad_parent + rep.bad_size +
+            rep.bad_refs + rep.bad_free + rep.bad_ptr + rep.bad_csum;
+    printf("%s: %llu files, %llu directories, %llu/%llu blocks free "
+            "(%.3fs)\n", argv[optind], (unsigned long long) rep.files,
+            (unsigned long long) rep.dirs, (unsigned long long) freeblks,
+            (unsigned long long) blks, (t1.tv_sec - t0.tv_sec) +
+            (t1.tv_nsec - t0.tv_nsec) / 1e9);
+    if (problems == 0) return 0;
+    printf("leaked %llu, doubly used %llu, bad parent %llu, bad size %llu, "
+            "bad refs %llu, free list %llu, bad pointers %llu, checksum %llu; "
+            "repaired %llu\n",
+            (unsigned long long) rep.leaked, (unsigned long long) rep.doubled,
+            (unsigned long long) rep.bad_parent,
+            (unsigned long long) rep.bad_size,
+            (unsigned long long) rep.bad_refs,
+            (unsigned long long) rep.bad_free,
+            (unsigned long long) rep.bad_ptr,
+            (unsigned long long) rep.bad_csum,
+            (unsigned long long) rep.repaired);
+    return rep.repaired >= problems ? 1 : 4;
+}
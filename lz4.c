@@ -0,0 +1,172 @@
+/*
+ * File:   lz4.c
+ *
+ * LZ4 block format.  A block is a series of sequences, each a token byte
+ * (literal length in the high nibble, match length - 4 in the low one,
+ * 15 meaning "more bytes follow, 255 at a time"), the literals, and a two
+ * byte little-endian offset back to the match.  The last sequence has
+ * literals only, and the format requires the last 5 bytes to be literals
+ * and the last match to start at least 12 bytes before the end.
+ *
+ * The compressor finds matches through a hash table of the positions of
+ * recent 4-byte sequences and skips faster through data that does not
+ * match, so incompressible input stays cheap.
+ */
+
+#include <string.h>
+#include <inttypes.h>
+
+#include "lz4.h"
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MF_LIMIT 12
+#define MAX_OFFSET 65535
+#define HASH_LOG 12
+#define SKIP_TRIGGER 6 /* misses before the search step grows */
+
+static uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof (v));
+    return v;
+}
+
+static uint64_t read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof (v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+/* writes the 15 + ... continuation bytes of a length */
+static uint8_t* putLength(uint8_t* op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t) len;
+    return op;
+}
+
+/* emits literals [anchor, ip) followed by a match of =mlen bytes at =off
+ * (=mlen zero for the last sequence); NULL if it does not fit */
+static uint8_t* putSequence(uint8_t* op, const uint8_t* oend,
+        const uint8_t* anchor, const uint8_t* ip, size_t off, size_t mlen) {
+    size_t lit = ip - anchor;
+    uint8_t* token = op++;
+
+    if (op + lit + lit / 255 + 1 + 2 + mlen / 255 + 1 > oend) return NULL;
+    if (lit >= 15) {
+        *token = 15 << 4;
+        op = putLength(op, lit - 15);
+    } else {
+        *token = (uint8_t) (lit << 4);
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+    if (mlen == 0) return op;
+    *op++ = (uint8_t) off;
+    *op++ = (uint8_t) (off >> 8);
+    mlen -= MIN_MATCH;
+    if (mlen >= 15) {
+        *token |= 15;
+        op = putLength(op, mlen - 15);
+    } else {
+        *token |= (uint8_t) mlen;
+    }
+    return op;
+}
+
+size_t lz4_compress(const void* src, size_t len, void* dst, size_t cap) {
+    const uint8_t* base = src, *ip = base, *anchor = base, *end = base + len;
+    const uint8_t* mfLimit, *matchLimit;
+    uint8_t* op = dst, *oend = op + cap;
+    uint32_t table[1 << HASH_LOG];
+    unsigned misses = 0;
+
+    memset(table, 0, sizeof (table));
+    if (len > MF_LIMIT) {
+        mfLimit = end - MF_LIMIT;
+        matchLimit = end - LAST_LITERALS;
+        while (ip < mfLimit) {
+            uint32_t seq = read32(ip), h = hash4(seq);
+            const uint8_t* ref = base + table[h], *m, *r;
+
+            table[h] = (uint32_t) (ip - base);
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+                ip += 1 + (misses++ >> SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            m = ip + MIN_MATCH;
+            r = ref + MIN_MATCH;
+            while (m + 8 <= matchLimit) {
+                uint64_t diff = read64(m) ^ read64(r);
+                if (diff != 0) {
+                    m += __builtin_ctzll(diff) >> 3; //little-endian
+                    r = NULL;
+                    break;
+                }
+                m += 8;
+                r += 8;
+            }
+            if (r != NULL) {
+                for (; m < matchLimit && *m == *r; m++, r++);
+            }
+            op = putSequence(op, oend, anchor, ip, ip - ref, m - ip);
+            if (op == NULL) return 0;
+            ip = anchor = m;
+        }
+    }
+    op = putSequence(op, oend, anchor, end, 0, 0);
+    return op == NULL ? 0 : (size_t) (op - (uint8_t*) dst);
+}
+
+/* reads the continuation bytes of a length into =*len */
+static const uint8_t* getLength(const uint8_t* ip, const uint8_t* iend,
+        size_t* len) {
+    uint8_t b;
+    do {
+        if (ip >= iend) return NULL;
+        b = *ip++;
+        *len += b;
+    } while (b == 255);
+    return ip;
+}
+
+size_t lz4_decompress(const void* src, size_t len, void* dst, size_t cap) {
+    const uint8_t* ip = src, *iend = ip + len;
+    uint8_t* op = dst, *oend = op + cap;
+    size_t lit, mlen, off, i;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        lit = token >> 4;
+        if (lit == 15 && (ip = getLength(ip, iend, &lit)) == NULL) break;
+        if (lit > (size_t) (iend - ip) || lit > (size_t) (oend - op)) break;
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == iend) return op - (uint8_t*) dst; //last sequence
+        if (iend - ip < 2) break;
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (off == 0 || off > (size_t) (op - (uint8_t*) dst)) break;
+        mlen = token & 15;
+        if (mlen == 15 && (ip = getLength(ip, iend, &mlen)) == NULL) break;
+        mlen += MIN_MATCH;
+        if (mlen > (size_t) (oend - op)) break;
+        if (off >= mlen) {
+            memcpy(op, op - off, mlen);
+        } else {
+            /* the match overlaps the bytes it produces */
+            for (i = 0; i < mlen; i++) op[i] = op[i - off];
+        }
+        op += mlen;
+    }
+    return (size_t) - 1;
+}
@@ -0,0 +1,34 @@
+/* 
+ * File:   lz4.h
+ *
+ * Compressor and decompressor for the LZ4 block format, so compressed
+ * files need no external library.
+ */
+
+#ifndef LZ4_H
+#define	LZ4_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+    /* worst case size of =len compressed bytes */
+#define LZ4_BOUND(len) ((len) + (len) / 255 + 16)
+
+    /* Compresses =len bytes at =src into at most =cap bytes at =dst.
+     * Returns the compressed size, or zero if it does not fit in =cap. */
+    size_t lz4_compress(const void* src, size_t len, void* dst, size_t cap);
+
+    /* Decompresses the =len bytes at =src into at most =cap bytes at =dst.
+     * Returns the decompressed size, or (size_t) -1 if =src is malformed
+     * or does not fit in =cap. */
+    size_t lz4_decompress(const void* src, size_t len, void* dst, size_t cap);
+
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* LZ4_H */
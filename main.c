@@ -2,19 +2,45 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <errno.h>
 
 #include <assert.h>
 
 #include "fs.h"
+#include "utils.h"
 #define MKDIR
 
 void test(uint64_t fsize, uint64_t blksz);
 void fs_check(const struct superblock *sb, uint64_t fsize, uint64_t blksz);
 void fs_free_check(struct superblock **sb, uint64_t fsize, uint64_t blksz);
+void makeImage(const char *name, uint64_t size);
 
 void fs_io_test(uint64_t fsize, uint64_t blksz);
+void fs_walk_test(uint64_t fsize, uint64_t blksz);
+void fs_remove_test(uint64_t fsize, uint64_t blksz);
+void fs_rename_test(uint64_t fsize, uint64_t blksz);
+void fs_snapshot_test(uint64_t fsize, uint64_t blksz);
+void fs_trace_test(uint64_t fsize, uint64_t blksz);
+void fs_fsck_test(uint64_t fsize, uint64_t blksz);
+void fs_csum_test(uint64_t fsize, uint64_t blksz);
+void fs_grow_test(uint64_t fsize, uint64_t blksz);
+void fs_defrag_test(uint64_t fsize, uint64_t blksz);
+void fs_compress_test(uint64_t fsize, uint64_t blksz);
+void fs_dedup_test(uint64_t fsize, uint64_t blksz);
+void fs_sparse_test(uint64_t fsize, uint64_t blksz);
+void fs_direct_test(uint64_t fsize, uint64_t blksz);
+void fs_shared_test(uint64_t fsize, uint64_t blksz);
+void fs_stripe_test(uint64_t fsize, uint64_t blksz);
+void fs_placement_test(uint64_t fsize, uint64_t blksz);
+void fs_preload_test(uint64_t fsize, uint64_t blksz);
+void fs_dir_churn_test(uint64_t fsize, uint64_t blksz);
+void fs_full_test(uint64_t fsize, uint64_t blksz);
+void fs_copy_test(uint64_t fsize, uint64_t blksz);
+void fs_legacy_test(uint64_t fsize, uint64_t blksz);
+void fs_large_test(void);
 
 #define NELEMS(x) (sizeof(x)/sizeof(x[0]))
 
@@ -32,7 +58,29 @@ int main(int argc, char **argv) {
     for (i = 1; i < NELEMS(blkszs); i++) {
         printf("fsize %d blksz %d\n", (int) fsizes[i], (int) blkszs[i]);
         fs_io_test(fsizes[i], blkszs[i]);
+        fs_walk_test(fsizes[i], blkszs[i]);
+        fs_remove_test(fsizes[i], blkszs[i]);
+        fs_rename_test(fsizes[i], blkszs[i]);
+        fs_snapshot_test(fsizes[i], blkszs[i]);
+        fs_trace_test(fsizes[i], blkszs[i]);
+        fs_fsck_test(fsizes[i], blkszs[i]);
+        fs_csum_test(fsizes[i], blkszs[i]);
+        fs_grow_test(fsizes[i], blkszs[i]);
+        fs_defrag_test(fsizes[i], blkszs[i]);
+        fs_compress_test(fsizes[i], blkszs[i]);
+        fs_dedup_test(fsizes[i], blkszs[i]);
+        fs_sparse_test(fsizes[i], blkszs[i]);
+        fs_direct_test(fsizes[i], blkszs[i]);
+        fs_shared_test(fsizes[i], blkszs[i]);
+        fs_stripe_test(fsizes[i], blkszs[i]);
+        fs_placement_test(fsizes[i], blkszs[i]);
+        fs_preload_test(fsizes[i], blkszs[i]);
+        fs_dir_churn_test(fsizes[i], blkszs[i]);
+        fs_full_test(fsizes[i], blkszs[i]);
+        fs_copy_test(fsizes[i], blkszs[i]);
+        fs_legacy_test(fsizes[i], blkszs[i]);
     }
+    fs_large_test();
 
 
 
@@ -110,7 +158,12 @@ void fs_io_test(uint64_t fsize, uint64_t blksz) {
     fwrite(buf, 1, fsize, fd);
     fclose(fd);
 
-    struct superblock*sb = fs_format(imName, blksz);
+    struct superblock*sb = fs_format(imName, blksz + 8);
+    if (sb != NULL || errno != EINVAL) {
+        printf("FAIL formatted with a block size not a power of two\n");
+        fs_close(sb);
+    }
+    sb = fs_format(imName, blksz);
     if (sb == NULL) {
         free(buf);
         return;
@@ -121,7 +174,7 @@ void fs_io_test(uint64_t fsize, uint64_t blksz) {
     char* buf_read = malloc(15);
     char* buf_read2 = malloc(6);
     char* fname = malloc(7);
-    char* f2name = malloc(3);
+    char* f2name = malloc(7);
     strcpy(buf_str2, "hallo");
     strcpy(fname, "/teste");
     strcpy(buf_str, "diga oi lilica");
@@ -155,6 +208,49 @@ void fs_io_test(uint64_t fsize, uint64_t blksz) {
 #ifdef MKDIR
     free(fs_list_dir(sb, "/dir"));
 #endif
+    size_t nents = 0, k;
+    struct fs_dirent *ents = fs_list_dir_plus(sb, "/", &nents);
+    if (ents == NULL || nents == 0) {
+        printf("FAIL list_dir_plus of /\n");
+        nents = 0;
+    }
+    for (k = 0; k < nents; k++) {
+        if (strcmp(ents[k].name, "teste") == 0) break;
+    }
+    if (k == nents) {
+        printf("FAIL list_dir_plus misses teste\n");
+    } else if (ents[k].mode != IMREG || ents[k].block == 0 ||
+            ents[k].size != strlen(buf_str) + 1) {
+        printf("FAIL list_dir_plus entry\n");
+    }
+    fs_free_dirents(ents, nents);
+
+    struct fs_stats st;
+    fs_get_stats(sb, &st);
+    if (st.calls[FS_OP_WRITE] != 2 || st.calls[FS_OP_READ] != 2 ||
+            st.writes[FS_BLK_DATA] < 2 || st.reads[FS_BLK_DATA] < 2 ||
+            st.allocs == 0 || st.lookup_components == 0 || st.io_errors != 0) {
+        printf("FAIL stats\n");
+    }
+
+    /* binary data with NUL bytes and a partial last block */
+    size_t i, blen = 3 * blksz + blksz / 2;
+    char *bin = malloc(blen), *bread = malloc(blen + 1);
+    for (i = 0; i < blen; i++) bin[i] = i * 7;
+    memset(bread, 0x55, blen + 1);
+    if (fs_write_file(sb, "/bin", bin, blen) != 0 ||
+            fs_read_file(sb, "/bin", bread, blen + 1) != blen ||
+            memcmp(bread, bin, blen) != 0 || bread[blen] != 0x55) {
+        printf("FAIL binary write and read\n");
+    }
+    memset(bread, 0x55, blen + 1);
+    if (fs_read_file(sb, "/bin", bread, blksz + 3) != blksz + 3 ||
+            memcmp(bread, bin, blksz + 3) != 0 || bread[blksz + 3] != 0x55) {
+        printf("FAIL partial binary read\n");
+    }
+    fs_delete_file(sb, "/bin");
+    free(bin);
+    free(bread);
     if (fs_delete_file(sb, fname) == -1) {
         perror("Delete File: ");
     }
@@ -175,6 +271,1578 @@ void fs_io_test(uint64_t fsize, uint64_t blksz) {
     buf = NULL;
 }
 
+static int count_entry(const char *path, const struct fs_dirent *ent,
+        void *arg) {
+    __atomic_add_fetch((int *) arg, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+void fs_walk_test(uint64_t fsize, uint64_t blksz) {
+    char path[64];
+    int i, j, visited = 0;
+
+    makeImage("walk.img", fsize);
+
+    struct superblock *sb = fs_format("walk.img", blksz);
+    if (sb == NULL) return;
+    /* 4 directories of 20 files each: enough to span several link blocks */
+    for (i = 0; i < 4; i++) {
+        sprintf(path, "/d%d", i);
+        fs_mkdir(sb, path);
+        for (j = 0; j < 20; j++) {
+            sprintf(path, "/d%d/f%d", i, j);
+            fs_write_file(sb, path, "x", 2);
+        }
+    }
+    if (fs_walk(sb, "/", count_entry, &visited, 4) != 0 || visited != 84) {
+        printf("FAIL walk visited %d entries\n", visited);
+    }
+    fs_close(sb);
+    unlink("walk.img");
+}
+
+void fs_remove_test(uint64_t fsize, uint64_t blksz) {
+    char path[64];
+    int i, j;
+
+    makeImage("rm.img", fsize);
+
+    struct superblock *sb = fs_format("rm.img", blksz);
+    if (sb == NULL) return;
+    uint64_t freeblks = sb->freeblks;
+    for (i = 0; i < 3; i++) {
+        sprintf(path, "/t%d", i);
+        fs_mkdir(sb, path);
+        sprintf(path, "/t%d/sub", i);
+        fs_mkdir(sb, path);
+        for (j = 0; j < 30; j++) {
+            sprintf(path, "/t%d/%s%d", i, (j % 2) ? "sub/f" : "f", j);
+            fs_write_file(sb, path, "data", 5);
+        }
+    }
+    if (fs_rmdir(sb, "/t0") != -1 || errno != ENOTEMPTY) {
+        printf("FAIL rmdir non-empty directory\n");
+    }
+    if (fs_delete_file(sb, "/t0/f4") != 0 || existsFile(sb, "/t0/f4")) {
+        printf("FAIL delete file\n");
+    }
+    if (!existsFile(sb, "/t0/f28") || !existsFile(sb, "/t0/sub/f29")) {
+        printf("FAIL delete file lost a sibling\n");
+    }
+    if (fs_remove_tree(sb, "/t1") != 0 || existsFile(sb, "/t1")) {
+        printf("FAIL remove tree\n");
+    }
+    fs_remove_tree(sb, "/t0");
+    fs_remove_tree(sb, "/t2/sub");
+    for (j = 0; j < 30; j += 2) {
+        sprintf(path, "/t2/f%d", j);
+        fs_delete_file(sb, path);
+    }
+    if (fs_rmdir(sb, "/t2") != 0) {
+        printf("FAIL rmdir empty directory\n");
+    }
+    if (sb->freeblks != freeblks) {
+        printf("FAIL remove leaked %d blocks\n", (int) (freeblks - sb->freeblks));
+    }
+    fs_close(sb);
+    unlink("rm.img");
+}
+
+void fs_rename_test(uint64_t fsize, uint64_t blksz) {
+    char buf[16];
+
+    makeImage("mv.img", fsize);
+
+    struct superblock *sb = fs_format("mv.img", blksz);
+    if (sb == NULL) return;
+    fs_mkdir(sb, "/pub");
+    fs_mkdir(sb, "/pub/old");
+    fs_write_file(sb, "/pub/cur", "old", 4);
+    uint64_t freeblks = sb->freeblks;
+
+    /* write to a temporary name and publish it over the current file */
+    fs_write_file(sb, "/tmp", "new", 4);
+    if (fs_rename(sb, "/tmp", "/pub/cur") != 0 || existsFile(sb, "/tmp")) {
+        printf("FAIL rename over existing file\n");
+    }
+    fs_read_file(sb, "/pub/cur", buf, 4);
+    if (strcmp(buf, "new") != 0) printf("FAIL rename content\n");
+    if (sb->freeblks != freeblks) printf("FAIL rename leaked blocks\n");
+
+    if (fs_rename(sb, "/pub", "/pub/old/pub") != -1 || errno != EINVAL) {
+        printf("FAIL moved directory below itself\n");
+    }
+    if (fs_rename(sb, "/pub/old", "/archive") != 0 ||
+            !existsFile(sb, "/archive") || existsFile(sb, "/pub/old")) {
+        printf("FAIL rename directory\n");
+    }
+    if (fs_rename(sb, "/pub/cur", "/pub/renamed") != 0 ||
+            !existsFile(sb, "/pub/renamed")) {
+        printf("FAIL rename in place\n");
+    }
+
+    /* a file in the middle of a path is no directory to walk into */
+    freeblks = sb->freeblks;
+    if (fs_rename(sb, "/pub/renamed/x", "/x") != -1 || errno != ENOTDIR ||
+            fs_rename(sb, "/archive", "/pub/renamed/x/y") != -1 ||
+            errno != ENOTDIR) {
+        printf("FAIL rename through a file\n");
+    }
+    if (fs_write_file(sb, "/pub/renamed/x", "x", 2) != -1 ||
+            errno != ENOTDIR) {
+        printf("FAIL write through a file\n");
+    }
+    if (fs_mkdir(sb, "/pub/renamed/d") != -1 || errno != ENOTDIR) {
+        printf("FAIL mkdir through a file\n");
+    }
+    if (fs_read_file(sb, "/pub/renamed/x", buf, 2) != -1 ||
+            errno != ENOTDIR ||
+            fs_delete_file(sb, "/pub/renamed/x") != -1 || errno != ENOTDIR) {
+        printf("FAIL lookup through a file\n");
+    }
+    if (sb->freeblks != freeblks) printf("FAIL path through a file leaked\n");
+    fs_close(sb);
+    unlink("mv.img");
+}
+
+void fs_snapshot_test(uint64_t fsize, uint64_t blksz) {
+    struct fs_stats st;
+    struct fs_dirent *snaps;
+    size_t nsnaps;
+    char buf[16];
+
+    makeImage("snap.img", fsize);
+
+    struct superblock *sb = fs_format("snap.img", blksz);
+    if (sb == NULL) return;
+    /* the reference table and snapshot directory stay once created */
+    fs_snapshot(sb, "first");
+    fs_snapshot_delete(sb, "first");
+    snaps = fs_snapshot_list(sb, &nsnaps);
+    if (snaps == NULL || nsnaps != 0) printf("FAIL list deleted snapshot\n");
+    fs_free_dirents(snaps, nsnaps);
+    fs_get_stats(sb, &st);
+    if (st.calls[FS_OP_SNAPSHOT] != 1 || st.calls[FS_OP_SNAPSHOT_DELETE] != 1 ||
+            st.calls[FS_OP_SNAPSHOT_LIST] != 1) {
+        printf("FAIL snapshot calls %d deletes %d lists %d\n",
+                (int) st.calls[FS_OP_SNAPSHOT],
+                (int) st.calls[FS_OP_SNAPSHOT_DELETE],
+                (int) st.calls[FS_OP_SNAPSHOT_LIST]);
+    }
+    uint64_t freeblks = sb->freeblks;
+
+    fs_mkdir(sb, "/a");
+    fs_write_file(sb, "/a/f", "one", 4);
+    fs_write_file(sb, "/g", "gee", 4);
+    if (fs_snapshot(sb, "s1") != 0) printf("FAIL snapshot\n");
+    if (fs_snapshot(sb, "s1") != -1 || errno != EEXIST) {
+        printf("FAIL duplicate snapshot\n");
+    }
+
+    fs_delete_file(sb, "/a/f");
+    fs_write_file(sb, "/a/f", "two", 4);
+    fs_rename(sb, "/g", "/h");
+    fs_mkdir(sb, "/a/new");
+
+    struct superblock *view = fs_snapshot_open(sb, "s1");
+    fs_read_file(view, "/a/f", buf, 4);
+    if (strcmp(buf, "one") != 0) printf("FAIL snapshot content\n");
+    if (!existsFile(view, "/g") || existsFile(view, "/h") ||
+            existsFile(view, "/a/new")) {
+        printf("FAIL snapshot namespace\n");
+    }
+    if (fs_write_file(view, "/x", "x", 2) != -1 || errno != EROFS) {
+        printf("FAIL wrote to a snapshot\n");
+    }
+    fs_close(view);
+    fs_read_file(sb, "/a/f", buf, 4);
+    if (strcmp(buf, "two") != 0) printf("FAIL live content\n");
+
+    fs_snapshot_delete(sb, "s1");
+    fs_remove_tree(sb, "/a");
+    fs_delete_file(sb, "/h");
+    if (sb->freeblks != freeblks) {
+        printf("FAIL snapshot leaked %d blocks\n", (int) (freeblks - sb->freeblks));
+    }
+    fs_close(sb);
+
+    /* on a full image the reference table comes from the free list */
+    struct fs_fsck_report rep;
+    char path[16], *data = malloc(32 * blksz);
+    int i;
+    memset(data, 's', 32 * blksz);
+    makeImage("snap.img", fsize);
+    sb = fs_format("snap.img", blksz);
+    fs_mkdir(sb, "/d");
+    for (i = 0; i < 16; i++) {
+        sprintf(path, "/d/f%d", i);
+        fs_write_file(sb, path, data, 8 * blksz);
+    }
+    i = 0;
+    do {
+        sprintf(path, "/f%d", i++);
+    } while (fs_write_file(sb, path, data, 32 * blksz) == 0);
+    while (fs_write_file(sb, path, data, blksz) == 0) {
+        sprintf(path, "/g%d", i++);
+    }
+    fs_remove_tree(sb, "/d");
+    if (fs_snapshot(sb, "full") != 0) printf("FAIL snapshot a full image\n");
+    if (fs_fsck(sb, 0, 4, NULL, &rep) != 0 || rep.leaked || rep.doubled ||
+            rep.bad_free) {
+        printf("FAIL fsck after snapshotting a full image\n");
+    }
+    fs_close(sb);
+    free(data);
+    unlink("snap.img");
+}
+
+/* a new trace, of a different size each time */
+static int restart_trace(const char *path, const struct fs_dirent *ent,
+        void *arg) {
+    return fs_trace_start(arg, 16 << ent->block % 8);
+}
+
+void fs_trace_test(uint64_t fsize, uint64_t blksz) {
+    struct fs_trace_header hdr;
+    struct fs_trace_event ev;
+    int io = 0, allocs = 0, frees = 0, ends = 0, gets = 0, puts = 0;
+    uint64_t i;
+
+    makeImage("trace.img", fsize);
+
+    struct superblock *sb = fs_format("trace.img", blksz);
+    if (sb == NULL) return;
+    if (fs_trace_save(sb, "trace.bin") != -1 || errno != ENOENT) {
+        printf("FAIL saved an empty trace\n");
+    }
+    fs_trace_start(sb, 4096);
+    fs_write_file(sb, "/t", "trace", 6);
+    fs_delete_file(sb, "/t");
+    fs_put_block(sb, fs_get_block(sb));
+    fs_trace_stop(sb);
+    fs_write_file(sb, "/u", "untraced", 9);
+    if (fs_trace_save(sb, "trace.bin") != 0) printf("FAIL trace save\n");
+    /* restarts while other walkers are recording */
+    for (i = 0; i < 40; i++) {
+        char path[16];
+        sprintf(path, "/w%d", (int) i);
+        fs_mkdir(sb, path);
+    }
+    fs_trace_start(sb, 16);
+    if (fs_walk(sb, "/", restart_trace, sb, 4) != 0) {
+        printf("FAIL walk while restarting the trace\n");
+    }
+    fs_trace_stop(sb);
+    fs_close(sb);
+
+    FILE *fd = fopen("trace.bin", "rb");
+    if (fread(&hdr, sizeof (hdr), 1, fd) != 1 || hdr.dropped != 0 ||
+            hdr.count == 0) {
+        printf("FAIL trace header\n");
+    }
+    for (i = 0; i < hdr.count && fread(&ev, sizeof (ev), 1, fd) == 1; i++) {
+        if (i == 0 && (ev.type != FS_TR_BEGIN || ev.arg != FS_OP_WRITE)) {
+            printf("FAIL trace does not start with fs_write_file\n");
+        }
+        io += (ev.type == FS_TR_READ || ev.type == FS_TR_WRITE);
+        allocs += (ev.type == FS_TR_ALLOC);
+        frees += (ev.type == FS_TR_FREE);
+        ends += (ev.type == FS_TR_END);
+        gets += (ev.type == FS_TR_BEGIN && ev.arg == FS_OP_GET_BLOCK);
+        puts += (ev.type == FS_TR_BEGIN && ev.arg == FS_OP_PUT_BLOCK);
+    }
+    fclose(fd);
+    if (io == 0 || allocs == 0 || frees == 0 || ends != 4) {
+        printf("FAIL trace events io %d allocs %d frees %d ends %d\n",
+                io, allocs, frees, ends);
+    }
+    if (gets != 1 || puts != 1) {
+        printf("FAIL traced %d fs_get_block %d fs_put_block\n", gets, puts);
+    }
+    unlink("trace.bin");
+    unlink("trace.img");
+}
+
+void fs_fsck_test(uint64_t fsize, uint64_t blksz) {
+    struct fs_fsck_report rep;
+    char path[64];
+    int i;
+
+    makeImage("fsck.img", fsize);
+
+    struct superblock *sb = fs_format("fsck.img", blksz);
+    if (sb == NULL) return;
+    fs_mkdir(sb, "/d");
+    for (i = 0; i < 40; i++) {
+        sprintf(path, "/d/f%d", i);
+        fs_write_file(sb, path, "fsck", 5);
+    }
+    fs_snapshot(sb, "s");
+    fs_delete_file(sb, "/d/f3");
+    fs_write_file(sb, "/g", "gee", 4);
+    if (fs_fsck(sb, 0, 4, NULL, &rep) != 0 || rep.leaked || rep.doubled ||
+            rep.bad_parent || rep.bad_size || rep.bad_refs || rep.bad_free ||
+            rep.bad_ptr || rep.dirs != 5 || rep.files != 41) {
+        printf("FAIL fsck on a clean filesystem\n");
+    }
+
+    /* leak a block, miscount /d and point /g at the wrong parent */
+    struct inode *node = malloc(blksz);
+    struct nodeinfo *info = malloc(blksz);
+    uint64_t g = findFile(sb, "/g", &i), d = findFile(sb, "/d", &i);
+    fs_get_block(sb);
+    seek_read(sb, g, node);
+    node->parent = g;
+    seek_write(sb, g, node);
+    seek_read(sb, d, node);
+    seek_read(sb, node->meta, info);
+    info->size++;
+    seek_write(sb, node->meta, info);
+    if (fs_fsck(sb, FS_FSCK_REPAIR, 4, NULL, &rep) != 0 || rep.leaked != 1 ||
+            rep.bad_size != 1 || rep.bad_parent != 1 || rep.repaired != 3) {
+        printf("FAIL fsck repair\n");
+    }
+    fs_fsck(sb, 0, 1, NULL, &rep);
+    if (rep.leaked || rep.bad_size || rep.bad_parent || rep.bad_free) {
+        printf("FAIL fsck after repair\n");
+    }
+
+    /* an entry of /d pointing past the end of the image */
+    seek_read(sb, d, node);
+    node->links[0] = sb->blks << 8;
+    seek_write(sb, d, node);
+    fs_fsck(sb, 0, 4, NULL, &rep);
+    if (rep.bad_ptr != 1 || rep.bad_size) {
+        printf("FAIL fsck of an entry out of range\n");
+    }
+    free(node);
+    free(info);
+    fs_close(sb);
+    unlink("fsck.img");
+}
+
+/* holds up the worker listing / so that another one takes /d */
+static int slow_entry(const char *path, const struct fs_dirent *ent,
+        void *arg) {
+    if (strcmp(path, "/slow") == 0) usleep(50000);
+    return 0;
+}
+
+void fs_csum_test(uint64_t fsize, uint64_t blksz) {
+    struct fs_fsck_report rep;
+    struct fs_stats st;
+    char buf[16], *junk = "corrupt";
+    int found;
+
+    makeImage("csum.img", fsize);
+
+    struct superblock *sb = fs_format_features("csum.img", blksz,
+            FS_FEAT_META_CSUM | FS_FEAT_DATA_CSUM);
+    if (sb == NULL) return;
+    fs_mkdir(sb, "/d");
+    fs_write_file(sb, "/d/f", "data", 5);
+    fs_write_file(sb, "/d/g", "meta", 5);
+    fs_write_file(sb, "/slow", "slow", 5);
+    fs_fsck(sb, 0, 2, NULL, &rep);
+    fs_get_stats(sb, &st);
+    if (rep.bad_csum != 0 || st.io_errors != 0) {
+        printf("FAIL checksum errors on a clean filesystem\n");
+    }
+    /* a run of data blocks updates the checksum table once */
+    char *run = calloc(16, blksz);
+    memset(run, 'r', 16 * blksz);
+    fs_reset_stats(sb);
+    fs_write_file(sb, "/run", run, 16 * blksz);
+    fs_get_stats(sb, &st);
+    if (st.writes[FS_BLK_META] >= 8) {
+        printf("FAIL %d metadata writes for one run\n",
+                (int) st.writes[FS_BLK_META]);
+    }
+    free(run);
+
+    /* flip bytes behind the library's back */
+    struct inode *node = malloc(blksz);
+    seek_read(sb, findFile(sb, "/d/f", &found), node);
+    pwrite(sb->fd, junk, 2, node->links[0] * blksz);
+    seek_read(sb, findFile(sb, "/d/g", &found), node);
+    pwrite(sb->fd, junk, 3, node->meta * blksz + blksz / 2);
+    if (fs_read_file(sb, "/d/f", buf, 5) != -1 || errno != EIO) {
+        printf("FAIL read corrupt data\n");
+    }
+    if (fs_read_file(sb, "/d/g", buf, 5) != -1 || errno != EIO) {
+        printf("FAIL read corrupt metadata\n");
+    }
+    if (fs_walk(sb, "/", slow_entry, NULL, 4) != -1 || errno != EIO) {
+        printf("FAIL walk over corrupt metadata\n");
+    }
+    fs_fsck(sb, 0, 2, NULL, &rep);
+    if (rep.bad_csum < 2) printf("FAIL fsck found %d checksum errors\n",
+            (int) rep.bad_csum);
+    free(node);
+    fs_close(sb);
+
+    FILE *fd = fopen("csum.img", "r+");
+    fseek(fd, 8, SEEK_SET);
+    fputc(1, fd);
+    fclose(fd);
+    if (fs_open("csum.img") != NULL || errno != EIO) {
+        printf("FAIL opened a corrupt superblock\n");
+    }
+    unlink("csum.img");
+}
+
+void fs_grow_test(uint64_t fsize, uint64_t blksz) {
+    struct fs_fsck_report rep;
+    char buf[16];
+    int found;
+
+    makeImage("grow.img", fsize / 4);
+
+    struct superblock *sb = fs_format_features("grow.img", blksz,
+            FS_FEAT_META_CSUM | FS_FEAT_DATA_CSUM);
+    if (sb == NULL) return;
+    fs_mkdir(sb, "/d");
+    fs_write_file(sb, "/d/f", "small", 6);
+    fs_snapshot(sb, "s");
+    uint64_t blks = sb->blks, freeblks = sb->freeblks;
+    if (fs_grow(sb, fsize / 8) != -1 || errno != EINVAL) {
+        printf("FAIL grow to a smaller size\n");
+    }
+    if (fs_grow(sb, fsize) != 0 || sb->blks != fsize / blksz ||
+            getFileSize(sb->fd) != fsize) {
+        printf("FAIL grow\n");
+    }
+    /* the grown tables take the difference, their old blocks come back */
+    uint64_t tables = getTableBlocks(sb, sb->blks, 1) +
+            getTableBlocks(sb, sb->blks, 4) - getTableBlocks(sb, blks, 1) -
+            getTableBlocks(sb, blks, 4);
+    if (sb->freeblks != freeblks + sb->blks - blks - tables) {
+        printf("FAIL grow added %d free blocks\n",
+                (int) (sb->freeblks - freeblks));
+    }
+    /* use up the old free space: new files must land in the new blocks */
+    uint64_t *taken = malloc(freeblks * sizeof (uint64_t)), ntaken = 0;
+    while (ntaken < freeblks) taken[ntaken++] = fs_get_block(sb);
+    if (fs_write_file(sb, "/d/g", "grown", 6) != 0 ||
+            findFile(sb, "/d/g", &found) < blks) {
+        printf("FAIL write after grow\n");
+    }
+    fs_put_blocks(sb, taken, ntaken);
+    free(taken);
+    fs_close(sb);
+
+    sb = fs_open("grow.img");
+    if (sb == NULL || sb->blks != fsize / blksz) {
+        printf("FAIL reopen grown image\n");
+        if (sb) fs_close(sb);
+        unlink("grow.img");
+        return;
+    }
+    struct superblock *view = fs_snapshot_open(sb, "s");
+    if (fs_read_file(sb, "/d/g", buf, 6) < 0 || strcmp(buf, "grown") != 0 ||
+            fs_read_file(view, "/d/f", buf, 6) < 0 ||
+            strcmp(buf, "small") != 0) {
+        printf("FAIL read after grow\n");
+    }
+    fs_close(view);
+    if (fs_fsck(sb, 0, 2, NULL, &rep) != 0 || rep.leaked || rep.doubled ||
+            rep.bad_free || rep.bad_refs || rep.bad_csum) {
+        printf("FAIL fsck after grow\n");
+    }
+    fs_close(sb);
+    unlink("grow.img");
+}
+
+void fs_defrag_test(uint64_t fsize, uint64_t blksz) {
+    struct fs_defrag_report rep;
+    struct fs_fsck_report frep;
+    struct inode *node = malloc(blksz);
+    char path[64], buf[16];
+    int i, found, r, scattered = 0;
+
+    makeImage("defrag.img", fsize / 2);
+
+    struct superblock *sb = fs_format_features("defrag.img", blksz,
+            FS_FEAT_META_CSUM | FS_FEAT_DATA_CSUM);
+    if (sb == NULL) {
+        free(node);
+        return;
+    }
+    fs_mkdir(sb, "/d");
+    fs_write_file(sb, "/d/old", "snap", 5);
+    fs_snapshot(sb, "s");
+    /* the grown tables move past the blocks in use */
+    fs_grow(sb, fsize);
+    /* churn: the second round reuses the freed blocks */
+    for (i = 0; i < 40; i++) {
+        sprintf(path, "/d/f%d", i);
+        fs_write_file(sb, path, "churn", 6);
+    }
+    for (i = 0; i < 40; i += 2) {
+        sprintf(path, "/d/f%d", i);
+        fs_delete_file(sb, path);
+    }
+    for (i = 0; i < 40; i += 2) {
+        sprintf(path, "/d/g%d", i);
+        fs_write_file(sb, path, "moved", 6);
+        uint64_t head = findFile(sb, path, &found);
+        seek_read(sb, head, node);
+        if (node->meta != head + 1 || node->links[0] != head + 2) {
+            scattered++;
+        }
+    }
+    if (scattered == 0) printf("FAIL defrag test did not fragment\n");
+    if (fs_shrink(sb, MIN_BLOCK_COUNT * blksz) != -1 || errno != ENOSPC) {
+        printf("FAIL shrink over blocks in use\n");
+    }
+
+    /* the snapshot trees are visited too: 5 directories and /d/old twice */
+    if (fs_defrag(sb, 0, 0, &rep) != 0 || rep.moved == 0 ||
+            rep.files != 42 || rep.dirs != 5) {
+        printf("FAIL defrag\n");
+    }
+    for (i = 0; i < 40; i += 2) {
+        uint64_t head;
+        sprintf(path, "/d/g%d", i);
+        head = findFile(sb, path, &found);
+        seek_read(sb, head, node);
+        if (node->meta != head + 1 || node->links[0] != head + 2) {
+            printf("FAIL defrag left %s scattered\n", path);
+        }
+    }
+    /* shrink after deleting most files; compaction runs in small steps */
+    for (i = 1; i < 40; i += 2) {
+        sprintf(path, "/d/f%d", i);
+        if (i > 4) fs_delete_file(sb, path);
+    }
+    uint64_t blks = sb->blks;
+    while ((r = fs_defrag(sb, FS_DEFRAG_COMPACT, 1, &rep)) == 1);
+    if (r != 0 || fs_shrink(sb, 0) != 0 || sb->blks >= blks / 2 ||
+            getFileSize(sb->fd) != sb->blks * blksz) {
+        printf("FAIL compact and shrink to %d blocks\n", (int) sb->blks);
+    }
+    fs_close(sb);
+
+    sb = fs_open("defrag.img");
+    struct superblock *view = fs_snapshot_open(sb, "s");
+    if (fs_read_file(sb, "/d/g38", buf, 6) < 0 || strcmp(buf, "moved") != 0 ||
+            fs_read_file(sb, "/d/f3", buf, 6) < 0 ||
+            strcmp(buf, "churn") != 0 ||
+            fs_read_file(view, "/d/old", buf, 5) < 0 ||
+            strcmp(buf, "snap") != 0) {
+        printf("FAIL read after defrag\n");
+    }
+    fs_close(view);
+    if (fs_fsck(sb, 0, 2, NULL, &frep) != 0 || frep.leaked || frep.doubled ||
+            frep.bad_parent || frep.bad_size || frep.bad_free ||
+            frep.bad_refs || frep.bad_ptr || frep.bad_csum) {
+        printf("FAIL fsck after defrag\n");
+    }
+    free(node);
+    fs_close(sb);
+    unlink("defrag.img");
+}
+
+/* compressible files take fewer data blocks and read back whole or in part */
+void fs_compress_test(uint64_t fsize, uint64_t blksz) {
+    struct fs_fsck_report frep;
+    struct fs_stats st0, st1;
+    size_t i, len = 3 * FS_COMPRESS_CHUNK / 2;
+    char *text = malloc(len + 1), *buf = malloc(len + 1);
+
+    for (i = 0; i < len; i++) text[i] = "lorem ipsum dolor "[i % 18] + i / 4096 % 3;
+    text[len] = 0;
+    makeImage("compress.img", fsize);
+
+    struct superblock *sb = fs_format("compress.img", blksz);
+    if (sb == NULL) {
+        free(text);
+        free(buf);
+        return;
+    }
+    fs_get_stats(sb, &st0);
+    if (fs_write_file_flags(sb, "/z", text, len + 1, FS_WRITE_COMPRESS) != 0) {
+        printf("FAIL compressed write\n");
+    }
+    fs_get_stats(sb, &st1);
+    if (st1.writes[FS_BLK_DATA] - st0.writes[FS_BLK_DATA] >= len / blksz / 2) {
+        printf("FAIL compressed write used %d data blocks\n",
+                (int) (st1.writes[FS_BLK_DATA] - st0.writes[FS_BLK_DATA]));
+    }
+    /* too small to gain a block: stored as is */
+    fs_write_file_flags(sb, "/s", "tiny", 5, FS_WRITE_COMPRESS);
+    /* one chunk of text, then chunks that stay raw */
+    size_t mlen = 5 * FS_COMPRESS_CHUNK;
+    char *mixed = malloc(mlen), *mbuf = malloc(mlen);
+    uint32_t x = 1;
+    memcpy(mixed, text, FS_COMPRESS_CHUNK);
+    for (i = FS_COMPRESS_CHUNK; i < mlen; i++) {
+        x = x * 1103515245 + 12345;
+        mixed[i] = x >> 16;
+    }
+    fs_write_file_flags(sb, "/m", mixed, mlen, FS_WRITE_COMPRESS);
+    fs_snapshot(sb, "s");
+    fs_close(sb);
+
+    sb = fs_open("compress.img");
+    memset(buf, 0, len + 1);
+    if (fs_read_file(sb, "/z", buf, len + 1) != len + 1 ||
+            memcmp(buf, text, len + 1) != 0) {
+        printf("FAIL compressed read\n");
+    }
+    memset(buf, 0, len + 1);
+    if (fs_read_file(sb, "/z", buf, FS_COMPRESS_CHUNK + 10) !=
+            FS_COMPRESS_CHUNK + 10 ||
+            memcmp(buf, text, FS_COMPRESS_CHUNK + 10) != 0 ||
+            buf[FS_COMPRESS_CHUNK + 10] != 0) {
+        printf("FAIL partial compressed read\n");
+    }
+    /* a short read decodes, and reads, the first chunk only */
+    fs_reset_stats(sb);
+    if (fs_read_file(sb, "/m", mbuf, 10) != 10 || memcmp(mbuf, mixed, 10)) {
+        printf("FAIL short read of raw chunks\n");
+    }
+    fs_get_stats(sb, &st1);
+    if (st1.reads[FS_BLK_DATA] > (FS_COMPRESS_CHUNK + 4) / blksz + 2) {
+        printf("FAIL short compressed read took %d data blocks\n",
+                (int) st1.reads[FS_BLK_DATA]);
+    }
+    if (fs_read_file(sb, "/m", mbuf, mlen) != mlen ||
+            memcmp(mbuf, mixed, mlen) != 0) {
+        printf("FAIL read of raw chunks\n");
+    }
+    free(mixed);
+    free(mbuf);
+    struct superblock *view = fs_snapshot_open(sb, "s");
+    if (fs_read_file(view, "/s", buf, 5) < 0 || strcmp(buf, "tiny") != 0 ||
+            fs_read_file(view, "/z", buf, len + 1) != len + 1 ||
+            memcmp(buf, text, len + 1) != 0) {
+        printf("FAIL compressed read from snapshot\n");
+    }
+    fs_close(view);
+    if (fs_fsck(sb, 0, 2, NULL, &frep) != 0 || frep.leaked || frep.doubled ||
+            frep.bad_size || frep.bad_free || frep.bad_ptr) {
+        printf("FAIL fsck with compressed files\n");
+    }
+    fs_close(sb);
+    unlink("compress.img");
+    free(text);
+    free(buf);
+}
+
+/* files built from the same template share their identical blocks */
+void fs_dedup_test(uint64_t fsize, uint64_t blksz) {
+    struct fs_fsck_report frep;
+    struct fs_stats st;
+    size_t len = 8 * blksz;
+    char *data = malloc(len), *buf = malloc(len), path[16];
+    int i, j;
+
+    makeImage("dedup.img", fsize / 2);
+
+    struct superblock *sb = fs_format_features("dedup.img", blksz,
+            FS_FEAT_META_CSUM | FS_FEAT_DATA_CSUM | FS_FEAT_DEDUP);
+    if (sb == NULL) {
+        free(data);
+        free(buf);
+        return;
+    }
+    fs_reset_stats(sb);
+    /* eight distinct blocks, the seventh one unique to each file */
+    for (i = 0; i < 10; i++) {
+        for (j = 0; j < 8; j++) memset(data + j * blksz, 'a' + j, blksz);
+        data[6 * blksz] = '0' + i;
+        data[len - 1] = 0;
+        sprintf(path, "/f%d", i);
+        fs_write_file(sb, path, data, len);
+    }
+    fs_get_stats(sb, &st);
+    if (st.dedup_hits != 9 * 7 || st.writes[FS_BLK_DATA] != 8 + 9) {
+        printf("FAIL dedup shared %d blocks, wrote %d\n", (int) st.dedup_hits,
+                (int) st.writes[FS_BLK_DATA]);
+    }
+    fs_snapshot(sb, "s");
+    for (i = 0; i < 9; i++) {
+        sprintf(path, "/f%d", i);
+        fs_delete_file(sb, path);
+    }
+    if (fs_read_file(sb, "/f9", buf, len) < 0 || strcmp(buf, data) != 0) {
+        printf("FAIL read of a deduplicated file\n");
+    }
+    struct superblock *view = fs_snapshot_open(sb, "s");
+    data[6 * blksz] = '0';
+    if (fs_read_file(view, "/f0", buf, len) < 0 || strcmp(buf, data) != 0) {
+        printf("FAIL dedup read from snapshot\n");
+    }
+    fs_close(view);
+    if (fs_fsck(sb, 0, 2, NULL, &frep) != 0 || frep.leaked || frep.doubled ||
+            frep.bad_refs || frep.bad_free || frep.bad_ptr || frep.bad_csum) {
+        printf("FAIL fsck with shared blocks\n");
+    }
+
+    /* the last references go: every block comes back and the index must
+     * not hand out the freed ones */
+    fs_snapshot_delete(sb, "s");
+    fs_delete_file(sb, "/f9");
+    fs_mkdir(sb, "/d");
+    fs_write_file(sb, "/d/g", data, len);
+    fs_get_stats(sb, &st);
+    if (fs_read_file(sb, "/d/g", buf, len) < 0 || strcmp(buf, data) != 0 ||
+            st.dedup_hits != 9 * 7) {
+        printf("FAIL dedup after freeing shared blocks\n");
+    }
+    fs_delete_file(sb, "/d/g");
+    fs_rmdir(sb, "/d");
+    /* the index is rebuilt for the new size */
+    fs_grow(sb, fsize);
+    fs_write_file(sb, "/a", data, len);
+    fs_write_file(sb, "/b", data, len);
+    fs_get_stats(sb, &st);
+    if (st.dedup_hits != 9 * 7 + 8 || fs_read_file(sb, "/b", buf, len) < 0 ||
+            strcmp(buf, data) != 0) {
+        printf("FAIL dedup after grow\n");
+    }
+    /* freeing a file reads its data blocks to clear their slots, and
+     * nothing else */
+    for (j = 0; j < 8; j++) memset(buf + j * blksz, 'p' + j, blksz);
+    fs_write_file(sb, "/u", buf, len);
+    fs_reset_stats(sb);
+    fs_delete_file(sb, "/u");
+    fs_get_stats(sb, &st);
+    if (st.reads[FS_BLK_DATA] != 8) {
+        printf("FAIL delete read %d data blocks\n",
+                (int) st.reads[FS_BLK_DATA]);
+    }
+    if (fs_fsck(sb, 0, 2, NULL, &frep) != 0 || frep.leaked || frep.doubled ||
+            frep.bad_refs || frep.bad_free || frep.bad_ptr || frep.bad_csum) {
+        printf("FAIL fsck after dedup\n");
+    }
+
+    /* a block shared by dedup as often as it may be, then copied once per
+     * snapshot until its one-byte count is full */
+    uint64_t freeblks;
+    memset(data, 'z', blksz);
+    for (i = 0; i <= 128; i++) {
+        sprintf(path, "/r%d", i);
+        fs_write_file(sb, path, data, blksz);
+    }
+    for (i = 0; ; i++) {
+        sprintf(path, "s%d", i);
+        if (fs_snapshot(sb, path) != 0) break;
+        freeblks = sb->freeblks;
+        if (fs_rename(sb, i % 2 ? "/q" : "/r0", i % 2 ? "/r0" : "/q") != 0) {
+            break;
+        }
+    }
+    if (i != 255 - 128 || errno != EMLINK || sb->freeblks != freeblks) {
+        printf("FAIL %d copies of a block shared by dedup\n", i);
+    }
+    if (fs_fsck(sb, 0, 2, NULL, &frep) != 0 || frep.leaked || frep.doubled ||
+            frep.bad_refs || frep.bad_free || frep.bad_ptr) {
+        printf("FAIL fsck with a full reference count\n");
+    }
+    for (j = 0; j <= 128; j++) {
+        sprintf(path, "/r%d", j);
+        fs_delete_file(sb, path);
+    }
+    fs_delete_file(sb, "/q");
+    memset(buf, 'x', blksz);
+    fs_write_file(sb, "/x", buf, blksz);
+    view = fs_snapshot_open(sb, "s0");
+    if (view == NULL || fs_read_file(view, "/r0", buf, blksz) != blksz ||
+            memcmp(buf, data, blksz) != 0) {
+        printf("FAIL snapshot of a fully shared block\n");
+    }
+    if (view) fs_close(view);
+    for (j = 0; j <= i; j++) {
+        sprintf(path, "s%d", j);
+        fs_snapshot_delete(sb, path);
+    }
+    if (fs_fsck(sb, 0, 2, NULL, &frep) != 0 || frep.leaked || frep.doubled ||
+            frep.bad_refs || frep.bad_free || frep.bad_ptr) {
+        printf("FAIL fsck after dropping the shared block\n");
+    }
+    fs_close(sb);
+    unlink("dedup.img");
+    free(data);
+    free(buf);
+}
+
+/* zero blocks are written as holes and read back as zeros */
+void fs_sparse_test(uint64_t fsize, uint64_t blksz) {
+    struct fs_defrag_report rep;
+    struct fs_fsck_report frep;
+    struct fs_stats st;
+    size_t len = 16 * blksz + 5;
+    char *data = calloc(1, len), *buf = malloc(len), *big;
+    int r;
+
+    makeImage("sparse.img", fsize);
+
+    struct superblock *sb = fs_format_features("sparse.img", blksz,
+            FS_FEAT_META_CSUM | FS_FEAT_DATA_CSUM);
+    if (sb == NULL) {
+        free(data);
+        free(buf);
+        return;
+    }
+    memset(data + 3 * blksz + 7, 'x', 9);
+    data[len - 1] = 'y';
+    fs_reset_stats(sb);
+    fs_write_file(sb, "/s", data, len);
+    fs_get_stats(sb, &st);
+    if (st.holes != 15 || st.writes[FS_BLK_DATA] != 2) {
+        printf("FAIL sparse write made %d holes, wrote %d blocks\n",
+                (int) st.holes, (int) st.writes[FS_BLK_DATA]);
+    }
+    memset(buf, 1, len);
+    fs_reset_stats(sb);
+    if (fs_read_file(sb, "/s", buf, len) != len || memcmp(buf, data, len)) {
+        printf("FAIL sparse read\n");
+    }
+    fs_get_stats(sb, &st);
+    if (st.reads[FS_BLK_DATA] != 2) printf("FAIL sparse read did I/O for holes\n");
+
+    /* more zeros than free space */
+    big = calloc(sb->freeblks + 10, blksz);
+    if (fs_write_file(sb, "/big", big, (sb->freeblks + 10) * blksz) != 0) {
+        printf("FAIL sparse write over free space\n");
+    }
+    free(big);
+    fs_snapshot(sb, "s");
+    fs_delete_file(sb, "/big");
+    while ((r = fs_defrag(sb, FS_DEFRAG_COMPACT, 0, &rep)) == 1);
+    if (r != 0 || fs_read_file(sb, "/s", buf, len) != len ||
+            memcmp(buf, data, len)) {
+        printf("FAIL sparse read after defrag\n");
+    }
+    if (fs_fsck(sb, 0, 2, NULL, &frep) != 0 || frep.leaked || frep.doubled ||
+            frep.bad_size || frep.bad_refs || frep.bad_free || frep.bad_ptr ||
+            frep.bad_csum) {
+        printf("FAIL fsck with holes\n");
+    }
+    fs_snapshot_delete(sb, "s");
+    fs_delete_file(sb, "/s");
+    if (fs_fsck(sb, 0, 2, NULL, &frep) != 0 || frep.leaked || frep.bad_free) {
+        printf("FAIL fsck after deleting sparse files\n");
+    }
+    fs_close(sb);
+    unlink("sparse.img");
+    free(data);
+    free(buf);
+}
+
+/* O_DIRECT works for block sizes matching the device alignment */
+void fs_direct_test(uint64_t fsize, uint64_t blksz) {
+    struct fs_fsck_report frep;
+    size_t i, len = 5 * blksz + 3;
+    char *data = malloc(len), *buf = malloc(len), path[16];
+
+    makeImage("direct.img", fsize);
+
+    struct superblock *sb = fs_format_features("direct.img", blksz,
+            FS_FEAT_META_CSUM | FS_FEAT_DATA_CSUM | FS_FEAT_DEDUP);
+    if (sb == NULL) {
+        free(data);
+        free(buf);
+        return;
+    }
+    if (fs_set_direct_io(sb, 1) != 0) {
+        if (blksz >= 4096 || errno != EINVAL) {
+            printf("FAIL O_DIRECT with %d byte blocks\n", (int) blksz);
+        }
+        fs_close(sb);
+        unlink("direct.img");
+        free(data);
+        free(buf);
+        return;
+    }
+    for (i = 0; i < len; i++) data[i] = i % 251;
+    fs_mkdir(sb, "/d");
+    for (i = 0; i < 20; i++) {
+        sprintf(path, "/d/f%d", (int) i);
+        fs_write_file(sb, path, data, len);
+    }
+    fs_delete_file(sb, "/d/f3");
+    if (fs_read_file(sb, "/d/f7", buf, len) != len || memcmp(buf, data, len)) {
+        printf("FAIL read with O_DIRECT\n");
+    }
+    if (fs_fsck(sb, 0, 4, NULL, &frep) != 0 || frep.leaked || frep.doubled ||
+            frep.bad_refs || frep.bad_free || frep.bad_ptr || frep.bad_csum) {
+        printf("FAIL fsck with O_DIRECT\n");
+    }
+    if (fs_set_direct_io(sb, 0) != 0) printf("FAIL leaving O_DIRECT\n");
+    fs_close(sb);
+
+    sb = fs_open("direct.img");
+    if (fs_read_file(sb, "/d/f19", buf, len) != len || memcmp(buf, data, len)) {
+        printf("FAIL read after O_DIRECT\n");
+    }
+    fs_close(sb);
+    unlink("direct.img");
+    free(data);
+    free(buf);
+}
+
+/* shared read-only opens: readers coexist, a writer is locked out and
+ * nothing a reader does changes the image */
+void fs_shared_test(uint64_t fsize, uint64_t blksz) {
+    struct fs_fsck_report frep;
+    struct superblock *a, *b, *w;
+    size_t i, len = 3 * blksz + 5;
+    char *data = malloc(len), *buf = malloc(len);
+
+    makeImage("shared.img", fsize);
+
+    struct superblock *sb = fs_format("shared.img", blksz);
+    for (i = 0; i < len; i++) data[i] = i % 13;
+    fs_mkdir(sb, "/d");
+    fs_write_file(sb, "/d/plain", data, len);
+    fs_write_file_flags(sb, "/d/packed", data, len, FS_WRITE_COMPRESS);
+    fs_close(sb);
+
+    a = fs_open_flags("shared.img", FS_OPEN_SHARED);
+    b = fs_open_flags("shared.img", FS_OPEN_SHARED);
+    if (a == NULL || b == NULL) {
+        printf("FAIL two shared opens\n");
+        if (a) fs_close(a);
+        if (b) fs_close(b);
+        unlink("shared.img");
+        free(data);
+        free(buf);
+        return;
+    }
+    w = fs_open("shared.img");
+    if (w != NULL || errno != EBUSY) {
+        printf("FAIL exclusive open beside shared ones\n");
+        if (w) fs_close(w);
+    }
+    if (fs_read_file(a, "/d/plain", buf, len) != len || memcmp(buf, data, len) ||
+            fs_read_file(b, "/d/packed", buf, len) != len ||
+            memcmp(buf, data, len)) {
+        printf("FAIL read from a shared open\n");
+    }
+    if (fs_write_file(a, "/d/new", data, len) != -1 || errno != EROFS ||
+            fs_mkdir(b, "/e") != -1 || errno != EROFS ||
+            fs_delete_file(a, "/d/plain") != -1 || errno != EROFS ||
+            fs_get_block(b) != (uint64_t) - 1 || errno != EROFS) {
+        printf("FAIL mutating a shared open\n");
+    }
+    if (fs_fsck(a, 0, 4, NULL, &frep) != 0 || frep.leaked || frep.doubled ||
+            frep.bad_refs || frep.bad_free || frep.bad_ptr || frep.bad_csum) {
+        printf("FAIL fsck of a shared open\n");
+    }
+    fs_close(a);
+    fs_close(b);
+
+    w = fs_open("shared.img");
+    if (w == NULL) {
+        printf("FAIL exclusive open after shared ones\n");
+    } else {
+        a = fs_open_flags("shared.img", FS_OPEN_SHARED);
+        if (a != NULL || errno != EBUSY) {
+            printf("FAIL shared open beside an exclusive one\n");
+            if (a) fs_close(a);
+        }
+        if (fs_read_file(w, "/d/plain", buf, len) != len ||
+                memcmp(buf, data, len)) {
+            printf("FAIL read after shared opens\n");
+        }
+        fs_close(w);
+    }
+    unlink("shared.img");
+    free(data);
+    free(buf);
+}
+
+/* a filesystem striped over three images of different sizes */
+void fs_stripe_test(uint64_t fsize, uint64_t blksz) {
+    const char *names[] = {"stripe0.img", "stripe1.img", "stripe2.img"};
+    struct fs_fsck_report frep;
+    uint64_t unit = 4, per = fsize / 3 / blksz;
+    size_t i, len = 11 * blksz + 7;
+    char *data = malloc(len), *buf = malloc(len), path[16];
+    struct superblock *sb;
+    struct stat st[3];
+    int d;
+
+    for (d = 0; d < 3; d++) {
+        makeImage(names[d], fsize / 3 + d * blksz);
+    }
+    if (fs_format_striped(names, 3, blksz, 0, FS_FEAT_META_CSUM) != NULL ||
+            errno != EINVAL) {
+        printf("FAIL striping without a stripe unit\n");
+    }
+    sb = fs_format_striped(names, 3, blksz, unit,
+            FS_FEAT_META_CSUM | FS_FEAT_DATA_CSUM);
+    if (sb == NULL || sb->blks != 3 * (per - per % unit) ||
+            !(sb->features & FS_FEAT_STRIPED)) {
+        printf("FAIL format striped\n");
+        if (sb) fs_close(sb);
+        for (d = 0; d < 3; d++) unlink(names[d]);
+        free(data);
+        free(buf);
+        return;
+    }
+    for (i = 0; i < len; i++) data[i] = i % 241;
+    fs_mkdir(sb, "/d");
+    for (i = 0; i < 12; i++) {
+        sprintf(path, "/d/f%d", (int) i);
+        fs_write_file(sb, path, data, len);
+    }
+    fs_delete_file(sb, "/d/f5");
+    if (fs_read_file(sb, "/d/f9", buf, len) != len || memcmp(buf, data, len)) {
+        printf("FAIL read striped\n");
+    }
+    if (fs_fsck(sb, 0, 4, NULL, &frep) != 0 || frep.leaked || frep.doubled ||
+            frep.bad_refs || frep.bad_free || frep.bad_ptr || frep.bad_csum) {
+        printf("FAIL fsck striped\n");
+    }
+    fs_close(sb);
+
+    if (fs_open(names[0]) != NULL || errno != EINVAL ||
+            fs_open_striped(names, 2, 0) != NULL || errno != EINVAL) {
+        printf("FAIL open striped with the wrong images\n");
+    }
+    sb = fs_open_striped(names, 3, 0);
+    if (sb == NULL) {
+        printf("FAIL open striped\n");
+    } else {
+        if (fs_read_file(sb, "/d/f11", buf, len) != len ||
+                memcmp(buf, data, len)) {
+            printf("FAIL read after reopening striped\n");
+        }
+        /* every image grows by its share */
+        uint64_t blks = sb->blks + 3 * unit + 1;
+        if (fs_grow(sb, blks * blksz) != 0 || sb->blks != blks) {
+            printf("FAIL grow striped\n");
+        }
+        for (d = 0; d < 3; d++) stat(names[d], &st[d]);
+        if (st[0].st_size != (blks / (3 * unit) * unit + 1) * blksz ||
+                st[2].st_size < blks / (3 * unit) * unit * blksz) {
+            printf("FAIL grow striped images\n");
+        }
+        if (fs_write_file(sb, "/d/g", data, len) != 0 ||
+                fs_read_file(sb, "/d/g", buf, len) != len ||
+                memcmp(buf, data, len)) {
+            printf("FAIL write after growing striped\n");
+        }
+        fs_close(sb);
+    }
+    for (d = 0; d < 3; d++) unlink(names[d]);
+    free(data);
+    free(buf);
+}
+
+/* metadata and data written together land in separate dense runs */
+void fs_placement_test(uint64_t fsize, uint64_t blksz) {
+    struct fs_fsck_report frep;
+    struct inode *node = malloc(blksz);
+    uint64_t i, k, b, lo = (uint64_t) - 1, hi = 0, nfiles = 20;
+    size_t len = 8 * blksz;
+    char *data = malloc(len), path[16];
+    int found, split = 0;
+
+    makeImage("place.img", fsize);
+
+    struct superblock *sb = fs_format("place.img", blksz);
+    fs_mkdir(sb, "/d");
+    FOR_EACH(i, nfiles) {
+        memset(data, 'a' + i, len);
+        sprintf(path, "/d/f%d", (int) i);
+        fs_write_file(sb, path, data, len);
+        b = findFile(sb, path, &found);
+        lo = MIN(lo, b);
+        hi = MAX(hi, b);
+        seek_read(sb, b, node);
+        FOR_EACH(k, 7) split |= node->links[k + 1] != node->links[k] + 1;
+    }
+    /* an inode and a name per file, not eight data blocks in between */
+    if (hi - lo >= 3 * nfiles) {
+        printf("FAIL inodes spread over %d blocks\n", (int) (hi - lo));
+    }
+    if (split) printf("FAIL data blocks not contiguous\n");
+    /* the tail moves past the data extent, which then goes to the free list */
+    FOR_EACH(i, 40) {
+        sprintf(path, "/e%d", (int) i);
+        fs_mkdir(sb, path);
+    }
+    if (fs_fsck(sb, 0, 4, NULL, &frep) != 0 || frep.leaked || frep.bad_free) {
+        printf("FAIL fsck after placement\n");
+    }
+    fs_write_file(sb, "/d/g", data, len);
+    fs_close(sb);
+
+    sb = fs_open("place.img");
+    if (fs_fsck(sb, 0, 4, NULL, &frep) != 0 || frep.leaked || frep.bad_free) {
+        printf("FAIL fsck after reopening placed image\n");
+    }
+    /* an aged image: the freed blocks come back by kind */
+    FOR_EACH(i, nfiles) {
+        sprintf(path, "/d/f%d", (int) i);
+        fs_delete_file(sb, path);
+    }
+    lo = (uint64_t) - 1;
+    hi = 0;
+    FOR_EACH(i, nfiles) {
+        sprintf(path, "/d/h%d", (int) i);
+        fs_write_file(sb, path, data, len);
+        b = findFile(sb, path, &found);
+        lo = MIN(lo, b);
+        hi = MAX(hi, b);
+        seek_read(sb, b, node);
+        FOR_EACH(k, 7) split |= node->links[k + 1] != node->links[k] + 1;
+    }
+    if (hi - lo >= 3 * nfiles) {
+        printf("FAIL recycled inodes spread over %d blocks\n", (int) (hi - lo));
+    }
+    if (split) printf("FAIL recycled data blocks not contiguous\n");
+    fs_close(sb);
+
+    /* a process dying with extents set aside leaks them, and nothing else */
+    if (fork() == 0) {
+        sb = fs_open("place.img");
+        fs_write_file(sb, "/crash", data, len);
+        _exit(0);
+    }
+    wait(NULL);
+    sb = fs_open("place.img");
+    i = 0;
+    do {
+        sprintf(path, "/fill%d", (int) i++);
+    } while (fs_write_file(sb, path, data, len) == 0);
+    if (errno != ENOSPC || getFileSize(sb->fd) != fsize ||
+            fs_fsck(sb, FS_FSCK_REPAIR, 4, NULL, &frep) < 0 ||
+            frep.bad_ptr || frep.doubled || frep.bad_free) {
+        printf("FAIL fill after a crash\n");
+    }
+    fs_close(sb);
+    unlink("place.img");
+    free(data);
+    free(node);
+}
+
+/* a preloaded namespace answers lookups and listings without reading
+ * metadata, and is dropped by the first change */
+void fs_preload_test(uint64_t fsize, uint64_t blksz) {
+    struct fs_stats st;
+    struct fs_dirent *ents;
+    struct superblock *sb, *view;
+    size_t i, count, len = 14 * blksz + 9, nfiles = 30;
+    char *data = malloc(len), *buf = malloc(len), path[32], *names;
+
+    makeImage("preload.img", fsize);
+
+    sb = fs_format("preload.img", blksz);
+    for (i = 0; i < len; i++) data[i] = i % 7 ? i % 199 : 0;
+    memset(data + 2 * blksz, 0, 2 * blksz); //a hole
+    fs_mkdir(sb, "/a");
+    fs_mkdir(sb, "/a/b");
+    FOR_EACH(i, nfiles) {
+        sprintf(path, "/a/b/f%d", (int) i);
+        fs_write_file_flags(sb, path, data, len - i,
+                i % 3 ? 0 : FS_WRITE_COMPRESS);
+    }
+    fs_snapshot(sb, "s");
+    fs_delete_file(sb, "/a/b/f0");
+    fs_close(sb);
+
+    sb = fs_open_flags("preload.img", FS_OPEN_SHARED | FS_OPEN_PRELOAD);
+    if (sb == NULL) {
+        printf("FAIL preload\n");
+        unlink("preload.img");
+        free(data);
+        free(buf);
+        return;
+    }
+    fs_reset_stats(sb);
+    ents = fs_list_dir_plus(sb, "/a/b", &count);
+    if (ents == NULL || count != nfiles - 1) {
+        printf("FAIL list preloaded directory\n");
+    }
+    fs_free_dirents(ents, count);
+    if (fs_list_dir_plus(sb, "/a/b/f3", &count) != NULL || errno != ENOTDIR ||
+            fs_list_dir_plus(sb, "/a/b/f3/x", &count) != NULL ||
+            errno != ENOTDIR ||
+            fs_read_file(sb, "/a/b/f0", buf, len) != -1 || errno != ENOENT) {
+        printf("FAIL preloaded errors\n");
+    }
+    for (i = 1; i < nfiles; i++) {
+        sprintf(path, "/a/b/f%d", (int) i);
+        if (fs_read_file(sb, path, buf, len) != len - i ||
+                memcmp(buf, data, len - i)) {
+            printf("FAIL read %s preloaded\n", path);
+        }
+    }
+    fs_get_stats(sb, &st);
+    if (st.reads[FS_BLK_META] != 0 || st.reads[FS_BLK_DATA] == 0) {
+        printf("FAIL preloaded reads %d metadata blocks\n",
+                (int) st.reads[FS_BLK_META]);
+    }
+    /* a view has another root and reads from disk */
+    view = fs_snapshot_open(sb, "s");
+    if (view == NULL || fs_read_file(view, "/a/b/f0", buf, len) != len ||
+            memcmp(buf, data, len)) {
+        printf("FAIL read snapshot of preloaded image\n");
+    }
+    if (view) fs_close(view);
+    fs_close(sb);
+
+    sb = fs_open_flags("preload.img", FS_OPEN_PRELOAD);
+    if (fs_mkdir(sb, "/a") != -1 || errno != EEXIST || sb->state->ns == NULL) {
+        printf("FAIL failed mkdir dropped the preloaded namespace\n");
+    }
+    fs_write_file(sb, "/a/b/f0", data, 5);
+    if (sb->state->ns != NULL) printf("FAIL write kept the namespace\n");
+    names = fs_list_dir(sb, "/a/b");
+    if (fs_read_file(sb, "/a/b/f0", buf, len) != 5 || names == NULL ||
+            strstr(names, "f0 ") == NULL) {
+        printf("FAIL change after preload\n");
+    }
+    free(names);
+    fs_close(sb);
+    unlink("preload.img");
+    free(data);
+    free(buf);
+}
+
+/* moving an entry out of and back into a directory reads as many blocks in
+ * a big directory as in a small one, and churn keeps it consistent */
+void fs_dir_churn_test(uint64_t fsize, uint64_t blksz) {
+    struct fs_fsck_report frep;
+    struct fs_stats st;
+    struct fs_dirent *ents;
+    struct blocklist freed;
+    struct superblock *sb;
+    uint64_t reads[2], dir, child;
+    size_t count;
+    int i, k, n[2], found, expect, ok = TRUE;
+    char path[32], *dirs[] = {"/s", "/l"};
+
+    makeImage("churn.img", fsize);
+
+    sb = fs_format("churn.img", blksz);
+    /* both end with three links in their last block */
+    n[0] = getLinksMaxLen(sb) + 2;
+    n[1] = 6 * getLinksMaxLen(sb) + 2;
+    FOR_EACH(k, 2) {
+        fs_mkdir(sb, dirs[k]);
+        FOR_EACH(i, n[k]) {
+            sprintf(path, "%s/f%d", dirs[k], i);
+            fs_write_file(sb, path, "x", 1);
+        }
+        sprintf(path, "%s/f%d", dirs[k], n[k] - 4); //in the next to last block
+        child = findFile(sb, path, &found);
+        dir = findFile(sb, dirs[k], &found);
+        initBlockList(&freed);
+        fs_reset_stats(sb);
+        removeFromDir(sb, dir, child, &freed);
+        insertInBlock(sb, dir, child, NULL);
+        fs_get_stats(sb, &st);
+        reads[k] = st.reads[FS_BLK_META];
+        freeBlockList(&freed);
+    }
+    if (reads[1] != reads[0]) {
+        printf("FAIL remove and insert read %d blocks, %d in a small dir\n",
+                (int) reads[1], (int) reads[0]);
+    }
+
+    for (i = 0; i < n[1]; i += 3) {
+        sprintf(path, "/l/f%d", i);
+        if (fs_delete_file(sb, path) != 0) ok = FALSE;
+    }
+    FOR_EACH(i, n[1] / 3) {
+        sprintf(path, "/l/g%d", i);
+        if (fs_write_file(sb, path, "y", 1) != 0) ok = FALSE;
+    }
+    if (fs_rename(sb, "/l/f1", "/s/h") != 0 ||
+            fs_rename(sb, "/l/f2", "/l/f4") != 0) {
+        ok = FALSE;
+    }
+    fs_close(sb);
+
+    sb = fs_open("churn.img");
+    expect = n[1] - (n[1] + 2) / 3 + n[1] / 3 - 2;
+    ents = fs_list_dir_plus(sb, "/l", &count);
+    if (ents == NULL || count != expect) ok = FALSE;
+    fs_free_dirents(ents, count);
+    for (i = 3; i < n[1]; i++) {
+        sprintf(path, "/l/f%d", i);
+        if (existsFile(sb, path) != (i % 3 != 0)) ok = FALSE;
+    }
+    if (!ok) printf("FAIL directory churn\n");
+    if (fs_fsck(sb, 0, 4, NULL, &frep) != 0 || frep.leaked || frep.bad_free) {
+        printf("FAIL fsck after directory churn\n");
+    }
+    /* emptying it leaves no link block behind */
+    ents = fs_list_dir_plus(sb, "/l", &count);
+    FOR_EACH(i, count) {
+        sprintf(path, "/l/%s", ents[i].name);
+        fs_delete_file(sb, path);
+    }
+    fs_free_dirents(ents, count);
+    if (fs_rmdir(sb, "/l") != 0 ||
+            fs_fsck(sb, 0, 4, NULL, &frep) != 0 || frep.leaked) {
+        printf("FAIL empty churned directory\n");
+    }
+    fs_close(sb);
+    unlink("churn.img");
+}
+
+/* a sparse multi-terabyte image: formatting must not touch every block, and
+ * blocks near its end, terabytes in, must survive the whole path */
+void fs_large_test(void) {
+    uint64_t blksz = 4096, fsize = (2ull << 40) + 5 * blksz, run, i;
+    size_t len = 300 * blksz;
+    char *data = malloc(len), *buf = malloc(len);
+    struct inode *node = malloc(blksz);
+    int found;
+
+    unlink("large.img");
+    FILE *fd = fopen("large.img", "w");
+    fclose(fd);
+    if (truncate("large.img", fsize) != 0) {
+        perror("large.img");
+        unlink("large.img");
+        return;
+    }
+    for (i = 0; i < len; i++) data[i] = i % 251 + 1;
+
+    struct superblock *sb = fs_format("large.img", blksz);
+    if (sb == NULL || sb->blks != fsize / blksz ||
+            sb->freeblks != sb->blks - 3) {
+        printf("FAIL format large image\n");
+        if (sb) fs_close(sb);
+        unlink("large.img");
+        return;
+    }
+    fs_write_file(sb, "/near", data, len);
+    /* the allocator hands out all but the last thousand blocks in one run */
+    run = takeFreeRun(sb, sb->blks - sb->tail - 1000);
+    if (run == 0 || sb->blks - sb->tail < 1000) {
+        printf("FAIL take a terabyte run\n");
+    }
+    /* what /near left in its extents is used up first */
+    fs_mkdir(sb, "/far");
+    if (fs_write_file(sb, "/far/away", data, len) != 0) {
+        printf("FAIL write at the end of a large image\n");
+    }
+    seek_read(sb, findFile(sb, "/far/away", &found), node);
+    if (node->links[len / blksz - 1] < sb->blks - 1000) {
+        printf("FAIL large image did not allocate at its end\n");
+    }
+    fs_close(sb);
+
+    sb = fs_open("large.img");
+    if (sb == NULL || sb->blks != fsize / blksz) {
+        printf("FAIL reopen large image\n");
+    } else {
+        if (fs_read_file(sb, "/far/away", buf, len) != len ||
+                memcmp(buf, data, len) != 0) {
+            printf("FAIL read from the end of a large image\n");
+        }
+        if (fs_read_file(sb, "/near", buf, len) != len ||
+                memcmp(buf, data, len) != 0) {
+            printf("FAIL read from the start of a large image\n");
+        }
+        fs_close(sb);
+    }
+    unlink("large.img");
+    free(data);
+    free(buf);
+    free(node);
+}
+
+/* a write that does not fit, its inodes and names included, is refused
+ * and leaves the image as it was */
+void fs_full_test(uint64_t fsize, uint64_t blksz) {
+    struct fs_fsck_report frep;
+    struct superblock *sb;
+    uint64_t i, free0, tries = 0;
+    size_t len;
+    char *data = malloc(fsize), *buf = malloc(fsize), path[16];
+
+    makeImage("full.img", fsize);
+    memset(data, 'x', fsize);
+
+    sb = fs_format("full.img", blksz);
+    for (i = 0; sb->freeblks > 40; i++) {
+        sprintf(path, "/f%d", (int) i);
+        len = MIN(sb->freeblks - 40, 64) * blksz;
+        fs_write_file(sb, path, data, len);
+    }
+    free0 = sb->freeblks;
+    /* as many data blocks as are free do not fit; shrink until one does */
+    for (len = free0 * blksz; len > 0; len -= blksz, tries++) {
+        if (fs_write_file(sb, "/big", data, len) == 0) break;
+        if (errno != ENOSPC || sb->freeblks != free0 ||
+                existsFile(sb, "/big")) {
+            printf("FAIL refused write left traces\n");
+            break;
+        }
+    }
+    if (tries == 0 || len == 0) printf("FAIL write on a full image\n");
+    if (fs_read_file(sb, "/big", buf, len) != len ||
+            memcmp(buf, data, len) != 0) {
+        printf("FAIL read after filling\n");
+    }
+    if (fs_fsck(sb, 0, 4, NULL, &frep) != 0 || frep.leaked || frep.bad_ptr) {
+        printf("FAIL fsck on a full image\n");
+    }
+    fs_close(sb);
+    unlink("full.img");
+    free(data);
+    free(buf);
+}
+
+/* writes =len bytes of =data to the host file =path */
+static void writeHostFile(const char *path, const char *data, size_t len) {
+    FILE *fd = fopen(path, "w");
+    fwrite(data, 1, len, fd);
+    fclose(fd);
+}
+
+/* fscopy.exe: a host tree imported into an image and exported back comes
+ * out unchanged, empty and all-zero files included */
+void fs_copy_test(uint64_t fsize, uint64_t blksz) {
+    struct fs_fsck_report frep;
+    struct superblock *sb;
+    size_t i, len = 100 << 10;
+    char *data = malloc(len), *buf = malloc(len), path[64];
+    uint32_t x = 7;
+
+    for (i = 0; i < len; i++) {
+        x = x * 1103515245 + 12345;
+        data[i] = i < len / 2 ? "copy tool "[i % 10] : x >> 16;
+    }
+    system("rm -rf copyin copyout");
+    mkdir("copyin", 0755);
+    mkdir("copyin/a", 0755);
+    mkdir("copyin/a/b", 0755);
+    mkdir("copyin/empty", 0755);
+    writeHostFile("copyin/a/none", data, 0);
+    memset(buf, 0, len);
+    writeHostFile("copyin/a/zero", buf, 3 * blksz + 7);
+    writeHostFile("copyin/a/b/big", data, len);
+    /* more small files than one batch holds */
+    for (i = 0; i < 70; i++) {
+        sprintf(path, "copyin/a/b/s%d", (int) i);
+        writeHostFile(path, data + i, i + 1);
+    }
+    makeImage("copy.img", fsize);
+    sb = fs_format("copy.img", blksz);
+    fs_close(sb);
+
+    if (system("./fscopy.exe -c -j 3 copy.img copyin > /dev/null") != 0) {
+        printf("FAIL fscopy import\n");
+    }
+    sb = fs_open("copy.img");
+    if (fs_read_file(sb, "/a/zero", buf, len) != 3 * blksz + 7 ||
+            fs_read_file(sb, "/a/b/big", buf, len) != len ||
+            memcmp(buf, data, len) != 0) {
+        printf("FAIL read imported files\n");
+    }
+    if (fs_fsck(sb, 0, 2, NULL, &frep) != 0 || frep.leaked || frep.bad_size ||
+            frep.files != 73 || frep.dirs != 4) {
+        printf("FAIL fsck after import\n");
+    }
+    fs_close(sb);
+    if (system("./fscopy.exe -x -j 2 copy.img copyout > /dev/null") != 0 ||
+            system("diff -r copyin copyout > /dev/null") != 0) {
+        printf("FAIL fscopy roundtrip\n");
+    }
+    system("rm -rf copyin copyout");
+    unlink("copy.img");
+    free(data);
+    free(buf);
+}
+
+/* an image laid out by the original fs_format: a six-field superblock
+ * followed by its in-memory descriptor, and a free list covering every
+ * block after the root directory */
+void fs_legacy_test(uint64_t fsize, uint64_t blksz) {
+    struct {
+        uint64_t magic, blks, blksz, freeblks, freelist, root;
+        int fd;
+    } old = {0xdcc605f5, fsize / blksz, blksz, fsize / blksz - 4, 3, 1, 3};
+    struct fs_fsck_report rep;
+    struct freepage *fp = calloc(1, blksz);
+    struct nodeinfo *info = calloc(1, blksz);
+    struct inode *root = calloc(1, blksz);
+    char *buf = calloc(1, blksz), *big, path[16];
+    uint64_t b;
+    int fd, i;
+
+    makeImage("legacy.img", fsize);
+    fd = open("legacy.img", O_RDWR);
+    memcpy(buf, &old, sizeof (old));
+    pwrite(fd, buf, blksz, 0);
+    root->mode = IMDIR;
+    root->parent = 1;
+    root->meta = 2;
+    pwrite(fd, root, blksz, blksz);
+    strcpy(info->name, "/");
+    pwrite(fd, info, blksz, 2 * blksz);
+    for (b = 3; b < old.blks; b++) {
+        fp->next = b + 1 < old.blks ? b + 1 : 0;
+        fp->count = b > 3;
+        fp->links[0] = b - 1;
+        pwrite(fd, fp, blksz, b * blksz);
+    }
+    close(fd);
+
+    struct superblock *sb = fs_open("legacy.img");
+    if (sb == NULL || sb->tail != sb->blks || sb->refmap != 0 ||
+            sb->snapshots != 0) {
+        printf("FAIL open a legacy image\n");
+        if (sb) fs_close(sb);
+        goto out;
+    }
+    /* the original format counted one block fewer than it freed */
+    if (fs_fsck(sb, 0, 2, NULL, &rep) != 0 || rep.leaked || rep.doubled ||
+            rep.bad_ptr) {
+        printf("FAIL fsck of a legacy image\n");
+    }
+    /* once the free list runs out nothing is left to allocate.  large
+     * files take most of it so the fill needs few writes. */
+    memset(buf, 'l', blksz);
+    fs_write_file(sb, "/l0", buf, blksz);
+    big = malloc(32 * blksz);
+    memset(big, 'b', 32 * blksz);
+    for (i = 0; ; i++) {
+        sprintf(path, "/b%d", i);
+        if (fs_write_file(sb, path, big, 32 * blksz) != 0) break;
+    }
+    free(big);
+    for (i = 1; ; i++) {
+        sprintf(path, "/l%d", i);
+        if (fs_write_file(sb, path, buf, blksz) != 0) break;
+    }
+    if (errno != ENOSPC || !existsFile(sb, "/l0") ||
+            fs_read_file(sb, "/l0", buf, blksz) != blksz || buf[0] != 'l') {
+        printf("FAIL fill a legacy image\n");
+    }
+    fs_close(sb);
+    sb = fs_open("legacy.img");
+    if (sb == NULL || !(sb->features & FS_FEAT_TAIL) || sb->refmap != 0 ||
+            fs_read_file(sb, "/l0", buf, blksz) != blksz) {
+        printf("FAIL reopen a legacy image\n");
+    }
+    /* deleting frees the blocks instead of consulting a reference table */
+    if (sb && (fs_delete_file(sb, "/l0") != 0 ||
+            fs_fsck(sb, 0, 2, NULL, &rep) != 0 || rep.leaked ||
+            rep.doubled || rep.bad_ptr)) {
+        printf("FAIL delete from a legacy image\n");
+    }
+    if (sb) fs_close(sb);
+out:
+    unlink("legacy.img");
+    free(fp);
+    free(info);
+    free(root);
+    free(buf);
+}
+
 void fs_free_check(struct superblock **sb, uint64_t fsize, uint64_t blksz) {
     long long numblocks = fsize / blksz - (*sb)->freeblks;
     unsigned long long freeblks = (*sb)->freeblks;
@@ -274,4 +1942,15 @@ void fs_check(const struct superblock *sb, uint64_t fsize, uint64_t blksz) {
 
     free(info);
     free(inode);
-}
\ No newline at end of file
+}
+
+/* a fresh image of =size zero bytes at =name */
+void makeImage(const char *name, uint64_t size) {
+    char *buf = calloc(1, size);
+
+    unlink(name);
+    FILE *fd = fopen(name, "w");
+    fwrite(buf, 1, size, fd);
+    fclose(fd);
+    free(buf);
+}
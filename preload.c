@@ -0,0 +1,398 @@
+/*
+ * File:   preload.c
+ *
+ * In-memory namespace for FS_OPEN_PRELOAD.  The tree is read at open a
+ * level at a time: the inodes, names and continuation inodes a level needs
+ * are sorted and read in ascending block order, adjacent blocks with one
+ * call, so the pass streams through the metadata extents (see getBlock)
+ * instead of seeking.  What it finds is kept in flat arrays indexed by
+ * entity, with the names in one pool and the children of directories and
+ * the data block maps of files in two shared link arrays, plus hash tables
+ * from inode block and from (parent, name) to entity.  Path lookups,
+ * directory listings and reading a file's block map then need no I/O.
+ * The first metadata write of a call that changes the filesystem drops it
+ * (see metaWritten).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "fs.h"
+#include "utils.h"
+
+/* entities whose inodes are read together */
+#define PRELOAD_BATCH 4096
+/* longest run of adjacent blocks read with one call */
+#define PRELOAD_RUN 64
+
+struct fs_ns {
+    uint64_t root; /* head inode of the root it was built from */
+    size_t n, cap;
+    uint64_t* block; /* head inode of each entity */
+    uint64_t* size; /* nodeinfo size */
+    uint64_t* flags; /* nodeinfo reserved[0] and [1], see FS_FILE_LZ4 */
+    uint64_t* stored;
+    uint64_t* first; /* children in =kids, or data blocks in =map */
+    uint32_t* count;
+    uint32_t* parent;
+    uint32_t* name; /* offset in =names */
+    uint8_t* mode;
+    char* names;
+    size_t namesLen, namesCap;
+    uint32_t* kids;
+    size_t nkids, capkids;
+    uint64_t* map;
+    size_t nmap, capmap;
+    /* open addressing, entity + 1 in each slot, zero for none */
+    uint32_t* byBlock, *byName;
+    size_t hashMask;
+};
+
+/* makes room for one more element in the array at =*p of =*cap elements */
+static void grow(void* p, size_t n, size_t* cap, size_t elsz) {
+    if (n < *cap) return;
+    *cap = *cap ? *cap * 2 : 256;
+    *(void**) p = realloc(*(void**) p, *cap * elsz);
+}
+
+static uint32_t addEntity(struct fs_ns* ns, uint64_t block, uint32_t parent) {
+    if (ns->n == ns->cap) {
+        size_t cap = ns->cap;
+        grow(&ns->block, ns->n, &cap, sizeof (uint64_t));
+        ns->size = realloc(ns->size, cap * sizeof (uint64_t));
+        ns->flags = realloc(ns->flags, cap * sizeof (uint64_t));
+        ns->stored = realloc(ns->stored, cap * sizeof (uint64_t));
+        ns->first = realloc(ns->first, cap * sizeof (uint64_t));
+        ns->count = realloc(ns->count, cap * sizeof (uint32_t));
+        ns->parent = realloc(ns->parent, cap * sizeof (uint32_t));
+        ns->name = realloc(ns->name, cap * sizeof (uint32_t));
+        ns->mode = realloc(ns->mode, cap);
+        ns->cap = cap;
+    }
+    ns->block[ns->n] = block;
+    ns->parent[ns->n] = parent;
+    ns->count[ns->n] = 0;
+    return ns->n++;
+}
+
+static uint64_t hashName(uint32_t parent, const char* name) {
+    uint64_t h = 1469598103934665603ull ^ parent;
+    for (; *name; name++) h = (h ^ (uint8_t) * name) * 1099511628211ull;
+    return h;
+}
+
+static uint64_t hashBlock(uint64_t block) {
+    return block * 0x9e3779b97f4a7c15ull >> 17;
+}
+
+static void buildHashes(struct fs_ns* ns) {
+    size_t cap = 16, i, h;
+    while (cap < 2 * ns->n) cap *= 2;
+    ns->hashMask = cap - 1;
+    ns->byBlock = calloc(cap, sizeof (uint32_t));
+    ns->byName = calloc(cap, sizeof (uint32_t));
+    FOR_EACH(i, ns->n) {
+        for (h = hashBlock(ns->block[i]); ns->byBlock[h & ns->hashMask]; h++);
+        ns->byBlock[h & ns->hashMask] = i + 1;
+        if (i == 0) continue; //the root is nobody's child
+        h = hashName(ns->parent[i], ns->names + ns->name[i]);
+        for (; ns->byName[h & ns->hashMask]; h++);
+        ns->byName[h & ns->hashMask] = i + 1;
+    }
+}
+
+struct sortedBlock {
+    uint64_t block;
+    size_t i;
+};
+
+static int cmpSorted(const void* a, const void* b) {
+    uint64_t x = ((const struct sortedBlock*) a)->block;
+    uint64_t y = ((const struct sortedBlock*) b)->block;
+    return (x > y) - (x < y);
+}
+
+/* reads the =n metadata blocks in =blocks into =buf, in that order, going
+ * through them in ascending block order */
+static void readSorted(const struct superblock* sb, const uint64_t* blocks,
+        size_t n, char* buf) {
+    struct sortedBlock* s = malloc(n * sizeof (struct sortedBlock));
+    char* run = malloc(PRELOAD_RUN * sb->blksz);
+    size_t i, k, len;
+
+    FOR_EACH(i, n) {
+        s[i].block = blocks[i];
+        s[i].i = i;
+    }
+    qsort(s, n, sizeof (struct sortedBlock), cmpSorted);
+    for (i = 0; i < n; i += len) {
+        for (len = 1; i + len < n && len < PRELOAD_RUN &&
+                s[i + len].block == s[i].block + len; len++);
+        seek_read_blocks(sb, s[i].block, len, run, FS_BLK_META);
+        FOR_EACH(k, len) {
+            memcpy(buf + s[i + k].i * sb->blksz, run + k * sb->blksz,
+                    sb->blksz);
+        }
+    }
+    free(run);
+    free(s);
+}
+
+/* true if every link up to the first zero is a block of the image */
+static int linksValid(const struct superblock* sb, const struct inode* node,
+        int isFile) {
+    int i, maxLinks = getLinksMaxLen(sb);
+    for (i = 0; i < maxLinks && node->links[i] != 0; i++) {
+        if (node->links[i] >= sb->blks &&
+                !(isFile && node->links[i] == FS_HOLE)) {
+            return FALSE;
+        }
+    }
+    return node->next < sb->blks;
+}
+
+/* reads the inodes and names of the =n entities at =ents, queueing the
+ * children of the directories among them on =next */
+static int loadBatch(const struct superblock* sb, struct fs_ns* ns,
+        const uint32_t* ents, size_t n, struct blocklist* next) {
+    char* inodes = malloc(n * sb->blksz), *metas = malloc(n * sb->blksz);
+    uint64_t* blocks = malloc(n * sizeof (uint64_t));
+    struct blocklist* links = malloc(n * sizeof (struct blocklist));
+    size_t i, k, pending;
+    int j, maxLinks = getLinksMaxLen(sb), ret = 0;
+
+    FOR_EACH(i, n) {
+        blocks[i] = ns->block[ents[i]];
+        initBlockList(&links[i]);
+    }
+    readSorted(sb, blocks, n, inodes);
+    FOR_EACH(i, n) {
+        struct inode* node = (struct inode*) (inodes + i * sb->blksz);
+        blocks[i] = node->meta < sb->blks ? node->meta : 0;
+    }
+    readSorted(sb, blocks, n, metas);
+
+    FOR_EACH(i, n) {
+        uint32_t e = ents[i];
+        struct inode* node = (struct inode*) (inodes + i * sb->blksz);
+        struct nodeinfo* info = (struct nodeinfo*) (metas + i * sb->blksz);
+        size_t len = strnlen(info->name, getFileNameMaxLen(sb)) + 1;
+
+        ns->mode[e] = node->mode;
+        ns->size[e] = info->size;
+        ns->flags[e] = info->reserved[0];
+        ns->stored[e] = info->reserved[1];
+        while (ns->namesCap < ns->namesLen + len) {
+            grow(&ns->names, ns->namesCap, &ns->namesCap, 1);
+        }
+        memcpy(ns->names + ns->namesLen, info->name, len - 1);
+        ns->names[ns->namesLen + len - 1] = '\0';
+        ns->name[e] = ns->namesLen;
+        ns->namesLen += len;
+    }
+
+    /* the links, following the chains of continuation inodes a round at
+     * a time */
+    for (;;) {
+        pending = 0;
+        FOR_EACH(i, n) {
+            struct inode* node = (struct inode*) (inodes + i * sb->blksz);
+            if (node->mode == 0) continue;
+            if (!linksValid(sb, node, (ns->mode[ents[i]] & IMREG) != 0)) {
+                ret = -1;
+                node->mode = 0;
+                continue;
+            }
+            for (j = 0; j < maxLinks && node->links[j] != 0; j++) {
+                pushBlock(&links[i], node->links[j]);
+            }
+            blocks[i] = node->next;
+            if (node->next != 0) pending++;
+        }
+        if (pending == 0) break;
+        k = 0;
+        FOR_EACH(i, n) {
+            struct inode* node = (struct inode*) (inodes + i * sb->blksz);
+            if (node->mode != 0 && node->next != 0) blocks[k++] = blocks[i];
+        }
+        readSorted(sb, blocks, k, metas);
+        k = 0;
+        FOR_EACH(i, n) {
+            struct inode* node = (struct inode*) (inodes + i * sb->blksz);
+            if (node->mode == 0 || node->next == 0) {
+                node->mode = 0;
+            } else {
+                memcpy(node, metas + k++ * sb->blksz, sb->blksz);
+                if (node->mode == 0) node->mode = IMCHILD;
+            }
+        }
+    }
+
+    FOR_EACH(i, n) {
+        uint32_t e = ents[i];
+        if (ns->mode[e] == IMDIR) {
+            ns->first[e] = ns->nkids;
+            FOR_EACH(k, links[i].n) {
+                if (ns->n >= sb->blks) {
+                    ret = -1; //a directory cycle
+                    break;
+                }
+                grow(&ns->kids, ns->nkids, &ns->capkids, sizeof (uint32_t));
+                ns->kids[ns->nkids] = addEntity(ns, links[i].v[k], e);
+                pushBlock(next, ns->kids[ns->nkids++]);
+                ns->count[e]++;
+            }
+        } else {
+            ns->first[e] = ns->nmap;
+            FOR_EACH(k, links[i].n) {
+                grow(&ns->map, ns->nmap, &ns->capmap, sizeof (uint64_t));
+                ns->map[ns->nmap++] = links[i].v[k];
+            }
+            ns->count[e] = links[i].n;
+        }
+        freeBlockList(&links[i]);
+    }
+    free(links);
+    free(blocks);
+    free(metas);
+    free(inodes);
+    return ret;
+}
+
+/**
+ * Builds the namespace of =sb (see FS_OPEN_PRELOAD).
+ * @return zero, or -1 with errno set to EIO if a block could not be read
+ * or the tree does not hold together
+ */
+int preloadTree(struct superblock* sb) {
+    struct fs_ns* ns = calloc(1, sizeof (struct fs_ns));
+    struct blocklist level, next;
+    uint32_t* ents = malloc(PRELOAD_BATCH * sizeof (uint32_t));
+    uint64_t t0 = opBegin(sb, FS_OP_PRELOAD);
+    size_t i, k, n;
+    int ret = 0;
+
+    ns->root = sb->root;
+    initBlockList(&level);
+    pushBlock(&level, addEntity(ns, sb->root, 0));
+    while (level.n > 0 && ret == 0) {
+        initBlockList(&next);
+        for (i = 0; i < level.n && ret == 0; i += n) {
+            n = MIN(level.n - i, PRELOAD_BATCH);
+            FOR_EACH(k, n) ents[k] = level.v[i + k];
+            ret = loadBatch(sb, ns, ents, n, &next);
+        }
+        freeBlockList(&level);
+        level = next;
+    }
+    freeBlockList(&level);
+    free(ents);
+    if (ret == 0 && !opFailed()) buildHashes(ns);
+    opEnd(sb, FS_OP_PRELOAD, t0);
+    if (ret != 0 || opFailed()) {
+        sb->state->ns = ns;
+        freeNamespace(sb->state);
+        errno = EIO;
+        return -1;
+    }
+    sb->state->ns = ns;
+    return 0;
+}
+
+void freeNamespace(struct fs_state* state) {
+    struct fs_ns* ns = state->ns;
+    if (ns == NULL) return;
+    state->ns = NULL;
+    free(ns->block);
+    free(ns->size);
+    free(ns->flags);
+    free(ns->stored);
+    free(ns->first);
+    free(ns->count);
+    free(ns->parent);
+    free(ns->name);
+    free(ns->mode);
+    free(ns->names);
+    free(ns->kids);
+    free(ns->map);
+    free(ns->byBlock);
+    free(ns->byName);
+    free(ns);
+}
+
+/* the namespace of =sb, if it was preloaded from the root =sb has */
+const struct fs_ns* nsOf(const struct superblock* sb) {
+    const struct fs_ns* ns = sb->state->ns;
+    return ns != NULL && ns->root == sb->root ? ns : NULL;
+}
+
+/* entity with head inode =block, or -1 */
+static long nsEntity(const struct fs_ns* ns, const uint64_t block) {
+    size_t h;
+    uint32_t e;
+    for (h = hashBlock(block); (e = ns->byBlock[h & ns->hashMask]); h++) {
+        if (ns->block[e - 1] == block) return e - 1;
+    }
+    return -1;
+}
+
+/* like findInDir */
+uint64_t nsLookup(const struct fs_ns* ns, const uint64_t dirBlock,
+        const char* name) {
+    long dir = nsEntity(ns, dirBlock);
+    size_t h;
+    uint32_t e;
+
+    if (dir < 0) return 0;
+    for (h = hashName(dir, name); (e = ns->byName[h & ns->hashMask]); h++) {
+        if (ns->parent[e - 1] == dir &&
+                strcmp(ns->names + ns->name[e - 1], name) == 0) {
+            return ns->block[e - 1];
+        }
+    }
+    return 0;
+}
+
+/* mode of the entity with head inode =block, or zero */
+uint64_t nsMode(const struct fs_ns* ns, const uint64_t block) {
+    long e = nsEntity(ns, block);
+    return e < 0 ? 0 : ns->mode[e];
+}
+
+/* like getDirEntries */
+struct fs_dirent* nsEntries(const struct fs_ns* ns, const uint64_t dirBlock,
+        size_t* count) {
+    long dir = nsEntity(ns, dirBlock);
+    struct fs_dirent* ents;
+    size_t i, n = dir < 0 ? 0 : ns->count[dir];
+
+    ents = malloc(MAX(n, 1) * sizeof (struct fs_dirent));
+    FOR_EACH(i, n) {
+        uint32_t e = ns->kids[ns->first[dir] + i];
+        ents[i].block = ns->block[e];
+        ents[i].mode = ns->mode[e];
+        ents[i].size = ns->size[e];
+        ents[i].name = strdup(ns->names + ns->name[e]);
+    }
+    *count = n;
+    return ents;
+}
+
+/**
+ * The nodeinfo fields and data block map of the file with head inode
+ * =block; =*map points into the namespace.
+ * @return zero, or -1 if there is no such entity
+ */
+int nsFile(const struct fs_ns* ns, const uint64_t block, uint64_t* size,
+        uint64_t* flags, uint64_t* stored, const uint64_t** map,
+        uint64_t* nmap) {
+    long e = nsEntity(ns, block);
+    if (e < 0) return -1;
+    *size = ns->size[e];
+    *flags = ns->flags[e];
+    *stored = ns->stored[e];
+    *map = ns->map + ns->first[e];
+    *nmap = ns->count[e];
+    return 0;
+}
@@ -0,0 +1,382 @@
+/*
+ * File:   snapshot.c
+ *
+ * Copy-on-write snapshots.  A snapshot is a copy of the root directory's
+ * inode chain whose links point at the same entries as the live root.
+ * Sharing is tracked by a reference count table with one byte per block
+ * holding the number of *extra* references to the block, so zero means
+ * "owned by a single directory (or file)" and blocks never shared need no
+ * bookkeeping.  Counts are kept for first inodes (shared between
+ * directories) and data blocks (shared between copies of a file); a first
+ * inode's nodeinfo, continuation inodes and link blocks always belong to
+ * that single inode.
+ *
+ * Before the live tree modifies an entity, every shared entity on the path
+ * to it is copied (see unsharePath) and the copy's children gain a
+ * reference, so snapshots keep seeing the old blocks.  The =parent pointer
+ * of a shared inode points at one of the directories that reference it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "fs.h"
+#include "utils.h"
+#include "StringProc.h"
+
+#define MAX_REFS 255
+#define SNAPSHOTS_NAME ".snapshots"
+
+/* counts held by one block of the table, which may end with a checksum */
+uint64_t getRefsPerBlock(const struct superblock *sb) {
+    return sb->blksz - getCsumLen(sb);
+}
+
+static uint8_t *refBlock(const struct superblock *sb, const uint64_t block,
+        uint64_t *tblock) {
+    uint8_t *buf = malloc(sb->blksz);
+    *tblock = sb->refmap + block / getRefsPerBlock(sb);
+    seek_read(sb, *tblock, buf);
+    return buf;
+}
+
+int getRefs(const struct superblock *sb, const uint64_t block) {
+    uint64_t tblock;
+    uint8_t *buf;
+    int refs;
+
+    if (sb->refmap == 0) return 0;
+    buf = refBlock(sb, block, &tblock);
+    refs = buf[block % getRefsPerBlock(sb)];
+    free(buf);
+    return refs;
+}
+
+/* fails with EMLINK, leaving the count as it is, past MAX_REFS */
+static int addRefs(const struct superblock *sb, const uint64_t block,
+        const int delta) {
+    uint64_t tblock;
+    uint8_t *buf = refBlock(sb, block, &tblock);
+    uint8_t *ref = buf + block % getRefsPerBlock(sb);
+    if (*ref + delta > MAX_REFS) {
+        free(buf);
+        errno = EMLINK;
+        return -1;
+    }
+    *ref += delta;
+    seek_write(sb, tblock, buf);
+    free(buf);
+    return 0;
+}
+
+int incRef(const struct superblock *sb, const uint64_t block) {
+    return addRefs(sb, block, 1);
+}
+
+int decRef(const struct superblock *sb, const uint64_t block) {
+    if (getRefs(sb, block) == 0) return FALSE;
+    addRefs(sb, block, -1);
+    return TRUE;
+}
+
+static int createRefmap(struct superblock *sb) {
+    uint64_t i, per = getRefsPerBlock(sb), n = (sb->blks + per - 1) / per;
+    char *zero = malloc(sb->blksz);
+    uint64_t start = takeFreeRun(sb, n);
+
+    if (start == 0) {
+        free(zero);
+        errno = ENOSPC;
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        memset(zero, 0, sb->blksz);
+        seek_write(sb, start + i, zero);
+    }
+    free(zero);
+    sb->refmap = start;
+    writeSuper(sb);
+    return 0;
+}
+
+/* number of blocks copyEntity needs to duplicate =block */
+static uint64_t entityInodes(const struct superblock *sb, uint64_t block) {
+    struct inode *node = malloc(sb->blksz);
+    uint64_t n = 1; //nodeinfo
+    while (block != 0) {
+        seek_read(sb, block, node);
+        block = node->next;
+        n++;
+    }
+    free(node);
+    return n;
+}
+
+/**
+ * Duplicates the inode chain and nodeinfo of the entity at =block.  The
+ * copy references the same children (directories) or data blocks (files),
+ * which gain one reference each.  If one of them cannot, the references
+ * already added and the blocks taken are given back.
+ * @param sb the superblock
+ * @param block first inode of the entity
+ * @param parent directory that will contain the copy
+ * @return first inode of the copy, or zero with errno set to ENOSPC if
+ * there is not enough space or EMLINK if a child is referenced too often
+ */
+static uint64_t copyEntity(struct superblock *sb, const uint64_t block,
+        const uint64_t parent) {
+    struct inode *node = malloc(sb->blksz);
+    struct nodeinfo *meta = malloc(sb->blksz);
+    struct blocklist taken, refs;
+    uint64_t cur = block, head, prev = 0, dst;
+    size_t k;
+    int i, maxLinks = getLinksMaxLen(sb);
+
+    if (entityInodes(sb, block) > sb->freeblks) {
+        free(node);
+        free(meta);
+        errno = ENOSPC;
+        return 0;
+    }
+    initBlockList(&taken);
+    initBlockList(&refs);
+    head = dst = getBlock(sb, FS_BLK_META);
+    pushBlock(&taken, head);
+    while (cur != 0) {
+        seek_read(sb, cur, node);
+        if (prev == 0) {
+            seek_read(sb, node->meta, meta);
+            node->meta = getBlock(sb, FS_BLK_META);
+            pushBlock(&taken, node->meta);
+            node->parent = parent;
+            seek_write(sb, node->meta, meta);
+        } else {
+            node->meta = prev;
+            node->parent = head;
+        }
+        for (i = 0; i < maxLinks && node->links[i] != 0; i++) {
+            if (node->links[i] == FS_HOLE) continue;
+            if (incRef(sb, node->links[i]) != 0) goto undo;
+            pushBlock(&refs, node->links[i]);
+        }
+        cur = node->next;
+        if (cur != 0) {
+            node->next = getBlock(sb, FS_BLK_META);
+            pushBlock(&taken, node->next);
+        }
+        seek_write(sb, dst, node);
+        prev = dst;
+        dst = node->next;
+    }
+    goto out;
+
+undo:
+    FOR_EACH(k, refs.n) decRef(sb, refs.v[k]);
+    putBlocks(sb, taken.v, taken.n);
+    head = 0;
+out:
+    freeBlockList(&taken);
+    freeBlockList(&refs);
+    free(node);
+    free(meta);
+    return head;
+}
+
+/* Gives the directory =dir its own copy of its entry =child if the entry is
+ * shared.  Returns the (possibly new) block of the entry, or zero with errno
+ * set if it cannot be copied (see copyEntity). */
+static uint64_t unshare(struct superblock *sb, const uint64_t dir,
+        const uint64_t child) {
+    uint64_t copy;
+    if (getRefs(sb, child) == 0) return child;
+    copy = copyEntity(sb, child, dir);
+    if (copy == 0) return 0;
+    replaceInDir(sb, dir, child, copy, NULL);
+    decRef(sb, child);
+    return copy;
+}
+
+/* unshares the entities on the path to =fname, and =fname itself if
+ * =includeLast.  Returns zero, or -1 with errno set (ENOSPC, EMLINK) when
+ * one cannot be copied; the ones before it stay unshared. */
+int unsharePath(struct superblock *sb, const char *fname, int includeLast) {
+    int len = 0, it, ret = 0;
+    char **fileParts;
+    uint64_t dir = sb->root, child;
+
+    if (sb->refmap == 0) return 0;
+    fileParts = getFileParts(fname, &len);
+    for (it = 1; it < (includeLast ? len : len - 1); it++) {
+        child = findInDir(sb, dir, fileParts[it]);
+        if (child == 0) break;
+        dir = unshare(sb, dir, child);
+        if (dir == 0) {
+            ret = -1;
+            break;
+        }
+    }
+    freeFileParts(&fileParts, len);
+    return ret;
+}
+
+static int validSnapshotName(const struct superblock *sb, const char *name) {
+    if (name[0] == '\0' || strchr(name, '/') != NULL) {
+        errno = EINVAL;
+        return FALSE;
+    }
+    if (strlen(name) > getFileNameMaxLen(sb)) {
+        errno = ENAMETOOLONG;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static int createSnapshotDir(struct superblock *sb) {
+    struct inode *dir = calloc(1, sb->blksz);
+    struct nodeinfo *info = calloc(1, sb->blksz);
+
+    if (sb->freeblks < 2) {
+        free(dir);
+        free(info);
+        errno = ENOSPC;
+        return -1;
+    }
+    sb->snapshots = getBlock(sb, FS_BLK_META);
+    dir->mode = IMDIR;
+    dir->parent = sb->snapshots;
+    dir->meta = getBlock(sb, FS_BLK_META);
+    strcpy(info->name, SNAPSHOTS_NAME);
+    seek_write(sb, dir->meta, info);
+    seek_write(sb, sb->snapshots, dir);
+    writeSuper(sb);
+    free(dir);
+    free(info);
+    return 0;
+}
+
+static int takeSnapshot(struct superblock *sb, const char *name) {
+    struct inode *dir;
+    struct nodeinfo *info;
+    uint64_t snap;
+
+    if (!checkWritable(sb) || !validSnapshotName(sb, name)) return -1;
+    if (sb->refmap == 0 && createRefmap(sb) != 0) return -1;
+    if (sb->snapshots == 0 && createSnapshotDir(sb) != 0) return -1;
+    if (findInDir(sb, sb->snapshots, name) != 0) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    dir = malloc(sb->blksz);
+    info = malloc(sb->blksz);
+    seek_read(sb, sb->snapshots, dir);
+    seek_read(sb, dir->meta, info);
+    if (info->size >= MAX_REFS) {
+        free(dir);
+        free(info);
+        errno = EMLINK;
+        return -1;
+    }
+
+    snap = copyEntity(sb, sb->root, sb->snapshots);
+    if (snap == 0) {
+        free(dir);
+        free(info);
+        return -1;
+    }
+    seek_read(sb, snap, dir);
+    seek_read(sb, dir->meta, info);
+    strcpy(info->name, name);
+    insertInBlock(sb, sb->snapshots, snap, info);
+    seek_write(sb, dir->meta, info);
+
+    free(dir);
+    free(info);
+    return 0;
+}
+
+static int deleteSnapshot(struct superblock *sb, const char *name) {
+    struct blocklist blocks, data;
+    uint64_t snap;
+
+    if (!checkWritable(sb)) return -1;
+    snap = sb->snapshots ? findInDir(sb, sb->snapshots, name) : 0;
+    if (snap == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    initBlockList(&blocks);
+    initBlockList(&data);
+    removeFromDir(sb, sb->snapshots, snap, &blocks);
+    collectBlocks(sb, snap, &blocks, &data);
+    if (sb->features & FS_FEAT_DEDUP) dedupForget(sb, data.v, data.n);
+    putBlocks(sb, blocks.v, blocks.n);
+    freeBlockList(&blocks);
+    freeBlockList(&data);
+    return 0;
+}
+
+int fs_snapshot(struct superblock *sb, const char *name) {
+    uint64_t t0 = opBegin(sb, FS_OP_SNAPSHOT);
+    int r = takeSnapshot(sb, name);
+    opEnd(sb, FS_OP_SNAPSHOT, t0);
+    return opStatus(r);
+}
+
+int fs_snapshot_delete(struct superblock *sb, const char *name) {
+    uint64_t t0 = opBegin(sb, FS_OP_SNAPSHOT_DELETE);
+    int r = deleteSnapshot(sb, name);
+    opEnd(sb, FS_OP_SNAPSHOT_DELETE, t0);
+    return opStatus(r);
+}
+
+static struct superblock * openSnapshot(struct superblock *sb,
+        const char *name) {
+    struct superblock *view;
+    uint64_t snap;
+
+    snap = sb->snapshots ? findInDir(sb, sb->snapshots, name) : 0;
+    if (snap == 0) {
+        errno = ENOENT;
+        return NULL;
+    }
+    view = malloc(sb->blksz);
+    memcpy(view, sb, sb->blksz);
+    view->root = snap;
+    view->flags = FS_RDONLY | FS_VIEW;
+    return view;
+}
+
+struct superblock * fs_snapshot_open(struct superblock *sb, const char *name) {
+    uint64_t t0 = opBegin(sb, FS_OP_SNAPSHOT_OPEN);
+    struct superblock *view = openSnapshot(sb, name);
+    opEnd(sb, FS_OP_SNAPSHOT_OPEN, t0);
+    if (view != NULL && opFailed()) {
+        free(view);
+        errno = EIO;
+        return NULL;
+    }
+    return view;
+}
+
+static struct fs_dirent * listSnapshots(struct superblock *sb,
+        size_t *count) {
+    if (sb->snapshots == 0) {
+        *count = 0;
+        return calloc(1, sizeof (struct fs_dirent));
+    }
+    return getDirEntries(sb, sb->snapshots, count);
+}
+
+struct fs_dirent * fs_snapshot_list(struct superblock *sb, size_t *count) {
+    uint64_t t0 = opBegin(sb, FS_OP_SNAPSHOT_LIST);
+    struct fs_dirent *r = listSnapshots(sb, count);
+    opEnd(sb, FS_OP_SNAPSHOT_LIST, t0);
+    if (r != NULL && opFailed()) {
+        fs_free_dirents(r, *count);
+        errno = EIO;
+        return NULL;
+    }
+    return r;
+}
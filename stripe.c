@@ -0,0 +1,300 @@
+/*
+ * File:   stripe.c
+ *
+ * Striping of the block address space over several image files
+ * (FS_FEAT_STRIPED).  Block b is in stripe unit u = b / =stripeUnit and
+ * lives on image u % =stripes, at block (u / =stripes) * =stripeUnit +
+ * b % =stripeUnit of it, so image 0 starts with the superblock and a run
+ * of blocks covers every image a unit at a time.  The blocks a run has on
+ * one image are consecutive there, so a transfer becomes at most one
+ * preadv or pwritev per image.  Each image has an I/O thread serving a
+ * queue of such transfers: the caller queues all of its parts but one,
+ * does that one itself and then waits for the others.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "fs.h"
+#include "utils.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* the part of a transfer on one image */
+struct stripeJob {
+    int isWrite;
+    int fd;
+    struct iovec* iov;
+    int iovcnt;
+    off_t off;
+    ssize_t done; /* bytes transferred */
+    struct stripeWait* wait;
+    struct stripeJob* next;
+};
+
+/* the parts of a transfer still queued or running */
+struct stripeWait {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending;
+};
+
+struct stripeDev {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct stripeJob *head, *tail;
+    int stop;
+    int started;
+};
+
+static void runJob(struct stripeJob* job) {
+    ssize_t r, want;
+    int i, k, n;
+
+    job->done = 0;
+    for (i = 0; i < job->iovcnt; i += n) {
+        n = MIN(job->iovcnt - i, IOV_MAX);
+        for (want = 0, k = 0; k < n; k++) want += job->iov[i + k].iov_len;
+        r = job->isWrite ?
+                pwritev(job->fd, job->iov + i, n, job->off + job->done) :
+                preadv(job->fd, job->iov + i, n, job->off + job->done);
+        if (r > 0) job->done += r;
+        if (r != want) break;
+    }
+}
+
+static void *devThread(void* arg) {
+    struct stripeDev* dev = arg;
+    struct stripeJob* job;
+    struct stripeWait* wait;
+
+    pthread_mutex_lock(&dev->lock);
+    for (;;) {
+        while (dev->head == NULL && !dev->stop) {
+            pthread_cond_wait(&dev->cond, &dev->lock);
+        }
+        if ((job = dev->head) == NULL) break;
+        dev->head = job->next;
+        if (dev->head == NULL) dev->tail = NULL;
+        pthread_mutex_unlock(&dev->lock);
+
+        runJob(job);
+        wait = job->wait;
+        pthread_mutex_lock(&wait->lock);
+        if (--wait->pending == 0) pthread_cond_signal(&wait->cond);
+        pthread_mutex_unlock(&wait->lock);
+
+        pthread_mutex_lock(&dev->lock);
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return NULL;
+}
+
+static void queueJob(struct stripeDev* dev, struct stripeJob* job) {
+    job->next = NULL;
+    pthread_mutex_lock(&dev->lock);
+    if (dev->tail != NULL) {
+        dev->tail->next = job;
+    } else {
+        dev->head = job;
+    }
+    dev->tail = job;
+    pthread_cond_signal(&dev->cond);
+    pthread_mutex_unlock(&dev->lock);
+}
+
+/* image holding block =b */
+static int stripeOf(const struct superblock* sb, const uint64_t b) {
+    return (b / sb->stripeUnit) % sb->stripes;
+}
+
+/* block of its image holding block =b */
+static uint64_t stripeBlock(const struct superblock* sb, const uint64_t b) {
+    uint64_t unit = sb->stripeUnit;
+    return b / unit / sb->stripes * unit + b % unit;
+}
+
+/**
+ * Takes over the =n image files open at =fds, the first being the one at
+ * =fd, and starts an I/O thread for each if there are several.
+ * @return zero, or -1 if a thread could not be started
+ */
+int stripeAttach(const struct superblock* sb, const int* fds, int n) {
+    struct fs_state* st = sb->state;
+    int i;
+
+    st->fds = malloc(n * sizeof (int));
+    memcpy(st->fds, fds, n * sizeof (int));
+    st->ndevs = n;
+    if (n == 1) return 0;
+    st->devs = calloc(n, sizeof (struct stripeDev));
+    FOR_EACH(i, n) {
+        pthread_mutex_init(&st->devs[i].lock, NULL);
+        pthread_cond_init(&st->devs[i].cond, NULL);
+        if (pthread_create(&st->devs[i].thread, NULL, devThread,
+                &st->devs[i]) != 0) {
+            pthread_mutex_destroy(&st->devs[i].lock);
+            pthread_cond_destroy(&st->devs[i].cond);
+            return -1; /* stripeDetach stops the ones started */
+        }
+        st->devs[i].started = TRUE;
+    }
+    return 0;
+}
+
+/* stops the I/O threads and closes every image but the first.  threads are
+ * started in order, so the ones after the first not started were never set
+ * up */
+void stripeDetach(struct fs_state* state) {
+    int i;
+
+    if (state->devs != NULL) {
+        FOR_EACH(i, state->ndevs) {
+            struct stripeDev* dev = &state->devs[i];
+            if (!dev->started) break;
+            pthread_mutex_lock(&dev->lock);
+            dev->stop = TRUE;
+            pthread_cond_signal(&dev->cond);
+            pthread_mutex_unlock(&dev->lock);
+            pthread_join(dev->thread, NULL);
+            pthread_mutex_destroy(&dev->lock);
+            pthread_cond_destroy(&dev->cond);
+        }
+    }
+    for (i = 1; i < state->ndevs; i++) close(state->fds[i]);
+    free(state->devs);
+    free(state->fds);
+    state->devs = NULL;
+    state->fds = NULL;
+    state->ndevs = 0;
+}
+
+/* transfers =count blocks from =b, one per iovec in =iov */
+ssize_t stripeIOV(const struct superblock* sb, int isWrite,
+        const struct iovec* iov, uint64_t count, uint64_t b) {
+    struct fs_state* st = sb->state;
+    struct stripeJob* jobs = calloc(st->ndevs, sizeof (struct stripeJob));
+    struct iovec* vecs = malloc(count * sizeof (struct iovec)), *v;
+    uint64_t* start = calloc(st->ndevs, sizeof (uint64_t));
+    struct stripeWait wait;
+    struct stripeJob* last = NULL;
+    uint64_t i;
+    ssize_t done = 0;
+    int d;
+
+    /* each image's iovecs go in their own slice of =vecs, merged where
+     * the buffers are adjacent */
+    FOR_EACH(i, count) {
+        d = stripeOf(sb, b + i);
+        if (jobs[d].iovcnt++ == 0) {
+            jobs[d].off = blockOffset(sb, stripeBlock(sb, b + i));
+        }
+    }
+    for (d = 1; d < st->ndevs; d++) {
+        start[d] = start[d - 1] + jobs[d - 1].iovcnt;
+    }
+    FOR_EACH(d, st->ndevs) {
+        jobs[d].iov = vecs + start[d];
+        jobs[d].iovcnt = 0;
+    }
+    FOR_EACH(i, count) {
+        d = stripeOf(sb, b + i);
+        v = jobs[d].iov + jobs[d].iovcnt;
+        if (jobs[d].iovcnt > 0 &&
+                (char*) v[-1].iov_base + v[-1].iov_len == iov[i].iov_base) {
+            v[-1].iov_len += iov[i].iov_len;
+        } else {
+            *v = iov[i];
+            jobs[d].iovcnt++;
+        }
+    }
+
+    pthread_mutex_init(&wait.lock, NULL);
+    pthread_cond_init(&wait.cond, NULL);
+    wait.pending = 0;
+    FOR_EACH(d, st->ndevs) {
+        if (jobs[d].iovcnt == 0) continue;
+        jobs[d].isWrite = isWrite;
+        jobs[d].fd = st->fds[d];
+        jobs[d].wait = &wait;
+        if (last != NULL) {
+            pthread_mutex_lock(&wait.lock);
+            wait.pending++;
+            pthread_mutex_unlock(&wait.lock);
+            queueJob(&st->devs[last - jobs], last);
+        }
+        last = &jobs[d];
+    }
+    if (last != NULL) runJob(last);
+    pthread_mutex_lock(&wait.lock);
+    while (wait.pending > 0) pthread_cond_wait(&wait.cond, &wait.lock);
+    pthread_mutex_unlock(&wait.lock);
+    pthread_mutex_destroy(&wait.lock);
+    pthread_cond_destroy(&wait.cond);
+
+    FOR_EACH(d, st->ndevs) done += jobs[d].done;
+    free(start);
+    free(vecs);
+    free(jobs);
+    return done;
+}
+
+/* pread or pwrite of =len bytes at block =b of a striped filesystem */
+ssize_t stripeIO(const struct superblock* sb, int isWrite, void* n,
+        size_t len, uint64_t b) {
+    uint64_t i, count = (len + sb->blksz - 1) / sb->blksz;
+    int fd = sb->state->fds[stripeOf(sb, b)];
+    off_t off = blockOffset(sb, stripeBlock(sb, b));
+    struct iovec* iov;
+    ssize_t r;
+
+    if (b % sb->stripeUnit + count <= sb->stripeUnit) {
+        /* within one unit, as single blocks always are */
+        return isWrite ? pwrite(fd, n, len, off) : pread(fd, n, len, off);
+    }
+    iov = malloc(count * sizeof (struct iovec));
+    FOR_EACH(i, count) {
+        iov[i].iov_base = (char*) n + i * sb->blksz;
+        iov[i].iov_len = MIN(sb->blksz, len - i * sb->blksz);
+    }
+    r = stripeIOV(sb, isWrite, iov, count, b);
+    free(iov);
+    return r;
+}
+
+/* blocks of the first =blks of the filesystem stored on image =d */
+static uint64_t stripeBlocks(const struct superblock* sb, int d,
+        const uint64_t blks) {
+    uint64_t unit = sb->stripeUnit, span, rem;
+    if (sb->state->ndevs <= 1) return blks;
+    span = unit * sb->stripes;
+    rem = blks % span;
+    return blks / span * unit +
+            (rem > d * unit ? MIN(unit, rem - d * unit) : 0);
+}
+
+/**
+ * Sizes every image for a filesystem of =blks blocks, only extending the
+ * ones that are too short unless =exact.
+ * @return zero, or -1 with errno set by ftruncate
+ */
+int resizeImage(const struct superblock* sb, const uint64_t blks, int exact) {
+    struct fs_state* st = sb->state;
+    uint64_t size;
+    int d;
+
+    FOR_EACH(d, st->ndevs) {
+        size = stripeBlocks(sb, d, blks) * sb->blksz;
+        if ((exact || getFileSize(st->fds[d]) < size) &&
+                ftruncate(st->fds[d], size) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * File:   trace.c
+ *
+ * Event tracing.  Events go into a ring buffer whose slots are claimed
+ * with an atomic increment of =head, so any number of threads record
+ * without taking a lock; when the buffer wraps the oldest events are
+ * overwritten.  The instrumented points use the TRACE macro, which only
+ * calls in here while a buffer is installed in sb->state->trace.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "fs.h"
+#include "utils.h"
+
+struct fs_trace {
+    uint64_t mask; /* capacity - 1, capacity being a power of two */
+    uint64_t head; /* events recorded so far (atomic) */
+    struct fs_trace* retired; /* smaller buffers this one replaced */
+    struct fs_trace_event ev[];
+};
+
+static __thread uint32_t traceTid;
+
+void traceRecord(const struct superblock* sb, int type, int arg,
+        uint64_t block, uint64_t count) {
+    struct fs_trace* t = __atomic_load_n(&sb->state->trace, __ATOMIC_ACQUIRE);
+    struct fs_trace_event* e;
+    struct timespec ts;
+
+    if (t == NULL) return;
+    if (traceTid == 0) traceTid = (uint32_t) syscall(SYS_gettid);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    e = &t->ev[__atomic_fetch_add(&t->head, 1, __ATOMIC_RELAXED) & t->mask];
+    e->ts_ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    e->block = block;
+    e->count = (uint32_t) count;
+    e->tid = traceTid;
+    e->type = (uint16_t) type;
+    e->arg = (uint16_t) arg;
+    e->pad = 0;
+}
+
+void freeTrace(struct fs_state* state) {
+    struct fs_trace* t = state->traceBuf, *next;
+    state->trace = NULL;
+    for (; t != NULL; t = next) {
+        next = t->retired;
+        free(t);
+    }
+    state->traceBuf = NULL;
+}
+
+/* a thread that loaded sb->state->trace before tracing stopped may still be
+ * writing to that buffer, so a buffer is never freed before fs_close: a
+ * restart reuses it, or keeps it on the =retired chain of a larger one */
+int fs_trace_start(struct superblock *sb, size_t nevents) {
+    struct fs_trace *t = sb->state->traceBuf;
+    size_t cap = 1;
+
+    if (nevents == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    while (cap < nevents) cap <<= 1;
+    fs_trace_stop(sb);
+    if (t != NULL && t->mask + 1 >= cap) {
+        __atomic_store_n(&t->head, 0, __ATOMIC_RELAXED);
+    } else {
+        t = calloc(1, sizeof (struct fs_trace) +
+                cap * sizeof (struct fs_trace_event));
+        if (t == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        t->mask = cap - 1;
+        t->retired = sb->state->traceBuf;
+        sb->state->traceBuf = t;
+    }
+    __atomic_store_n(&sb->state->trace, t, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void fs_trace_stop(struct superblock *sb) {
+    __atomic_store_n(&sb->state->trace, NULL, __ATOMIC_RELEASE);
+}
+
+int fs_trace_save(const struct superblock *sb, const char *path) {
+    struct fs_trace *t = sb->state->traceBuf;
+    struct fs_trace_header hdr;
+    uint64_t i, head, n;
+    FILE *f;
+
+    if (t == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    f = fopen(path, "wb");
+    if (f == NULL) return -1;
+    head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+    n = head > t->mask + 1 ? t->mask + 1 : head;
+    memset(&hdr, 0, sizeof (hdr));
+    memcpy(hdr.magic, FS_TRACE_MAGIC, sizeof (hdr.magic));
+    hdr.version = FS_TRACE_VERSION;
+    hdr.evsize = sizeof (struct fs_trace_event);
+    hdr.count = n;
+    hdr.dropped = head - n;
+    fwrite(&hdr, sizeof (hdr), 1, f);
+    for (i = head - n; i < head; i++) {
+        fwrite(&t->ev[i & t->mask], sizeof (struct fs_trace_event), 1, f);
+    }
+    if (fclose(f) != 0) return -1;
+    return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * File:   tracedump.c
+ *
+ * Converts a trace saved by fs_trace_save into the Chrome trace event JSON
+ * format, which chrome://tracing and ui.perfetto.dev both load.  API calls
+ * become duration slices on the thread that made them; block I/O and
+ * allocator calls become instant events inside those slices carrying the
+ * block range and block class.
+ *
+ * usage: tracedump.exe trace.bin [out.json]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fs.h"
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static const char *opNames[] = {
+    "fs_write_file", "fs_read_file", "fs_delete_file", "fs_mkdir",
+    "fs_rmdir", "fs_remove_tree", "fs_rename", "fs_list_dir", "fs_walk",
+    "fs_snapshot", "fs_grow", "fs_defrag", "fs_shrink",
+    "fs_open (preload)", "fs_snapshot_delete", "fs_snapshot_open",
+    "fs_open", "fs_close", "fs_get_block", "fs_put_block", "fs_put_blocks",
+    "fs_fsck", "fs_snapshot_list"
+};
+
+static const char *blkNames[] = {"super", "meta", "data", "free"};
+
+static const char *evNames[] = {
+    "begin", "end", "read", "write", "alloc", "free"
+};
+
+static const char *lookup(const char **names, size_t n, unsigned i) {
+    return i < n ? names[i] : "?";
+}
+
+static void dumpEvent(FILE *out, const struct fs_trace_event *e,
+        uint64_t t0, int first) {
+    double us = (e->ts_ns - t0) / 1e3;
+
+    fprintf(out, "%s\n{\"pid\":1,\"tid\":%u,\"ts\":%.3f,", first ? "" : ",",
+            e->tid, us);
+    switch (e->type) {
+        case FS_TR_BEGIN:
+        case FS_TR_END:
+            fprintf(out, "\"ph\":\"%s\",\"cat\":\"api\",\"name\":\"%s\"}",
+                    e->type == FS_TR_BEGIN ? "B" : "E",
+                    lookup(opNames, NELEMS(opNames), e->arg));
+            break;
+        case FS_TR_READ:
+        case FS_TR_WRITE:
+            fprintf(out, "\"ph\":\"i\",\"s\":\"t\",\"cat\":\"io\","
+                    "\"name\":\"%s %s\",\"args\":{\"block\":%llu,"
+                    "\"count\":%u}}", lookup(evNames, NELEMS(evNames), e->type),
+                    lookup(blkNames, NELEMS(blkNames), e->arg),
+                    (unsigned long long) e->block, e->count);
+            break;
+        default:
+            fprintf(out, "\"ph\":\"i\",\"s\":\"t\",\"cat\":\"alloc\","
+                    "\"name\":\"%s\",\"args\":{\"block\":%llu,\"count\":%u}}",
+                    lookup(evNames, NELEMS(evNames), e->type),
+                    (unsigned long long) e->block, e->count);
+    }
+}
+
+int main(int argc, char **argv) {
+    struct fs_trace_header hdr;
+    struct fs_trace_event e;
+    FILE *in, *out = stdout;
+    uint64_t i, t0 = 0;
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s trace.bin [out.json]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    in = fopen(argv[1], "rb");
+    if (in == NULL) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    if (fread(&hdr, sizeof (hdr), 1, in) != 1 ||
+            memcmp(hdr.magic, FS_TRACE_MAGIC, sizeof (hdr.magic)) != 0 ||
+            hdr.version != FS_TRACE_VERSION ||
+            hdr.evsize != sizeof (struct fs_trace_event)) {
+        fprintf(stderr, "%s: not a trace file\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    if (argc == 3 && (out = fopen(argv[2], "w")) == NULL) {
+        perror(argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"otherData\":"
+            "{\"dropped\":%llu},\"traceEvents\":[",
+            (unsigned long long) hdr.dropped);
+    for (i = 0; i < hdr.count && fread(&e, sizeof (e), 1, in) == 1; i++) {
+        if (i == 0) t0 = e.ts_ns;
+        dumpEvent(out, &e, t0, i == 0);
+    }
+    fprintf(out, "\n]}\n");
+    fclose(in);
+    if (out != stdout) fclose(out);
+    if (i != hdr.count) {
+        fprintf(stderr, "%s: truncated after %llu events\n", argv[1],
+                (unsigned long long) i);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
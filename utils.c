@@ -1,18 +1,395 @@
+#define _GNU_SOURCE /* O_DIRECT, statx */
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include "utils.h"
 #include "fs.h"
 #include "StringProc.h"
+#include "crc32c.h"
 
-void seek_write(const struct superblock* sb, const uint64_t to, void * n) {
+#ifndef IOV_MAX
+#define IOV_MAX 1024 /* Linux's UIO_MAXIOV */
+#endif
+/* blocks in one bounce buffer of the O_DIRECT pool */
+#define BOUNCE_BLOCKS 64
+#define DIRECT_ALIGN 512 /* when the kernel cannot tell */
+
+static __thread int ioFailed; /* set when the current call hit an I/O error */
+
+static void ioError(const struct superblock* sb) {
+    ioFailed = TRUE;
+    statsCount(sb, &sb->state->stats.io_errors, 1);
+}
+
+/* true if a block read since the last opBegin on this thread was short or
+ * failed its checksum */
+int opFailed(void) {
+    return ioFailed;
+}
+
+/* marks the current call as having hit an I/O error, one that another
+ * thread hit on its behalf */
+void opFail(void) {
+    ioFailed = TRUE;
+}
+
+/* the result of a call that returned =r: -1 with errno set to EIO instead
+ * if it hit an I/O error, which may also be what made it fail */
+ssize_t opStatus(ssize_t r) {
+    if (ioFailed) {
+        errno = EIO;
+        return -1;
+    }
+    return r;
+}
+
+int getCsumLen(const struct superblock* sb) {
+    return (sb->features & FS_FEAT_META_CSUM) ? sizeof (uint32_t) : 0;
+}
+
+static uint32_t blockCsum(const struct superblock* sb, const void* n) {
+    return crc32c(0, n, sb->blksz - sizeof (uint32_t));
+}
+
+/* stores the checksum of a metadata block in its last four bytes */
+void setBlockCsum(const struct superblock* sb, void* n) {
+    uint32_t crc = blockCsum(sb, n);
+    memcpy((char*) n + sb->blksz - sizeof (uint32_t), &crc, sizeof (crc));
+}
+
+int checkBlockCsum(const struct superblock* sb, const void* n) {
+    uint32_t crc;
+    memcpy(&crc, (const char*) n + sb->blksz - sizeof (uint32_t), sizeof (crc));
+    return crc == blockCsum(sb, n);
+}
+
+/**
+ * The data checksum table holds one uint32_t per block.  Stores, or with
+ * =check compares, the checksums of the =count data blocks from =first:
+ * block i is at =n + i * blksz or, given =iov, at its i-th buffer.  Each
+ * table block is read, and written back, once for the whole run.  A
+ * mismatch is an I/O error; zero means no checksum yet.
+ */
+static void dataCsums(const struct superblock* sb, const uint64_t first,
+        const uint64_t count, const char* n, const struct iovec* iov,
+        int check) {
+    uint32_t* table = malloc(sb->blksz), crc;
+    uint64_t i = 0, k, per = (sb->blksz - getCsumLen(sb)) / sizeof (uint32_t);
+
+    while (i < count) {
+        uint64_t tblock = sb->csums + (first + i) / per;
+        seek_read(sb, tblock, table);
+        for (k = (first + i) % per; k < per && i < count; k++, i++) {
+            crc = crc32c(0, iov ? iov[i].iov_base : n + i * sb->blksz,
+                    sb->blksz);
+            if (!check) table[k] = crc;
+            else if (table[k] != 0 && table[k] != crc) ioError(sb);
+        }
+        if (!check) seek_write(sb, tblock, table);
+    }
+    free(table);
+}
+
+/* With O_DIRECT the kernel needs buffers aligned in memory.  Blocks come
+ * from plain malloc, so I/O on them goes through aligned bounce buffers of
+ * BOUNCE_BLOCKS blocks, kept in a pool for reuse across calls and
+ * threads. */
+static char* takeBounce(const struct superblock* sb) {
+    struct fs_state* st = sb->state;
+    void* p = NULL;
+    pthread_mutex_lock(&st->poolLock);
+    if (st->npool > 0) p = st->pool[--st->npool];
+    pthread_mutex_unlock(&st->poolLock);
+    if (p == NULL &&
+            posix_memalign(&p, st->memAlign, BOUNCE_BLOCKS * sb->blksz) != 0) {
+        return NULL;
+    }
+    return p;
+}
+
+static void giveBounce(const struct superblock* sb, char* p) {
+    struct fs_state* st = sb->state;
+    pthread_mutex_lock(&st->poolLock);
+    if (st->npool == st->cappool) {
+        st->cappool = st->cappool ? st->cappool * 2 : 4;
+        st->pool = realloc(st->pool, st->cappool * sizeof (void*));
+    }
+    st->pool[st->npool++] = p;
+    pthread_mutex_unlock(&st->poolLock);
+}
+
+/* pread or pwrite of =len bytes at block =b, on the image holding it */
+static ssize_t rawIO(const struct superblock* sb, int isWrite, void* n,
+        size_t len, uint64_t b) {
+    if (sb->state->ndevs > 1) return stripeIO(sb, isWrite, n, len, b);
+    return isWrite ? pwrite(sb->fd, n, len, blockOffset(sb, b)) :
+            pread(sb->fd, n, len, blockOffset(sb, b));
+}
+
+/* pread or pwrite of =len bytes at block =b, bounced if O_DIRECT needs an
+ * aligned buffer; returns the bytes transferred */
+ssize_t blockIO(const struct superblock* sb, int isWrite, void* n,
+        size_t len, uint64_t b) {
+    struct fs_state* st = sb->state;
+    size_t done, chunk;
+    ssize_t r = 0;
+    char* bounce;
+
+    if (!isWrite && st->map != NULL) {
+        off_t off = blockOffset(sb, b);
+        if ((size_t) off >= st->mapLen) return 0;
+        len = MIN(len, st->mapLen - off);
+        memcpy(n, st->map + off, len);
+        return len;
+    }
+    if (!st->direct || ((uintptr_t) n & (st->memAlign - 1)) == 0) {
+        return rawIO(sb, isWrite, n, len, b);
+    }
+    if ((bounce = takeBounce(sb)) == NULL) return -1;
+    for (done = 0; done < len; done += chunk) {
+        chunk = MIN(len - done, BOUNCE_BLOCKS * sb->blksz);
+        if (isWrite) memcpy(bounce, (char*) n + done, chunk);
+        r = rawIO(sb, isWrite, bounce, chunk, b + done / sb->blksz);
+        if (!isWrite && r > 0) memcpy((char*) n + done, bounce, r);
+        if (r != (ssize_t) chunk) {
+            if (r > 0) done += r;
+            break;
+        }
+    }
+    giveBounce(sb, bounce);
+    return done;
+}
+
+void freeBouncePool(struct fs_state* state) {
+    while (state->npool > 0) free(state->pool[--state->npool]);
+    free(state->pool);
+    state->pool = NULL;
+    state->cappool = 0;
+}
+
+/* maps the image of a shared read-only open, so that the processes reading
+ * it copy blocks out of the same page cache pages instead of each issuing a
+ * pread per block.  reads fall back to pread if the mapping fails. */
+void mapImage(const struct superblock* sb) {
+    struct stat st;
+    void* map;
+
+    if (sb->state->ndevs > 1) return;
+    if (fstat(sb->fd, &st) != 0 || st.st_size == 0) return;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, sb->fd, 0);
+    if (map == MAP_FAILED) return;
+    sb->state->map = map;
+    sb->state->mapLen = st.st_size;
+}
+
+void unmapImage(struct fs_state* state) {
+    if (state->map != NULL) munmap((void*) state->map, state->mapLen);
+    state->map = NULL;
+    state->mapLen = 0;
+}
+
+int fs_set_direct_io(struct superblock* sb, int on) {
+    struct fs_state* st = sb->state;
+    size_t memAlign = DIRECT_ALIGN, offAlign = DIRECT_ALIGN;
+    int i, fl;
+
+    if (sb->flags & FS_VIEW) {
+        errno = EINVAL;
+        return -1;
+    }
+#ifdef STATX_DIOALIGN
+    struct statx sx;
+    if (statx(sb->fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &sx) == 0 &&
+            (sx.stx_mask & STATX_DIOALIGN) && sx.stx_dio_mem_align != 0) {
+        memAlign = sx.stx_dio_mem_align;
+        offAlign = sx.stx_dio_offset_align;
+    }
+#endif
+    memAlign = MAX(memAlign, sizeof (void*));
+    /* every transfer is whole blocks at block offsets */
+    if (on && sb->blksz % offAlign != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    FOR_EACH(i, st->ndevs) {
+        fl = fcntl(st->fds[i], F_GETFL);
+        if (fl == -1 || fcntl(st->fds[i], F_SETFL,
+                on ? fl | O_DIRECT : fl & ~O_DIRECT) == -1) {
+            return -1;
+        }
+    }
+    st->memAlign = memAlign;
+    st->direct = on != 0;
+    return 0;
+}
+
+/* the tree only changes through metadata writes other than the
+ * superblock's, which make the preloaded namespace stale; calls that fail
+ * before writing any keep it */
+static void metaWritten(const struct superblock* sb, uint64_t to, int kind) {
+    if (kind == FS_BLK_META && to != 0) freeNamespace(sb->state);
+}
+
+/* positioned I/O keeps the block layer safe to use from several threads */
+void seek_write_kind(const struct superblock* sb, const uint64_t to, void * n,
+        int kind) {
+    assert(sb != NULL && n != NULL);
+    metaWritten(sb, to, kind);
+    if (kind != FS_BLK_DATA && (sb->features & FS_FEAT_META_CSUM)) {
+        setBlockCsum(sb, n);
+    }
+    blockIO(sb, TRUE, n, sb->blksz, to);
+    statsIO(sb, to == 0 ? FS_BLK_SUPER : kind, TRUE, 1);
+    TRACE(sb, FS_TR_WRITE, to == 0 ? FS_BLK_SUPER : kind, to, 1);
+    if (kind == FS_BLK_DATA && (sb->features & FS_FEAT_DATA_CSUM)) {
+        dataCsums(sb, to, 1, n, NULL, FALSE);
+    }
+}
+
+void seek_read_kind(const struct superblock* sb, const uint64_t from, void* n,
+        int kind) {
     assert(sb != NULL && n != NULL);
-    lseek((sb)->fd, (to) * (sb)->blksz, SEEK_SET);
-    write((sb)->fd, (n), (sb)->blksz);
+    if (blockIO(sb, FALSE, n, sb->blksz, from) != sb->blksz) {
+        ioError(sb);
+    } else if (kind != FS_BLK_DATA && (sb->features & FS_FEAT_META_CSUM)) {
+        if (!checkBlockCsum(sb, n)) ioError(sb);
+    }
+    statsIO(sb, from == 0 ? FS_BLK_SUPER : kind, FALSE, 1);
+    TRACE(sb, FS_TR_READ, from == 0 ? FS_BLK_SUPER : kind, from, 1);
+    if (kind == FS_BLK_DATA && (sb->features & FS_FEAT_DATA_CSUM)) {
+        dataCsums(sb, from, 1, n, NULL, TRUE);
+    }
+}
+
+void seek_write(const struct superblock* sb, const uint64_t to, void * n) {
+    seek_write_kind(sb, to, n, FS_BLK_META);
 }
 
 void seek_read(const struct superblock* sb, const uint64_t from, void* n) {
+    seek_read_kind(sb, from, n, FS_BLK_META);
+}
+
+/* writes =count consecutive blocks starting at =to from =n in one call */
+void seek_write_blocks(const struct superblock* sb, const uint64_t to,
+        const uint64_t count, void* n, int kind) {
+    uint64_t i;
     assert(sb != NULL && n != NULL);
-    lseek((sb)->fd, (from) * (sb)->blksz, SEEK_SET);
-    read((sb)->fd, (n), sb->blksz);
+    metaWritten(sb, to, kind);
+    if (kind != FS_BLK_DATA && (sb->features & FS_FEAT_META_CSUM)) {
+        FOR_EACH(i, count) setBlockCsum(sb, (char*) n + i * sb->blksz);
+    }
+    blockIO(sb, TRUE, n, count * sb->blksz, to);
+    statsIO(sb, kind, TRUE, count);
+    TRACE(sb, FS_TR_WRITE, kind, to, count);
+    if (kind == FS_BLK_DATA && (sb->features & FS_FEAT_DATA_CSUM)) {
+        dataCsums(sb, to, count, n, NULL, FALSE);
+    }
+}
+
+/* writes =count consecutive data blocks starting at =to from the buffers in
+ * =iov, one block each, with as few calls as IOV_MAX allows */
+void seek_writev_blocks(const struct superblock* sb, const uint64_t to,
+        const uint64_t count, const struct iovec* iov) {
+    uint64_t i, k, n;
+    char* bounce;
+    assert(sb != NULL && iov != NULL);
+    if (!sb->state->direct && sb->state->ndevs > 1) {
+        stripeIOV(sb, TRUE, iov, count, to);
+    } else if (!sb->state->direct) {
+        for (i = 0; i < count; i += n) {
+            n = MIN(count - i, IOV_MAX);
+            pwritev(sb->fd, iov + i, n, blockOffset(sb, to + i));
+        }
+    } else if ((bounce = takeBounce(sb)) != NULL) {
+        /* gathered into aligned buffers instead */
+        for (i = 0; i < count; i += n) {
+            n = MIN(count - i, BOUNCE_BLOCKS);
+            FOR_EACH(k, n) {
+                memcpy(bounce + k * sb->blksz, iov[i + k].iov_base, sb->blksz);
+            }
+            blockIO(sb, TRUE, bounce, n * sb->blksz, to + i);
+        }
+        giveBounce(sb, bounce);
+    }
+    statsIO(sb, FS_BLK_DATA, TRUE, count);
+    TRACE(sb, FS_TR_WRITE, FS_BLK_DATA, to, count);
+    if (sb->features & FS_FEAT_DATA_CSUM) {
+        dataCsums(sb, to, count, NULL, iov, FALSE);
+    }
+}
+
+/* reads =count consecutive blocks starting at =from into =n in one call */
+void seek_read_blocks(const struct superblock* sb, const uint64_t from,
+        const uint64_t count, void* n, int kind) {
+    uint64_t i;
+    assert(sb != NULL && n != NULL);
+    if (blockIO(sb, FALSE, n, count * sb->blksz, from) != count * sb->blksz) {
+        ioError(sb);
+    } else if (kind != FS_BLK_DATA && (sb->features & FS_FEAT_META_CSUM)) {
+        FOR_EACH(i, count) {
+            if (!checkBlockCsum(sb, (char*) n + i * sb->blksz)) ioError(sb);
+        }
+    }
+    statsIO(sb, kind, FALSE, count);
+    TRACE(sb, FS_TR_READ, kind, from, count);
+    if (kind == FS_BLK_DATA && (sb->features & FS_FEAT_DATA_CSUM)) {
+        dataCsums(sb, from, count, n, NULL, TRUE);
+    }
+}
+
+void statsIO(const struct superblock* sb, int kind, int isWrite,
+        uint64_t nblocks) {
+    uint64_t* ctr = isWrite ? sb->state->stats.writes : sb->state->stats.reads;
+    __atomic_add_fetch(&ctr[kind], nblocks, __ATOMIC_RELAXED);
+}
+
+void statsCount(const struct superblock* sb, uint64_t* ctr, uint64_t n) {
+    __atomic_add_fetch(ctr, n, __ATOMIC_RELAXED);
+}
+
+/* CLOCK_MONOTONIC in nanoseconds, as opBegin returns it */
+uint64_t opClock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t opBegin(const struct superblock* sb, int op) {
+    ioFailed = FALSE;
+    TRACE(sb, FS_TR_BEGIN, op, 0, 0);
+    return opClock();
+}
+
+void opEnd(const struct superblock* sb, int op, uint64_t t0) {
+    __atomic_add_fetch(&sb->state->stats.calls[op], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sb->state->stats.latency_ns[op], opClock() - t0,
+            __ATOMIC_RELAXED);
+    TRACE(sb, FS_TR_END, op, 0, 0);
+}
+
+struct fs_state* newState(void) {
+    struct fs_state* state = calloc(1, sizeof (struct fs_state));
+    pthread_mutex_init(&state->poolLock, NULL);
+    return state;
+}
+
+/* caches what the block size determines; called once the superblock is
+ * read or formatted */
+void setGeometry(const struct superblock* sb) {
+    struct fs_state* state = sb->state;
+    state->blkshift = 0;
+    if ((sb->blksz & (sb->blksz - 1)) == 0) {
+        state->blkshift = __builtin_ctzll(sb->blksz);
+    }
+    state->linksMax = (sb->blksz - sizeof (struct inode) - getCsumLen(sb)) /
+            sizeof (uint64_t);
+    state->nameMax = sb->blksz - sizeof (struct nodeinfo) - getCsumLen(sb) - 1;
 }
 
 void cleanNode(struct inode* n) {
@@ -24,32 +401,45 @@ void cleanNode(struct inode* n) {
 }
 
 void initNode(struct inode** n, size_t sz) {
-    *n = (struct inode*) malloc(sz);
+    *n = (struct inode*) calloc(1, sz);
     cleanNode(*n);
 }
 
-int getFileSize(const char* fname) {
-    FILE *fd = fopen(fname, "r");
-    fseek(fd, 0, SEEK_END);
-    int size = ftell(fd);
-    rewind(fd);
-    fclose(fd);
-    return size;
+/* size in bytes of the file open at =fd, or zero if it cannot be found */
+uint64_t getFileSize(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return 0;
+    return (uint64_t) st.st_size;
+}
+
+/* blocks taken by a table holding one =entsz byte entry for each of =blks
+ * blocks; every table block may end with a checksum */
+uint64_t getTableBlocks(const struct superblock* sb, const uint64_t blks,
+        const size_t entsz) {
+    uint64_t per = (sb->blksz - getCsumLen(sb)) / entsz;
+    return (blks + per - 1) / per;
 }
 
 int getLinksMaxLen(const struct superblock* sb) {
-    int ans = (sb->blksz - sizeof (struct inode)) / sizeof (uint64_t);
-    return ans;
+    return sb->state->linksMax;
 }
 
 int getFileNameMaxLen(const struct superblock* sb) {
-    int ans = sb->blksz - sizeof (struct nodeinfo);
-    return ans - 1;
+    return sb->state->nameMax;
 }
 
-int getLinksLen(const struct inode* node) {
-    int len = 0;
-    while (node->links[len] != 0)len++;
+/* the first word is zero and the block equals itself shifted by a word,
+ * which leaves the scan to memcmp's vectorized loop */
+int isZeroBlock(const struct superblock* sb, const void* n) {
+    const char* p = n;
+    uint64_t w;
+    memcpy(&w, p, sizeof (w));
+    return w == 0 && memcmp(p, p + sizeof (w), sb->blksz - sizeof (w)) == 0;
+}
+
+int getLinksLen(const struct superblock* sb, const struct inode* node) {
+    int len = 0, max = getLinksMaxLen(sb);
+    while (len < max && node->links[len] != 0)len++;
     return len;
 }
 
@@ -66,61 +456,310 @@ uint64_t getNodeLastLinkBlock(const struct superblock* sb, uint64_t nodeBlock) {
     return ans;
 }
 
+/**
+ * Looks for an entry called name inside the directory whose head inode is
+ * dirBlock, following the directory's link chain.
+ * @param sb the superblock
+ * @param dirBlock head inode of the directory to search
+ * @param name entry name (a single path component)
+ * @return the block of the entry's inode, or zero with errno set to ENOENT
+ * if there is no such entry, or to ENOTDIR if dirBlock is not a directory
+ */
+uint64_t findInDir(const struct superblock* sb, const uint64_t dirBlock,
+        const char* name) {
+    struct inode* node, *ent;
+    struct nodeinfo* meta;
+    const struct fs_ns* ns = nsOf(sb);
+    uint64_t ans = 0, mode;
+    int i, maxLinks = getLinksMaxLen(sb);
+
+    statsCount(sb, &sb->state->stats.lookup_components, 1);
+    if (ns != NULL && (mode = nsMode(ns, dirBlock)) != 0) {
+        ans = mode == IMDIR ? nsLookup(ns, dirBlock, name) : 0;
+        if (ans == 0) errno = mode == IMDIR ? ENOENT : ENOTDIR;
+        return ans;
+    }
+    initNode(&node, sb->blksz);
+    seek_read(sb, dirBlock, node);
+    if (node->mode != IMDIR) {
+        free(node);
+        errno = ENOTDIR;
+        return 0;
+    }
+    meta = (struct nodeinfo*) malloc(sb->blksz);
+    initNode(&ent, sb->blksz);
+    for (;;) {
+        for (i = 0; i < maxLinks && node->links[i] != 0; i++) {
+            seek_read(sb, node->links[i], ent);
+            seek_read(sb, ent->meta, meta);
+            if (strcmp(meta->name, name) == 0) {
+                ans = node->links[i];
+                break;
+            }
+        }
+        if (ans != 0 || node->next == 0)break;
+        seek_read(sb, node->next, node);
+    }
+    free(node);
+    free(ent);
+    free(meta);
+    if (ans == 0) errno = ENOENT;
+    return ans;
+}
+
+/* deepest entity of =fname that exists.  if that is not all of it, errno is
+ * ENOENT, or ENOTDIR if the lookup reached an entity that is not a
+ * directory */
 uint64_t findFile(const struct superblock* sb, const char* fname, int* exists) {
     assert(exists != NULL);
-    struct inode* node, *ent;
 
     if (strcmp("/", fname) == 0) {
         *exists = TRUE;
         return sb->root;
     }
 
-    initNode(&node, sb->blksz);
-    initNode(&ent, sb->blksz);
-    struct nodeinfo *meta = (struct nodeinfo*) malloc(sb->blksz);
     int len = 0;
     char** fileParts = getFileParts(fname, &len);
 
     *exists = FALSE;
     uint64_t fileBlock = sb->root;
-    seek_read(sb, fileBlock, node);
     int it = 1;
     while (it < len) {
-        int foundEnt = FALSE;
-        int i = 0;
-        do {
-            while (node->links[i] != 0) {
-                seek_read(sb, node->links[i], ent);
-                seek_read(sb, ent->meta, meta);
-                if (strcmp(meta->name, fileParts[it]) == 0) {
-                    foundEnt = TRUE;
-                    fileBlock = node->links[i];
-                    it++;
-                    break;
-                }
-                i++;
-            }
-            if ((foundEnt || node->next == 0))break;
-            seek_read(sb, node->next, node);
-        } while (node->next != 0);
-        if (foundEnt) {
-            seek_read(sb, fileBlock, node);
-        } else {
-            *exists = FALSE;
-            free(node);
-            free(ent);
-            free(meta);
-            freeFileParts(&fileParts, len);
-            return fileBlock;
-        }
+        uint64_t entBlock = findInDir(sb, fileBlock, fileParts[it]);
+        if (entBlock == 0)break;
+        fileBlock = entBlock;
+        it++;
     }
 
     if (it >= len) *exists = TRUE;
     freeFileParts(&fileParts, len);
+    return fileBlock;
+}
+
+/**
+ * Resolves every component of fname but the last one.
+ * @param sb the superblock
+ * @param fname path of the entity
+ * @param exists set to TRUE if the whole parent path was found; if not,
+ * errno is ENOENT, or ENOTDIR if a component is not a directory
+ * @return the block of the parent directory's inode
+ */
+uint64_t findParent(const struct superblock* sb, const char* fname,
+        int* exists) {
+    int len = 0, it = 1;
+    char** fileParts = getFileParts(fname, &len);
+    uint64_t dirBlock = sb->root;
+
+    *exists = TRUE;
+    while (it < len - 1) {
+        dirBlock = findInDir(sb, dirBlock, fileParts[it]);
+        if (dirBlock == 0) {
+            *exists = FALSE;
+            dirBlock = sb->root;
+            break;
+        }
+        it++;
+    }
+    freeFileParts(&fileParts, len);
+    return dirBlock;
+}
+
+/* reads the block a hint names.  a stale hint may name a block that now
+ * holds data or is free, which is no I/O error, so the block is read raw.
+ * @return FALSE if it cannot be a metadata block */
+static int readHint(const struct superblock* sb, const uint64_t block,
+        void* n) {
+    if (block == 0 || block >= sb->blks ||
+            blockIO(sb, FALSE, n, sb->blksz, block) != sb->blksz) {
+        return FALSE;
+    }
+    statsIO(sb, FS_BLK_META, FALSE, 1);
+    TRACE(sb, FS_TR_READ, FS_BLK_META, block, 1);
+    return !(sb->features & FS_FEAT_META_CSUM) || checkBlockCsum(sb, n);
+}
+
+/* true if =node, read from =block, holds links of the directory =dirBlock */
+static int isLinkBlock(const struct inode* node, const uint64_t block,
+        const uint64_t dirBlock) {
+    if (block == dirBlock) return node->mode == IMDIR;
+    return node->mode == (IMCHILD | IMDIR) && node->parent == dirBlock;
+}
+
+/* links used in =node, the last link block of a directory of =size
+ * entries.  the head holds up to linksMax - 1 links and the other blocks
+ * linksMax, all of them full but the last, so the count follows from the
+ * size; the links are counted if they disagree. */
+static int lastLinksLen(const struct superblock* sb, const struct inode* node,
+        const uint64_t size) {
+    int max = getLinksMaxLen(sb);
+    int n = size < max ? size : size % max + 1;
+    if ((n > 0 && node->links[n - 1] == 0) ||
+            (n < max && node->links[n] != 0)) {
+        return getLinksLen(sb, node);
+    }
+    return n;
+}
+
+/**
+ * Reads the last link block of the directory =dirBlock into =node, through
+ * the tail hint in its nodeinfo =meta when it holds and else by walking the
+ * chain.  The hint in =meta is refreshed; the caller writes =meta back.
+ * @return the last link block
+ */
+static uint64_t readLastLink(const struct superblock* sb,
+        const uint64_t dirBlock, struct nodeinfo* meta, struct inode* node) {
+    uint64_t b = meta->reserved[2];
+
+    if (readHint(sb, b, node) && isLinkBlock(node, b, dirBlock) &&
+            node->next == 0) {
+        return b;
+    }
+    b = dirBlock;
+    seek_read(sb, b, node);
+    while (node->next != 0) {
+        b = node->next;
+        seek_read(sb, b, node);
+    }
+    meta->reserved[2] = b;
+    return b;
+}
+
+/* records in the nodeinfo of =child that its link is =slot of link block
+ * =at: in =info when the caller writes it next, else on disk */
+static void setLinkHint(const struct superblock* sb, const uint64_t child,
+        const uint64_t at, const int slot, struct nodeinfo* info) {
+    struct inode* node;
+
+    if (info != NULL) {
+        info->reserved[3] = at;
+        info->reserved[4] = slot;
+        return;
+    }
+    node = malloc(sb->blksz);
+    info = malloc(sb->blksz);
+    seek_read(sb, child, node);
+    seek_read(sb, node->meta, info);
+    if (info->reserved[3] != at || info->reserved[4] != slot) {
+        info->reserved[3] = at;
+        info->reserved[4] = slot;
+        seek_write(sb, node->meta, info);
+    }
+    free(node);
+    free(info);
+}
+
+/**
+ * Finds the link to =child in the directory =dirBlock, through the hint in
+ * the child's nodeinfo when it holds and else by scanning the chain.
+ * @param node receives the link block
+ * @param slot receives the index of the link in it
+ * @return the link block, or zero if =child is not in the directory
+ */
+static uint64_t findLink(const struct superblock* sb, const uint64_t dirBlock,
+        const uint64_t child, struct inode* node, int* slot) {
+    struct nodeinfo* info = malloc(sb->blksz);
+    uint64_t at, cur;
+    int i, maxLinks = getLinksMaxLen(sb);
+
+    seek_read(sb, child, node);
+    seek_read(sb, node->meta, info);
+    at = info->reserved[3];
+    i = info->reserved[4] < maxLinks ? (int) info->reserved[4] : 0;
+    free(info);
+    if (readHint(sb, at, node) && isLinkBlock(node, at, dirBlock) &&
+            node->links[i] == child) {
+        *slot = i;
+        return at;
+    }
+    for (cur = dirBlock; cur != 0; cur = node->next) {
+        seek_read(sb, cur, node);
+        for (i = 0; i < maxLinks && node->links[i] != 0; i++) {
+            if (node->links[i] == child) {
+                *slot = i;
+                return cur;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Replaces the link to =oldChild in directory =dirBlock by =newChild with a
+ * single block write.
+ * @param newInfo nodeinfo of =newChild that the caller writes afterwards,
+ * or NULL to update the one on disk
+ * @return zero on success, -1 if =oldChild is not in the directory
+ */
+int replaceInDir(struct superblock* sb, const uint64_t dirBlock,
+        const uint64_t oldChild, const uint64_t newChild,
+        struct nodeinfo* newInfo) {
+    struct inode* node = malloc(sb->blksz);
+    uint64_t at;
+    int slot;
+
+    at = findLink(sb, dirBlock, oldChild, node, &slot);
+    if (at == 0) {
+        free(node);
+        return -1;
+    }
+    node->links[slot] = newChild;
+    seek_write(sb, at, node);
+    setLinkHint(sb, newChild, at, slot, newInfo);
+    free(node);
+    return 0;
+}
+
+/**
+ * Reads every entry of the directory whose head inode is dirBlock in a
+ * single pass over its link chain.  Each child's inode and nodeinfo are
+ * read exactly once.
+ * @param sb the superblock
+ * @param dirBlock head inode of the directory
+ * @param count receives the number of entries returned
+ * @return array of entries, to be released with fs_free_dirents
+ */
+struct fs_dirent* getDirEntries(const struct superblock* sb,
+        const uint64_t dirBlock, size_t* count) {
+    struct inode* node, *ent;
+    struct nodeinfo* meta;
+    struct fs_dirent* ents = NULL;
+    size_t n = 0, cap;
+    int i, maxLinks = getLinksMaxLen(sb);
+
+    /* the snapshot directory is outside the tree the namespace holds */
+    if (nsOf(sb) != NULL && nsMode(nsOf(sb), dirBlock) == IMDIR) {
+        return nsEntries(nsOf(sb), dirBlock, count);
+    }
+    meta = (struct nodeinfo*) malloc(sb->blksz);
+    initNode(&node, sb->blksz);
+    initNode(&ent, sb->blksz);
+    seek_read(sb, dirBlock, node);
+    seek_read(sb, node->meta, meta);
+    cap = MAX(meta->size, 1);
+    ents = (struct fs_dirent*) malloc(cap * sizeof (struct fs_dirent));
+    for (;;) {
+        for (i = 0; i < maxLinks && node->links[i] != 0; i++) {
+            seek_read(sb, node->links[i], ent);
+            seek_read(sb, ent->meta, meta);
+            if (n == cap) {
+                cap *= 2;
+                ents = (struct fs_dirent*) realloc(ents,
+                        cap * sizeof (struct fs_dirent));
+            }
+            ents[n].block = node->links[i];
+            ents[n].mode = ent->mode;
+            ents[n].size = meta->size;
+            ents[n].name = strdup(meta->name);
+            n++;
+        }
+        if (node->next == 0)break;
+        seek_read(sb, node->next, node);
+    }
     free(node);
     free(ent);
     free(meta);
-    return fileBlock;
+    *count = n;
+    return ents;
 }
 
 int existsFile(const struct superblock* sb, const char* fname) {
@@ -156,13 +795,13 @@ int InsertInNode(struct superblock* sb, const char* dirName,
         if (lastLinkNode->next != 0) {
             exit(EXIT_FAILURE);
         }
-        lastLinkNode->next = fs_get_block(sb);
+        lastLinkNode->next = getBlock(sb, FS_BLK_META);
         seek_write(sb, lastLinkNode->next, linknode);
         seek_write(sb, lastLinkBlock, lastLinkNode);
         free(linknode);
         free(lastLinkNode);
     } else {
-        int linkLen = getLinksLen(dirNode);
+        int linkLen = getLinksLen(sb, dirNode);
         dirNode->links[linkLen] = fileBlock;
         dirNode->links[linkLen + 1] = 0;
     }
@@ -181,43 +820,334 @@ int InsertInNode(struct superblock* sb, const char* dirName,
  * @param sb the superblock
  * @param destBlock block to receive block2Add as a child
  * @param block2Add block to be added in the children of destBlock
- * @return as of now you can ignore this
+ * @param childInfo nodeinfo of block2Add that the caller writes afterwards,
+ * or NULL to update the one on disk
+ * @return FALSE, with errno set to ENOSPC, if the directory needs a new
+ * link block and none is left; nothing is changed then
  */
 int insertInBlock(struct superblock* sb, const uint64_t destBlock,
-        const uint64_t block2Add) {
+        const uint64_t block2Add, struct nodeinfo* childInfo) {
     struct inode *dirNode = NULL;
     struct nodeinfo* meta = NULL;
     dirNode = malloc(sb->blksz);
     meta = malloc(sb->blksz);
     seek_read(sb, destBlock, dirNode);
     seek_read(sb, dirNode->meta, meta);
+    uint64_t lastLinkBlock = destBlock;
+    struct inode* lastLinkNode = dirNode;
+    if (dirNode->next != 0) {
+        lastLinkNode = malloc(sb->blksz);
+        lastLinkBlock = readLastLink(sb, destBlock, meta, lastLinkNode);
+    }
     if ((++meta->size) % getLinksMaxLen(sb) == 0) {
         //needs to create another link block      
+        uint64_t linkBlock = getBlock(sb, FS_BLK_META);
+        if (linkBlock == 0) {
+            if (lastLinkNode != dirNode) free(lastLinkNode);
+            free(dirNode);
+            free(meta);
+            return FALSE;
+        }
         struct inode* linknode = NULL;
-        linknode = malloc(sb->blksz);
+        linknode = calloc(1, sb->blksz);
+        linknode->mode = IMCHILD | IMDIR;
+        linknode->parent = destBlock;
+        linknode->meta = lastLinkBlock;
         linknode->links[0] = block2Add;
         linknode->links[1] = 0;
-        uint64_t lastLinkBlock = getNodeLastLinkBlock(sb, destBlock);
-        struct inode* lastLinkNode = NULL;
-        lastLinkNode = malloc(sb->blksz);
-        seek_read(sb, lastLinkBlock, lastLinkNode);
         if (lastLinkNode->next != 0) {
             exit(EXIT_FAILURE);
         }
-        lastLinkNode->next = fs_get_block(sb);
+        lastLinkNode->next = linkBlock;
         seek_write(sb, lastLinkNode->next, linknode);
-        seek_write(sb, lastLinkBlock, lastLinkNode);
+        setLinkHint(sb, block2Add, lastLinkNode->next, 0, childInfo);
+        meta->reserved[2] = lastLinkNode->next;
         free(linknode);
-        free(lastLinkNode);
     } else {
-        int linkLen = getLinksLen(dirNode);
-        dirNode->links[linkLen] = block2Add;
-        dirNode->links[linkLen + 1] = 0;
+        int linkLen = lastLinksLen(sb, lastLinkNode, meta->size - 1);
+        lastLinkNode->links[linkLen] = block2Add;
+        if (linkLen + 1 < getLinksMaxLen(sb)) {
+            lastLinkNode->links[linkLen + 1] = 0;
+        }
+        setLinkHint(sb, block2Add, lastLinkBlock, linkLen, childInfo);
+        meta->reserved[2] = lastLinkBlock;
     }
-    seek_write(sb, destBlock, dirNode);
+    seek_write(sb, lastLinkBlock, lastLinkNode);
     seek_write(sb, dirNode->meta, meta);
+    if (lastLinkNode != dirNode) {
+        free(lastLinkNode);
+    }
 
     free(dirNode);
     free(meta);
     return TRUE;
 }
+
+void initBlockList(struct blocklist* l) {
+    l->v = NULL;
+    l->n = 0;
+    l->cap = 0;
+}
+
+void pushBlock(struct blocklist* l, const uint64_t block) {
+    if (l->n == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 64;
+        l->v = (uint64_t*) realloc(l->v, l->cap * sizeof (uint64_t));
+    }
+    l->v[l->n++] = block;
+}
+
+void freeBlockList(struct blocklist* l) {
+    free(l->v);
+    initBlockList(l);
+}
+
+/**
+ * Appends to =list every block owned by the entity whose first inode is
+ * =block: its inodes, nodeinfo and data blocks and, for directories, the
+ * link blocks and everything below them.
+ * @param sb the superblock
+ * @param block first inode of the entity
+ * @param list receives the blocks
+ * @param data if not NULL, also receives the data blocks among them
+ */
+void collectBlocks(const struct superblock* sb, const uint64_t block,
+        struct blocklist* list, struct blocklist* data) {
+    struct inode* node;
+    uint64_t cur = block, prev = 0;
+    int i, maxLinks = getLinksMaxLen(sb);
+
+    /* an entity still referenced from a snapshot only loses a reference */
+    if (sb->refmap != 0 && decRef(sb, block)) return;
+    node = malloc(sb->blksz);
+    while (cur != 0) {
+        seek_read(sb, cur, node);
+        pushBlock(list, cur);
+        /* first inodes own their nodeinfo; for IMCHILD inodes =meta points
+         * back to the previous inode (older images kept a nodeinfo copy) */
+        if (!(node->mode & IMCHILD) || node->meta != prev) {
+            pushBlock(list, node->meta);
+        }
+        for (i = 0; i < maxLinks && node->links[i] != 0; i++) {
+            if (node->mode & IMDIR) {
+                collectBlocks(sb, node->links[i], list, data);
+            } else if (node->links[i] == FS_HOLE) {
+                continue;
+            } else if (sb->refmap == 0 || !decRef(sb, node->links[i])) {
+                pushBlock(list, node->links[i]);
+                if (data != NULL) pushBlock(data, node->links[i]);
+            }
+        }
+        prev = cur;
+        cur = node->next;
+    }
+    free(node);
+}
+
+/**
+ * Removes =childBlock from the links of the directory =dirBlock.  The last
+ * link of the directory is moved into the freed slot so every link block
+ * but the last stays full; a link block left empty is unchained and
+ * appended to =freed.  The link and the last link block are found through
+ * the hints in the nodeinfos, so this reads the same few blocks whatever
+ * the size of the directory.
+ * @param sb the superblock
+ * @param dirBlock head inode of the directory
+ * @param childBlock entry to remove
+ * @param freed receives link blocks that are no longer used
+ * @return zero on success, -1 if =childBlock is not in the directory
+ */
+int removeFromDir(struct superblock* sb, const uint64_t dirBlock,
+        const uint64_t childBlock, struct blocklist* freed) {
+    struct inode* node = malloc(sb->blksz), *found = malloc(sb->blksz);
+    struct nodeinfo* meta = malloc(sb->blksz);
+    uint64_t foundBlock, lastBlock = dirBlock, beforeLast, metaBlock, moved;
+    int foundIdx, lastIdx;
+
+    foundBlock = findLink(sb, dirBlock, childBlock, found, &foundIdx);
+    if (foundBlock == 0) {
+        free(node);
+        free(found);
+        free(meta);
+        return -1;
+    }
+    seek_read(sb, dirBlock, node);
+    metaBlock = node->meta;
+    seek_read(sb, metaBlock, meta);
+    if (node->next != 0) lastBlock = readLastLink(sb, dirBlock, meta, node);
+
+    /* =node holds the last link block */
+    lastIdx = lastLinksLen(sb, node, meta->size) - 1;
+    moved = node->links[lastIdx];
+    node->links[lastIdx] = 0;
+    if (foundBlock == lastBlock) {
+        if (foundIdx != lastIdx) node->links[foundIdx] = moved;
+    } else {
+        found->links[foundIdx] = moved;
+        seek_write(sb, foundBlock, found);
+    }
+    if (foundBlock != lastBlock || foundIdx != lastIdx) {
+        setLinkHint(sb, moved, foundBlock, foundIdx, NULL);
+    }
+    if (lastIdx == 0 && lastBlock != dirBlock) {
+        /* the last link block is now empty; its =meta names the one
+         * before it */
+        beforeLast = node->meta;
+        if (!readHint(sb, beforeLast, found) ||
+                !isLinkBlock(found, beforeLast, dirBlock) ||
+                found->next != lastBlock) {
+            beforeLast = dirBlock;
+            seek_read(sb, beforeLast, found);
+            while (found->next != lastBlock && found->next != 0) {
+                beforeLast = found->next;
+                seek_read(sb, beforeLast, found);
+            }
+        }
+        found->next = 0;
+        seek_write(sb, beforeLast, found);
+        pushBlock(freed, lastBlock);
+        meta->reserved[2] = beforeLast;
+    } else {
+        seek_write(sb, lastBlock, node);
+        meta->reserved[2] = lastBlock;
+    }
+
+    meta->size--;
+    seek_write(sb, metaBlock, meta);
+
+    free(node);
+    free(found);
+    free(meta);
+    return 0;
+}
+
+/* fails with EROFS on read-only superblocks such as snapshot views */
+int checkWritable(const struct superblock* sb) {
+    if (sb->flags & FS_RDONLY) {
+        errno = EROFS;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* removes =block from the middle of the free list */
+void unlinkFree(struct superblock* sb, const uint64_t block) {
+    struct freepage* fp = malloc(sb->blksz), *other = malloc(sb->blksz);
+    uint64_t next, prev;
+
+    seek_read_kind(sb, block, fp, FS_BLK_FREE);
+    next = fp->next;
+    prev = fp->links[0];
+    if (block == sb->freelist) {
+        sb->freelist = next;
+        prev = 0;
+    } else {
+        seek_read_kind(sb, prev, other, FS_BLK_FREE);
+        other->next = next;
+        seek_write_kind(sb, prev, other, FS_BLK_FREE);
+    }
+    if (next != 0) {
+        seek_read_kind(sb, next, other, FS_BLK_FREE);
+        other->count = (prev != 0);
+        other->links[0] = prev;
+        seek_write_kind(sb, next, other, FS_BLK_FREE);
+    }
+    sb->freeblks--;
+    free(fp);
+    free(other);
+}
+
+/* map of free space, one byte per block set for the blocks on the free
+ * list and in the tail */
+uint8_t* getFreeMap(const struct superblock* sb) {
+    struct freepage* fp = malloc(sb->blksz);
+    uint8_t* isFree = calloc(sb->blks, 1);
+    uint64_t b, n;
+
+    for (b = sb->freelist, n = 0; b != 0 && n < sb->freeblks; n++) {
+        isFree[b] = 1;
+        seek_read_kind(sb, b, fp, FS_BLK_FREE);
+        b = fp->next;
+    }
+    for (b = sb->tail; b < sb->blks; b++) isFree[b] = 1;
+    free(fp);
+    return isFree;
+}
+
+/**
+ * Finds the lowest run of =count adjacent free blocks lying below =limit.
+ * @param sb the superblock
+ * @param isFree map of free space (see getFreeMap)
+ * @param count length of the run
+ * @param limit first block the run may not include
+ * @return the first block of the run, or zero if there is no such run
+ */
+uint64_t findFreeRun(const struct superblock* sb, const uint8_t* isFree,
+        const uint64_t count, const uint64_t limit) {
+    uint64_t b, start = 0, run = 0;
+
+    for (b = 1; b < limit && b < sb->blks && run < count; b++) {
+        if (!isFree[b]) {
+            run = 0;
+        } else if (run++ == 0) {
+            start = b;
+        }
+    }
+    return (run < count || count == 0) ? 0 : start;
+}
+
+/* takes the run of =count free blocks at =start out of free space */
+void takeRun(struct superblock* sb, const uint64_t start,
+        const uint64_t count) {
+    uint64_t b;
+
+    /* the run may extend from the free list into the tail */
+    for (b = start; b < start + count && b < sb->tail; b++) {
+        unlinkFree(sb, b);
+    }
+    if (start + count > sb->tail) {
+        sb->freeblks -= start + count - sb->tail;
+        sb->tail = start + count;
+    }
+    writeSuper(sb);
+    statsCount(sb, &sb->state->stats.allocs, count);
+    TRACE(sb, FS_TR_ALLOC, 0, start, count);
+}
+
+/**
+ * Takes a run of =count adjacent free blocks out of free space: the start
+ * of the never used tail when it is long enough, else the first run of
+ * adjacent pages on the free list, which fs_put_blocks chains in ascending
+ * order, going on into the tail if it ends where the tail starts.  Nothing
+ * proportional to the size of the image is read or allocated.
+ * @param sb the superblock
+ * @param count length of the run
+ * @return the first block of the run, or zero if there is no such run
+ */
+uint64_t takeFreeRun(struct superblock* sb, const uint64_t count) {
+    struct freepage* fp;
+    uint64_t b, start, run = 0, n = 0;
+    int found;
+
+    if (count == 0) return 0;
+    releaseExtents(sb);
+    start = sb->tail;
+    found = sb->blks - sb->tail >= count;
+    fp = malloc(sb->blksz);
+    for (b = sb->freelist; !found && b != 0 && n < sb->freeblks; n++) {
+        if (run == 0 || b != start + run) {
+            start = b;
+            run = 0;
+        }
+        run++;
+        found = run >= count || (start + run == sb->tail &&
+                run + sb->blks - sb->tail >= count);
+        if (found) break;
+        seek_read_kind(sb, b, fp, FS_BLK_FREE);
+        b = fp->next;
+    }
+    free(fp);
+    if (!found) return 0;
+    takeRun(sb, start, count);
+    return start;
+}
@@ -16,41 +16,209 @@ extern "C" {
 #include <stdio.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include "fs.h"
 
 #define FALSE 0
 #define TRUE 1
 #define FOR_EACH(i, n) for((i) = 0; (i) < (n); (i)++)
-#define MAX(a, b) ((a) > (b))? a : b
-#define MIN(a, b) ((a) < (b))? a : b
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+    struct fs_trace;
+
+    /* in-memory state attached to an open superblock */
+    /* blocks set aside for one kind of block, from the head of the free
+     * list or the never used tail: =next to =end are counted as free in
+     * memory but are in neither the tail nor the free list */
+    struct fs_extent {
+        uint64_t next, end;
+    };
+
+    struct fs_state {
+        struct fs_stats stats;
+        struct fs_trace* trace; /* ring buffer being recorded, or NULL */
+        struct fs_trace* traceBuf; /* last ring buffer, kept for saving */
+        uint64_t defragCursor; /* entities fs_defrag's pass went through */
+        /* log2 of the block size, or zero for images formatted before
+         * block sizes had to be powers of two */
+        int blkshift;
+        int linksMax; /* getLinksMaxLen */
+        int nameMax; /* getFileNameMaxLen */
+        int direct; /* the image is open with O_DIRECT */
+        size_t memAlign; /* buffer alignment O_DIRECT needs */
+        pthread_mutex_t poolLock; /* protects the bounce buffer pool */
+        void** pool; /* free bounce buffers */
+        size_t npool, cappool;
+        /* the image mapped read-only (FS_OPEN_SHARED), or NULL */
+        const char* map;
+        size_t mapLen;
+        int ndevs; /* image files, more than one if striped */
+        int* fds; /* their descriptors, the first being =fd */
+        struct stripeDev* devs; /* their I/O threads, if striped */
+        struct fs_extent extent[2]; /* metadata and data, see getBlock */
+        struct fs_ns* ns; /* namespace read by FS_OPEN_PRELOAD, or NULL */
+    };
+
+    struct fs_state* newState(void);
+    void freeBouncePool(struct fs_state* state);
+    void mapImage(const struct superblock* sb);
+    void unmapImage(struct fs_state* state);
+    void setGeometry(const struct superblock* sb);
+
+    /* byte offset of block =b in the image */
+    static inline off_t blockOffset(const struct superblock* sb,
+            const uint64_t b) {
+        int shift = sb->state->blkshift;
+        return shift ? (off_t) (b << shift) : (off_t) (b * sb->blksz);
+    }
 
     void seek_write(const struct superblock* sb, const uint64_t to, void * n);
 
     void seek_read(const struct superblock* sb, const uint64_t from, void* n);
 
+    void seek_write_kind(const struct superblock* sb, const uint64_t to,
+            void * n, int kind);
+    void seek_read_kind(const struct superblock* sb, const uint64_t from,
+            void* n, int kind);
+    void seek_write_blocks(const struct superblock* sb, const uint64_t to,
+            const uint64_t count, void* n, int kind);
+    void seek_read_blocks(const struct superblock* sb, const uint64_t from,
+            const uint64_t count, void* n, int kind);
+    ssize_t blockIO(const struct superblock* sb, int isWrite, void* n,
+            size_t len, uint64_t b);
+    struct iovec;
+    void seek_writev_blocks(const struct superblock* sb, const uint64_t to,
+            const uint64_t count, const struct iovec* iov);
+
+    int opFailed(void);
+    void opFail(void);
+    ssize_t opStatus(ssize_t r);
+    int getCsumLen(const struct superblock* sb);
+    void setBlockCsum(const struct superblock* sb, void* n);
+    int checkBlockCsum(const struct superblock* sb, const void* n);
+
+    void statsIO(const struct superblock* sb, int kind, int isWrite,
+            uint64_t nblocks);
+    void statsCount(const struct superblock* sb, uint64_t* ctr, uint64_t n);
+    uint64_t opClock(void);
+    uint64_t opBegin(const struct superblock* sb, int op);
+    void opEnd(const struct superblock* sb, int op, uint64_t t0);
+
+    /* trace.c */
+    void traceRecord(const struct superblock* sb, int type, int arg,
+            uint64_t block, uint64_t count);
+    void freeTrace(struct fs_state* state);
+
+    /* records a trace event; a single predicted branch when tracing is off */
+#define TRACE(sb, type, arg, block, count) do { \
+        if (__builtin_expect((sb)->state->trace != NULL, 0)) \
+            traceRecord((sb), (type), (arg), (block), (count)); \
+    } while (0)
+
+    /* growable array of block numbers */
+    struct blocklist {
+        uint64_t* v;
+        size_t n, cap;
+    };
+
+    void initBlockList(struct blocklist* l);
+    void pushBlock(struct blocklist* l, const uint64_t block);
+    void freeBlockList(struct blocklist* l);
+
     void cleanNode(struct inode* n);
     void initNode(struct inode** n, size_t sz);
 
-    int getFileSize(const char* fname);
+    /* fs.c */
+    uint64_t getBlock(struct superblock* sb, int kind);
+    int putBlocks(struct superblock* sb, uint64_t* blocks, size_t count);
+    void releaseExtents(struct superblock* sb);
+    void writeSuper(struct superblock* sb);
+
+    uint64_t getFileSize(int fd);
+    uint64_t getTableBlocks(const struct superblock* sb, const uint64_t blks,
+            const size_t entsz);
 
     uint64_t findFile(const struct superblock* sb, const char* fname, int* exists);
+    uint64_t findParent(const struct superblock* sb, const char* fname,
+            int* exists);
+    uint64_t findInDir(const struct superblock* sb, const uint64_t dirBlock,
+            const char* name);
+    struct fs_dirent* getDirEntries(const struct superblock* sb,
+            const uint64_t dirBlock, size_t* count);
 
     int getLinksMaxLen(const struct superblock* sb);
     int getFileNameMaxLen(const struct superblock* sb);
 
     uint64_t getNodeLastLinkBlock(const struct superblock* sb, uint64_t linkBlock);
 
-    int getLinksLen(const struct inode* node);
+    int getLinksLen(const struct superblock* sb, const struct inode* node);
+    int isZeroBlock(const struct superblock* sb, const void* n);
 
     int insertBlock2NodeLinks(struct superblock* sb, const char* dirName,
             const uint64_t fileBlock);
     int insertInBlockLinks(struct superblock* sb, const uint64_t dirBlock,
             const uint64_t fileBlock);
     int insertInBlock(struct superblock* sb, const uint64_t destBlock,
-            const uint64_t insertionBlock);
+            const uint64_t insertionBlock, struct nodeinfo* childInfo);
 
     int existsFile(const struct superblock* sb, const char* fname);
 
+    void collectBlocks(const struct superblock* sb, const uint64_t block,
+            struct blocklist* list, struct blocklist* data);
+    int removeFromDir(struct superblock* sb, const uint64_t dirBlock,
+            const uint64_t childBlock, struct blocklist* freed);
+    int replaceInDir(struct superblock* sb, const uint64_t dirBlock,
+            const uint64_t oldChild, const uint64_t newChild,
+            struct nodeinfo* newInfo);
+
+    int checkWritable(const struct superblock* sb);
+    uint64_t takeFreeRun(struct superblock* sb, const uint64_t count);
+    uint8_t* getFreeMap(const struct superblock* sb);
+    uint64_t findFreeRun(const struct superblock* sb, const uint8_t* isFree,
+            const uint64_t count, const uint64_t limit);
+    void takeRun(struct superblock* sb, const uint64_t start,
+            const uint64_t count);
+    void unlinkFree(struct superblock* sb, const uint64_t block);
+
+    /* snapshot.c */
+    uint64_t getRefsPerBlock(const struct superblock* sb);
+    int getRefs(const struct superblock* sb, const uint64_t block);
+    int incRef(const struct superblock* sb, const uint64_t block);
+    int decRef(const struct superblock* sb, const uint64_t block);
+    int unsharePath(struct superblock* sb, const char* fname, int includeLast);
+
+    /* dedup.c */
+    uint64_t dedupLookup(const struct superblock* sb, const void* n);
+    void dedupInsert(const struct superblock* sb, const uint64_t block,
+            const void* n);
+    void dedupForget(const struct superblock* sb, const uint64_t* blocks,
+            const size_t count);
+    void dedupReset(const struct superblock* sb);
+
+    /* preload.c */
+    int preloadTree(struct superblock* sb);
+    void freeNamespace(struct fs_state* state);
+    const struct fs_ns* nsOf(const struct superblock* sb);
+    uint64_t nsLookup(const struct fs_ns* ns, const uint64_t dirBlock,
+            const char* name);
+    uint64_t nsMode(const struct fs_ns* ns, const uint64_t block);
+    struct fs_dirent* nsEntries(const struct fs_ns* ns,
+            const uint64_t dirBlock, size_t* count);
+    int nsFile(const struct fs_ns* ns, const uint64_t block, uint64_t* size,
+            uint64_t* flags, uint64_t* stored, const uint64_t** map,
+            uint64_t* nmap);
+
+    /* stripe.c */
+    int stripeAttach(const struct superblock* sb, const int* fds, int n);
+    void stripeDetach(struct fs_state* state);
+    ssize_t stripeIO(const struct superblock* sb, int isWrite, void* n,
+            size_t len, uint64_t b);
+    ssize_t stripeIOV(const struct superblock* sb, int isWrite,
+            const struct iovec* iov, uint64_t count, uint64_t b);
+    int resizeImage(const struct superblock* sb, const uint64_t blks,
+            int exact);
+
 
 
 #ifdef	__cplusplus
@@ -0,0 +1,260 @@
+/*
+ * File:   walk.c
+ *
+ * Parallel breadth-first traversal of a directory tree.  Every worker owns
+ * a deque of pending directories; it takes work from the front of its own
+ * deque (oldest first, so the walk stays breadth-first) and, when that is
+ * empty, steals from the back of another worker's deque.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "fs.h"
+#include "utils.h"
+
+struct walk_item {
+    uint64_t block; /* head inode of the directory */
+    char *path;
+};
+
+struct walk_deque {
+    pthread_mutex_t lock;
+    struct walk_item *items; /* ring buffer of =cap items */
+    size_t head, count, cap;
+};
+
+struct walk_ctx {
+    const struct superblock *sb;
+    fs_walk_fn fn;
+    void *arg;
+    int nthreads;
+    struct walk_deque *deques;
+    pthread_mutex_t lock; /* protects the sleep/wake protocol below */
+    pthread_cond_t cond;
+    size_t queued; /* items sitting in deques (atomic) */
+    size_t pending; /* items queued or being processed (atomic) */
+    int stop;
+    int ret;
+    int ioFailed; /* a worker hit an I/O error (atomic) */
+};
+
+struct walk_worker {
+    struct walk_ctx *ctx;
+    int id;
+};
+
+static void dequePushBack(struct walk_deque *dq, struct walk_item it) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count == dq->cap) {
+        size_t i, cap = dq->cap ? dq->cap * 2 : 64;
+        struct walk_item *items = malloc(cap * sizeof (struct walk_item));
+        for (i = 0; i < dq->count; i++) {
+            items[i] = dq->items[(dq->head + i) % dq->cap];
+        }
+        free(dq->items);
+        dq->items = items;
+        dq->head = 0;
+        dq->cap = cap;
+    }
+    dq->items[(dq->head + dq->count) % dq->cap] = it;
+    dq->count++;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+static int dequePopFront(struct walk_deque *dq, struct walk_item *it) {
+    int ok = FALSE;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        *it = dq->items[dq->head];
+        dq->head = (dq->head + 1) % dq->cap;
+        dq->count--;
+        ok = TRUE;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return ok;
+}
+
+static int dequePopBack(struct walk_deque *dq, struct walk_item *it) {
+    int ok = FALSE;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        dq->count--;
+        *it = dq->items[(dq->head + dq->count) % dq->cap];
+        ok = TRUE;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return ok;
+}
+
+static void walkPush(struct walk_ctx *ctx, int id, uint64_t block, char *path) {
+    struct walk_item it = {block, path};
+    __atomic_add_fetch(&ctx->pending, 1, __ATOMIC_SEQ_CST);
+    dequePushBack(&ctx->deques[id], it);
+    __atomic_add_fetch(&ctx->queued, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&ctx->lock);
+    pthread_cond_signal(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static int walkTake(struct walk_ctx *ctx, int id, struct walk_item *it) {
+    int i;
+    if (dequePopFront(&ctx->deques[id], it)) {
+        __atomic_sub_fetch(&ctx->queued, 1, __ATOMIC_SEQ_CST);
+        return TRUE;
+    }
+    for (i = 1; i < ctx->nthreads; i++) {
+        if (dequePopBack(&ctx->deques[(id + i) % ctx->nthreads], it)) {
+            __atomic_sub_fetch(&ctx->queued, 1, __ATOMIC_SEQ_CST);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static int walkStopped(struct walk_ctx *ctx) {
+    return __atomic_load_n(&ctx->stop, __ATOMIC_RELAXED);
+}
+
+static char *joinPath(const char *dir, const char *name) {
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    int slash = (dlen == 0 || dir[dlen - 1] != '/');
+    char *path = malloc(dlen + slash + nlen + 1);
+    memcpy(path, dir, dlen);
+    if (slash) path[dlen] = '/';
+    memcpy(path + dlen + slash, name, nlen + 1);
+    return path;
+}
+
+static void walkVisit(struct walk_ctx *ctx, int id, struct walk_item *it) {
+    size_t i, count = 0;
+    struct fs_dirent *ents = getDirEntries(ctx->sb, it->block, &count);
+
+    for (i = 0; i < count && !walkStopped(ctx); i++) {
+        char *path = joinPath(it->path, ents[i].name);
+        int r = ctx->fn(path, &ents[i], ctx->arg);
+        if (r == FS_WALK_SKIP) {
+            free(path);
+            continue;
+        }
+        if (r != 0) {
+            pthread_mutex_lock(&ctx->lock);
+            if (!ctx->stop) {
+                ctx->ret = r;
+                __atomic_store_n(&ctx->stop, TRUE, __ATOMIC_RELAXED);
+            }
+            pthread_cond_broadcast(&ctx->cond);
+            pthread_mutex_unlock(&ctx->lock);
+        }
+        if (ents[i].mode == IMDIR && !walkStopped(ctx)) {
+            walkPush(ctx, id, ents[i].block, path);
+        } else {
+            free(path);
+        }
+    }
+    fs_free_dirents(ents, count);
+}
+
+static void *walkWorker(void *p) {
+    struct walk_worker *w = p;
+    struct walk_ctx *ctx = w->ctx;
+    struct walk_item it;
+
+    for (;;) {
+        if (walkTake(ctx, w->id, &it)) {
+            if (!walkStopped(ctx)) {
+                walkVisit(ctx, w->id, &it);
+            }
+            free(it.path);
+            if (__atomic_sub_fetch(&ctx->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+                pthread_mutex_lock(&ctx->lock);
+                pthread_cond_broadcast(&ctx->cond);
+                pthread_mutex_unlock(&ctx->lock);
+            }
+            continue;
+        }
+        pthread_mutex_lock(&ctx->lock);
+        while (__atomic_load_n(&ctx->queued, __ATOMIC_SEQ_CST) == 0 &&
+                __atomic_load_n(&ctx->pending, __ATOMIC_SEQ_CST) > 0) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        pthread_mutex_unlock(&ctx->lock);
+        if (__atomic_load_n(&ctx->pending, __ATOMIC_SEQ_CST) == 0) break;
+    }
+    /* I/O errors are noted per thread: hand them to the caller's */
+    if (opFailed()) __atomic_store_n(&ctx->ioFailed, TRUE, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static int walkTree(struct superblock *sb, const char *root, fs_walk_fn fn,
+        void *arg, int nthreads) {
+    struct walk_ctx ctx;
+    struct walk_worker *workers;
+    pthread_t *threads;
+    struct inode *node;
+    uint64_t rootBlock;
+    int i, found;
+
+    rootBlock = findFile(sb, root, &found);
+    if (!found) {
+        return -1;
+    }
+    node = malloc(sb->blksz);
+    seek_read(sb, rootBlock, node);
+    if (node->mode != IMDIR) {
+        free(node);
+        errno = ENOTDIR;
+        return -1;
+    }
+    free(node);
+
+    if (nthreads < 1) nthreads = 1;
+    memset(&ctx, 0, sizeof (ctx));
+    ctx.sb = sb;
+    ctx.fn = fn;
+    ctx.arg = arg;
+    ctx.nthreads = nthreads;
+    ctx.deques = calloc(nthreads, sizeof (struct walk_deque));
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.cond, NULL);
+    workers = malloc(nthreads * sizeof (struct walk_worker));
+    threads = malloc(nthreads * sizeof (pthread_t));
+    FOR_EACH(i, nthreads) {
+        pthread_mutex_init(&ctx.deques[i].lock, NULL);
+        workers[i].ctx = &ctx;
+        workers[i].id = i;
+    }
+
+    walkPush(&ctx, 0, rootBlock, strdup(root));
+    for (i = 1; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, walkWorker, &workers[i]);
+    }
+    walkWorker(&workers[0]);
+    for (i = 1; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    if (ctx.ioFailed) opFail();
+
+    FOR_EACH(i, nthreads) {
+        struct walk_item it;
+        while (dequePopFront(&ctx.deques[i], &it)) free(it.path);
+        free(ctx.deques[i].items);
+        pthread_mutex_destroy(&ctx.deques[i].lock);
+    }
+    free(ctx.deques);
+    free(workers);
+    free(threads);
+    pthread_mutex_destroy(&ctx.lock);
+    pthread_cond_destroy(&ctx.cond);
+    return ctx.ret;
+}
+
+int fs_walk(struct superblock *sb, const char *root, fs_walk_fn fn, void *arg,
+        int nthreads) {
+    uint64_t t0 = opBegin(sb, FS_OP_WALK);
+    int r = walkTree(sb, root, fn, arg, nthreads);
+    opEnd(sb, FS_OP_WALK, t0);
+    return opStatus(r);
+}